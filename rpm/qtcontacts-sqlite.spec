@@ -10,6 +10,7 @@ BuildRequires: pkgconfig(QtCore)
 BuildRequires: pkgconfig(QtSql)
 BuildRequires: pkgconfig(QtDBus)
 BuildRequires: pkgconfig(QtContacts)
+BuildRequires: pkgconfig(sqlite3)
 
 Provides: qtcontacts-tracker > 4.19.2
 Obsoletes: qtcontacts-tracker <= 4.19.2
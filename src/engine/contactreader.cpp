@@ -73,7 +73,9 @@
 
 #include <QContactManagerEngine>
 
+#include <QDataStream>
 #include <QSqlError>
+#include <QSqlRecord>
 #include <QVector>
 
 #include <QtDebug>
@@ -83,6 +85,7 @@ using namespace Conversion;
 #endif
 
 static const int ReportBatchSize = 50;
+static const int MaximumCachedQueries = 16;
 
 enum FieldType {
     StringField = 0,
@@ -161,7 +164,7 @@ static const FieldInfo favoriteFields[] =
 
 static const FieldInfo statusFlagsFields[] =
 {
-    // No specific field; tests hasPhoneNumber/hasEmailAddress/hasOnlineAccount/isOnline
+    // No specific field; tests hasPhoneNumber/hasEmailAddress/hasOnlineAccount/isOnline/pending aggregation
     { QContactStatusFlags::FieldFlags, "", OtherField }
 };
 
@@ -497,49 +500,54 @@ static int contextType(const QString &type)
 }
 #endif
 
-template <typename T> static void readDetail(
-        quint32 contactId, QContact *contact, QSqlQuery *query, quint32 &currentId)
+template <typename T> static void readDetailRow(QContact *contact, QSqlQuery *query)
 {
-    do {
-        T detail;
+    T detail;
 
-        QString detailUriValue = query->value(0).toString();
-        QString linkedDetailUrisValue = query->value(1).toString();
-        QString contextValue = query->value(2).toString();
-        int accessConstraints = query->value(3).toInt();
+    QString detailUriValue = query->value(0).toString();
+    QString linkedDetailUrisValue = query->value(1).toString();
+    QString contextValue = query->value(2).toString();
+    int accessConstraints = query->value(3).toInt();
 
-        if (!detailUriValue.isEmpty()) {
-            setValue(&detail,
-                     QContactDetail::FieldDetailUri,
-                     detailUriValue);
-        }
-        if (!linkedDetailUrisValue.isEmpty()) {
-            setValue(&detail,
-                     QContactDetail::FieldLinkedDetailUris,
-                     linkedDetailUrisValue.split(QLatin1Char(';'), QString::SkipEmptyParts));
-        }
-        if (!contextValue.isEmpty()) {
+    if (!detailUriValue.isEmpty()) {
+        setValue(&detail,
+                 QContactDetail::FieldDetailUri,
+                 detailUriValue);
+    }
+    if (!linkedDetailUrisValue.isEmpty()) {
+        setValue(&detail,
+                 QContactDetail::FieldLinkedDetailUris,
+                 linkedDetailUrisValue.split(QLatin1Char(';'), QString::SkipEmptyParts));
+    }
+    if (!contextValue.isEmpty()) {
 #ifdef USING_QTPIM
-            QList<int> contexts;
-            foreach (const QString &context, contextValue.split(QLatin1Char(';'), QString::SkipEmptyParts)) {
-                int type = contextType(context);
-                if (type != -1) {
-                    contexts.append(type);
-                }
-            }
-            if (!contexts.isEmpty()) {
-                detail.setContexts(contexts);
+        QList<int> contexts;
+        foreach (const QString &context, contextValue.split(QLatin1Char(';'), QString::SkipEmptyParts)) {
+            int type = contextType(context);
+            if (type != -1) {
+                contexts.append(type);
             }
+        }
+        if (!contexts.isEmpty()) {
+            detail.setContexts(contexts);
+        }
 #else
-            setValue(&detail,
-                     QContactDetail::FieldContext,
-                     contextValue.split(QLatin1Char(';'), QString::SkipEmptyParts));
+        setValue(&detail,
+                 QContactDetail::FieldContext,
+                 contextValue.split(QLatin1Char(';'), QString::SkipEmptyParts));
 #endif
-        }
-        QContactManagerEngine::setDetailAccessConstraints(&detail, static_cast<QContactDetail::AccessConstraints>(accessConstraints));
-        setValues(&detail, query, 6);
+    }
+    QContactManagerEngine::setDetailAccessConstraints(&detail, static_cast<QContactDetail::AccessConstraints>(accessConstraints));
+    setValues(&detail, query, 6);
+
+    contact->saveDetail(&detail);
+}
 
-        contact->saveDetail(&detail);
+template <typename T> static void readDetail(
+        quint32 contactId, QContact *contact, QSqlQuery *query, quint32 &currentId)
+{
+    do {
+        readDetailRow<T>(contact, query);
     } while (query->next() && (currentId = query->value(5).toUInt()) == contactId);
 }
 
@@ -579,6 +587,7 @@ static void readRelationshipTable(
 }
 
 typedef void (*ReadDetail)(quint32 contactId, QContact *contact, QSqlQuery *query, quint32 &currentId);
+typedef void (*ReadDetailRow)(QContact *contact, QSqlQuery *query);
 
 struct DetailInfo
 {
@@ -593,6 +602,7 @@ struct DetailInfo
     const int fieldCount;
     const bool join;
     const ReadDetail read;
+    const ReadDetailRow readRow;
 
     QString where() const
     {
@@ -613,16 +623,16 @@ template <typename T> const QLatin1String detailIdentifier() { return T::Definit
 #define PREFIX_LENGTH 8
 #ifdef USING_QTPIM
 #define DEFINE_DETAIL(Detail, Table, fields, join) \
-    { detailIdentifier<Detail>(), #Detail + PREFIX_LENGTH, #Table, fields, lengthOf(fields), join, readDetail<Detail> }
+    { detailIdentifier<Detail>(), #Detail + PREFIX_LENGTH, #Table, fields, lengthOf(fields), join, readDetail<Detail>, readDetailRow<Detail> }
 
 #define DEFINE_DETAIL_PRIMARY_TABLE(Detail, fields) \
-    { detailIdentifier<Detail>(), #Detail + PREFIX_LENGTH, 0, fields, lengthOf(fields), false, 0 }
+    { detailIdentifier<Detail>(), #Detail + PREFIX_LENGTH, 0, fields, lengthOf(fields), false, 0, 0 }
 #else
 #define DEFINE_DETAIL(Detail, Table, fields, join) \
-    { detailIdentifier<Detail>(), #Table, fields, lengthOf(fields), join, readDetail<Detail> }
+    { detailIdentifier<Detail>(), #Table, fields, lengthOf(fields), join, readDetail<Detail>, readDetailRow<Detail> }
 
 #define DEFINE_DETAIL_PRIMARY_TABLE(Detail, fields) \
-    { detailIdentifier<Detail>(), 0, fields, lengthOf(fields), false, 0 }
+    { detailIdentifier<Detail>(), 0, fields, lengthOf(fields), false, 0, 0 }
 #endif
 
 // Note: join should be true only if there can be only a single row for each contact in that table
@@ -780,14 +790,123 @@ static QString dateString(const DetailInfo &detail, const QDateTime &qdt)
 }
 
 
-static QString buildWhere(const QContactDetailFilter &filter, QVariantList *bindings, bool *failed)
+static const char *searchIndexColumn(const QContactDetailFilter &filter)
+{
+    if (filterOnField<QContactDisplayLabel>(filter, QContactDisplayLabel::FieldLabel))
+        return "displayLabel";
+    if (filterOnField<QContactName>(filter, QContactName::FieldFirstName))
+        return "firstName";
+    if (filterOnField<QContactName>(filter, QContactName::FieldMiddleName))
+        return "middleName";
+    if (filterOnField<QContactName>(filter, QContactName::FieldLastName))
+        return "lastName";
+    if (filterOnField<QContactNickname>(filter, QContactNickname::FieldNickname))
+        return "nickname";
+    if (filterOnField<QContactEmailAddress>(filter, QContactEmailAddress::FieldEmailAddress))
+        return "emailAddress";
+    if (filterOnField<QContactNote>(filter, QContactNote::FieldNote))
+        return "note";
+    if (filterOnField<QContactOrganization>(filter, QContactOrganization::FieldName))
+        return "organization";
+    return 0;
+}
+
+static QString searchIndexPrefixQuery(const QString &value)
+{
+    // Produce an FTS query matching every token of the value, with the final token
+    // matched as a prefix.  The simple tokenizer folds only ASCII case, so any other
+    // value cannot be used to select candidates from the index.
+    QStringList tokens;
+    QString token;
+    for (int i = 0; i < value.size(); ++i) {
+        const QChar c(value.at(i));
+        if (c.unicode() >= 0x80)
+            return QString();
+
+        if (c.isLetterOrNumber()) {
+            token.append(c.toLower());
+        } else if (!token.isEmpty()) {
+            tokens.append(token);
+            token.clear();
+        }
+    }
+    if (!token.isEmpty())
+        tokens.append(token + QLatin1String("*"));
+
+    return tokens.join(QLatin1String(" "));
+}
+
+static QString prefixUpperBound(const QString &prefix)
 {
-    if (filter.matchFlags() & QContactFilter::MatchKeypadCollation) {
+    // Values starting with the prefix sort before the prefix with its final character incremented.
+    // Text is compared by memcmp of its UTF-16 encoding, so callers must still confirm the match
+    // for any value containing characters outside the Latin-1 range.
+    QString upperBound(prefix);
+    upperBound[upperBound.size() - 1] = QChar(upperBound.at(upperBound.size() - 1).unicode() + 1);
+    return upperBound;
+}
+
+static const char *keypadIndexField(const QContactDetailFilter &filter)
+{
+    if (filterOnField<QContactDisplayLabel>(filter, QContactDisplayLabel::FieldLabel))
+        return "displayLabel";
+    if (filterOnField<QContactName>(filter, QContactName::FieldFirstName))
+        return "firstName";
+    if (filterOnField<QContactName>(filter, QContactName::FieldMiddleName))
+        return "middleName";
+    if (filterOnField<QContactName>(filter, QContactName::FieldLastName))
+        return "lastName";
+    if (filterOnField<QContactNickname>(filter, QContactNickname::FieldNickname))
+        return "nickname";
+    return 0;
+}
+
+static QString buildKeypadWhere(const QContactDetailFilter &filter, QVariantList *bindings, bool *failed)
+{
+    const char *field = keypadIndexField(filter);
+    if (!field) {
         *failed = true;
-        qWarning() << "Cannot buildWhere with filter requiring keypad collation";
+        qWarning() << "Cannot buildWhere with keypad collation on field without keypad index";
         return QLatin1String("FAILED");
     }
 
+    // The filter value may be given as keypad digits or as text
+    const QString value(filter.value().toString());
+    const QString keypad(ContactsDatabase::keypadDigits(value));
+    const int globValue = filter.matchFlags() & 7;
+
+    // A value with no keypad representation cannot match any indexed name
+    if (keypad.isEmpty() && !value.isEmpty())
+        return QLatin1String("0");
+
+    QString comparison;
+    if (globValue == QContactFilter::MatchStartsWith && !keypad.isEmpty()) {
+        comparison = QLatin1String("keypad >= ? AND keypad < ?");
+        bindings->append(keypad);
+        bindings->append(prefixUpperBound(keypad));
+    } else if (globValue == QContactFilter::MatchStartsWith) {
+        comparison = QLatin1String("keypad IS NOT NULL");
+    } else if (globValue == QContactFilter::MatchContains) {
+        comparison = QLatin1String("keypad GLOB ?");
+        bindings->append(QLatin1String("*") + keypad + QLatin1String("*"));
+    } else if (globValue == QContactFilter::MatchEndsWith) {
+        comparison = QLatin1String("keypad GLOB ?");
+        bindings->append(QLatin1String("*") + keypad);
+    } else {
+        comparison = QLatin1String("keypad = ?");
+        bindings->append(keypad);
+    }
+
+    return QString::fromLatin1("Contacts.contactId IN (SELECT contactId FROM KeypadIndex WHERE field = '%1' AND %2)")
+            .arg(QLatin1String(field)).arg(comparison);
+}
+
+static QString buildWhere(const QContactDetailFilter &filter, bool searchIndex, QVariantList *bindings, bool *failed)
+{
+    if (filter.matchFlags() & QContactFilter::MatchKeypadCollation) {
+        return buildKeypadWhere(filter, bindings, failed);
+    }
+
     for (int i = 0; i < lengthOf(detailInfo); ++i) {
         const DetailInfo &detail = detailInfo[i];
         if (!matchOnType(filter, detail.detail))
@@ -812,11 +931,13 @@ static QString buildWhere(const QContactDetailFilter &filter, QVariantList *bind
                     static const quint64 flags[] = { QContactStatusFlags::HasPhoneNumber,
                                                  QContactStatusFlags::HasEmailAddress,
                                                  QContactStatusFlags::HasOnlineAccount,
-                                                 QContactStatusFlags::IsOnline };
+                                                 QContactStatusFlags::IsOnline,
+                                                 QContactStatusFlags::IsPendingAggregation };
                     static const char *flagColumns[] = { "hasPhoneNumber",
                                                          "hasEmailAddress",
                                                          "hasOnlineAccount",
-                                                         "isOnline" };
+                                                         "isOnline",
+                                                         "(Contacts.contactId IN (SELECT contactId FROM DeferredAggregates))" };
 
                     quint64 flagsValue = filter.value().value<quint64>();
 
@@ -848,6 +969,7 @@ static QString buildWhere(const QContactDetailFilter &filter, QVariantList *bind
             bool stringField = field.fieldType == StringField;
             bool phoneNumberMatch = filter.matchFlags() & QContactFilter::MatchPhoneNumber;
             bool useNormalizedNumber = false;
+            bool useReversedNumber = false;
             int globValue = filter.matchFlags() & 7;
 
             // TODO: if MatchFixedString is specified but the field type is numeric, we need to
@@ -889,6 +1011,17 @@ static QString buildWhere(const QContactDetailFilter &filter, QVariantList *bind
                         bindValue = bindValue.toLower();
                     }
                     column = QString::fromLatin1("normalizedNumber");
+                } else if (filterOnField<QContactPhoneNumber>(filter, QContactPhoneNumber::FieldNumber) &&
+                           globValue == QContactFilter::MatchEndsWith) {
+                    // A suffix of the number is a prefix of the reversed number, which can be
+                    // found by a range scan of the index on that column
+                    for (int i = stringValue.size() - 1; i >= 0; --i) {
+                        if (stringValue.at(i).isDigit()) {
+                            bindValue.append(stringValue.at(i));
+                        }
+                    }
+                    useReversedNumber = !bindValue.isEmpty();
+                    column = QString::fromLatin1("reversedNumber");
                 } else {
                     // remove any non-digit characters from the column value when we do our comparison: +,-, ,#,(,) are removed.
                     comparison = QLatin1String("replace(replace(replace(replace(replace(replace(%1, '+', ''), '-', ''), '#', ''), '(', ''), ')', ''), ' ', '')");
@@ -917,7 +1050,21 @@ static QString buildWhere(const QContactDetailFilter &filter, QVariantList *bind
 #endif
             }
 
-            if (stringField && (globValue == QContactFilter::MatchStartsWith)) {
+            if (useReversedNumber) {
+                comparison = QLatin1String("%1 >= ? AND %1 < ? AND %1 GLOB ?");
+                bindings->append(bindValue);
+                bindings->append(prefixUpperBound(bindValue));
+                bindings->append(bindValue + QLatin1String("*"));
+            } else if (stringField && (globValue == QContactFilter::MatchStartsWith)) {
+                const char *indexColumn = (searchIndex && !phoneNumberMatch) ? searchIndexColumn(filter) : 0;
+                const QString indexQuery(indexColumn ? searchIndexPrefixQuery(stringValue) : QString());
+                if (!indexQuery.isEmpty()) {
+                    // Restrict the GLOB comparison to the candidates found in the search index
+                    comparison.prepend(QString::fromLatin1("%1.contactId IN (SELECT docid FROM SearchIndex WHERE %2 MATCH ?) AND ")
+                                       .arg(QLatin1String(detail.table ? detail.table : "Contacts"))
+                                       .arg(QLatin1String(indexColumn)));
+                    bindings->append(indexQuery);
+                }
                 bindValue = bindValue + QLatin1String("*");
                 comparison += QLatin1String(" GLOB ?");
                 bindings->append(bindValue);
@@ -1159,17 +1306,23 @@ static QString buildWhere(const QContactChangeLogFilter &filter, QVariantList *b
             return statement.arg(QLatin1String("created"));
         case QContactChangeLogFilter::EventChanged:
             return statement.arg(QLatin1String("modified"));
+        case QContactChangeLogFilter::EventRemoved:
+            // Removed contacts are not in the Contacts table; their ids are reported by
+            // readContactIds from the tombstones, only for a change log filter on its own
+            *failed = true;
+            qWarning() << "Cannot buildWhere with a removal changelog filter combined with other filters";
+            return QLatin1String("FALSE");
         default: break;
     }
 
     *failed = true;
-    qWarning() << "Cannot buildWhere with changelog filter on removed timestamps";
+    qWarning() << "Cannot buildWhere with unknown changelog event type:" << filter.eventType();
     return QLatin1String("FALSE");
 }
 
-static QString buildWhere(const QContactFilter &filter, QVariantList *bindings, bool *failed);
+static QString buildWhere(const QContactFilter &filter, bool searchIndex, QVariantList *bindings, bool *failed);
 
-static QString buildWhere(const QContactUnionFilter &filter, QVariantList *bindings, bool *failed)
+static QString buildWhere(const QContactUnionFilter &filter, bool searchIndex, QVariantList *bindings, bool *failed)
 {
     const QList<QContactFilter> filters  = filter.filters();
     if (filters.isEmpty())
@@ -1177,7 +1330,7 @@ static QString buildWhere(const QContactUnionFilter &filter, QVariantList *bindi
 
     QStringList fragments;
     foreach (const QContactFilter &filter, filters) {
-        const QString fragment = buildWhere(filter, bindings, failed);
+        const QString fragment = buildWhere(filter, searchIndex, bindings, failed);
         if (!*failed && !fragment.isEmpty()) {
             fragments.append(fragment);
         }
@@ -1186,7 +1339,7 @@ static QString buildWhere(const QContactUnionFilter &filter, QVariantList *bindi
     return QString::fromLatin1("( %1 )").arg(fragments.join(QLatin1String(" OR ")));
 }
 
-static QString buildWhere(const QContactIntersectionFilter &filter, QVariantList *bindings, bool *failed)
+static QString buildWhere(const QContactIntersectionFilter &filter, bool searchIndex, QVariantList *bindings, bool *failed)
 {
     const QList<QContactFilter> filters  = filter.filters();
     if (filters.isEmpty())
@@ -1194,7 +1347,7 @@ static QString buildWhere(const QContactIntersectionFilter &filter, QVariantList
 
     QStringList fragments;
     foreach (const QContactFilter &filter, filters) {
-        const QString fragment = buildWhere(filter, bindings, failed);
+        const QString fragment = buildWhere(filter, searchIndex, bindings, failed);
         if (filter.type() != QContactFilter::DefaultFilter && !*failed) {
             // default filter gets special (permissive) treatment by the intersection filter.
             fragments.append(fragment.isEmpty() ? QLatin1String("NULL") : fragment);
@@ -1204,13 +1357,13 @@ static QString buildWhere(const QContactIntersectionFilter &filter, QVariantList
     return fragments.join(QLatin1String(" AND "));
 }
 
-static QString buildWhere(const QContactFilter &filter, QVariantList *bindings, bool *failed)
+static QString buildWhere(const QContactFilter &filter, bool searchIndex, QVariantList *bindings, bool *failed)
 {
     switch (filter.type()) {
     case QContactFilter::DefaultFilter:
         return QString();
     case QContactFilter::ContactDetailFilter:
-        return buildWhere(static_cast<const QContactDetailFilter &>(filter), bindings, failed);
+        return buildWhere(static_cast<const QContactDetailFilter &>(filter), searchIndex, bindings, failed);
     case QContactFilter::ContactDetailRangeFilter:
         return buildWhere(static_cast<const QContactDetailRangeFilter &>(filter), bindings, failed);
     case QContactFilter::ChangeLogFilter:
@@ -1218,9 +1371,9 @@ static QString buildWhere(const QContactFilter &filter, QVariantList *bindings,
     case QContactFilter::RelationshipFilter:
         return buildWhere(static_cast<const QContactRelationshipFilter &>(filter), bindings, failed);
     case QContactFilter::IntersectionFilter:
-        return buildWhere(static_cast<const QContactIntersectionFilter &>(filter), bindings, failed);
+        return buildWhere(static_cast<const QContactIntersectionFilter &>(filter), searchIndex, bindings, failed);
     case QContactFilter::UnionFilter:
-        return buildWhere(static_cast<const QContactUnionFilter &>(filter), bindings, failed);
+        return buildWhere(static_cast<const QContactUnionFilter &>(filter), searchIndex, bindings, failed);
 #ifdef USING_QTPIM
     case QContactFilter::IdFilter:
         return buildWhere(static_cast<const QContactIdFilter &>(filter), bindings, failed);
@@ -1241,7 +1394,32 @@ static int sortField(const QContactSortOrder &sort) { return sort.detailField();
 static QString sortField(const QContactSortOrder &sort) { return sort.detailFieldName(); }
 #endif
 
-static QString buildOrderBy(const QContactSortOrder &order, QStringList *joins)
+static bool hasSortKey(const char *column)
+{
+    return qstrcmp(column, "displayLabel") == 0
+        || qstrcmp(column, "firstName") == 0
+        || qstrcmp(column, "lastName") == 0;
+}
+
+struct OrderTerm
+{
+    QString expression;
+    QString collation;
+    bool ascending;
+};
+
+static OrderTerm orderTerm(const QString &expression, const QString &collation, bool ascending)
+{
+    OrderTerm term = { expression, collation, ascending };
+    return term;
+}
+
+static QString collatedExpression(const OrderTerm &term)
+{
+    return term.collation.isEmpty() ? term.expression : term.expression + QLatin1String(" COLLATE ") + term.collation;
+}
+
+static bool buildOrderBy(const QContactSortOrder &order, QStringList *joins, QList<OrderTerm> *terms)
 {
     for (int i = 0; i < lengthOf(detailInfo); ++i) {
         const DetailInfo &detail = detailInfo[i];
@@ -1253,15 +1431,28 @@ static QString buildOrderBy(const QContactSortOrder &order, QStringList *joins)
             if (sortField(order) != field.field)
                 continue;
 
-            QString collate = (order.caseSensitivity() == Qt::CaseSensitive)
-                    ? QLatin1String("COLLATE RTRIM")
-                    : QLatin1String("COLLATE NOCASE");
-            QString direction = (order.direction() == Qt::AscendingOrder)
-                    ? QLatin1String("ASC")
-                    : QLatin1String("DESC");
-            QString blanksLocation = (order.blankPolicy() == QContactSortOrder::BlanksLast)
-                    ? QLatin1String("CASE WHEN %2.%3 IS NULL OR %2.%3 = '' THEN 1 ELSE 0 END,")
-                    : QLatin1String("CASE WHEN %2.%3 IS NULL OR %2.%3 = '' THEN 0 ELSE 1 END,");
+            const QString collate = (order.caseSensitivity() == Qt::CaseSensitive)
+                    ? QLatin1String("RTRIM")
+                    : QLatin1String("NOCASE");
+            const bool ascending = order.direction() == Qt::AscendingOrder;
+            const bool blanksLast = order.blankPolicy() == QContactSortOrder::BlanksLast;
+            const QString blanksLocation = blanksLast
+                    ? QLatin1String("CASE WHEN %1 IS NULL OR %1 = '' THEN 1 ELSE 0 END")
+                    : QLatin1String("CASE WHEN %1 IS NULL OR %1 = '' THEN 0 ELSE 1 END");
+
+            // The stored sort keys are case folded and stripped of accents, so they cannot produce the
+            // binary order required by a case-sensitive sort; such sorts, including the default order
+            // of QContactSortOrder, are evaluated on the stored names without an index
+            if (!detail.table && order.caseSensitivity() != Qt::CaseSensitive && hasSortKey(field.column)) {
+                // The stored sort key begins with a flag placing blanks after other values, so
+                // ascending order with blanks last (or the reverse) can be read from an index
+                const QString sortKey(QString::fromLatin1("Contacts.%1SortKey").arg(QLatin1String(field.column)));
+
+                if (ascending != blanksLast)
+                    terms->append(orderTerm(QString::fromLatin1("substr(%1, 1, 1)").arg(sortKey), QString(), blanksLast));
+                terms->append(orderTerm(sortKey, QString(), ascending));
+                return true;
+            }
 
             if (detail.join) {
                 QString join = QString(QLatin1String(
@@ -1271,17 +1462,15 @@ static QString buildOrderBy(const QContactSortOrder &order, QStringList *joins)
                 if (!joins->contains(join))
                     joins->append(join);
 
-                return QString(QLatin1String("%1 %2.%3 %4 %5"))
-                        .arg(blanksLocation)
-                        .arg(QLatin1String(detail.table))
-                        .arg(QLatin1String(field.column))
-                        .arg(collate).arg(direction);
+                const QString column(fieldName(detail.table, field.column));
+                terms->append(orderTerm(blanksLocation.arg(column), QString(), true));
+                terms->append(orderTerm(column, collate, ascending));
+                return true;
             } else if (!detail.table) {
-                return QString(QLatin1String("%1 %2.%3 %4 %5"))
-                        .arg(blanksLocation)
-                        .arg(QLatin1String("Contacts"))
-                        .arg(QLatin1String(field.column))
-                        .arg(collate).arg(direction);
+                const QString column(fieldName("Contacts", field.column));
+                terms->append(orderTerm(blanksLocation.arg(column), QString(), true));
+                terms->append(orderTerm(column, collate, ascending));
+                return true;
             } else {
                 qWarning() << "UNSUPPORTED SORTING: no join and not primary table for ORDER BY in query with:"
 #ifdef USING_QTPIM
@@ -1293,42 +1482,234 @@ static QString buildOrderBy(const QContactSortOrder &order, QStringList *joins)
         }
     }
 
-    return QString();
+    return false;
 }
 
-static QString buildOrderBy(const QList<QContactSortOrder> &order, QString *join)
+static QString buildOrderBy(const QList<QContactSortOrder> &order, QString *join, QList<OrderTerm> *orderTerms = 0)
 {
     QStringList joins;
-    QStringList fragments;
+    QList<OrderTerm> terms;
     foreach (const QContactSortOrder &sort, order) {
-        QString fragment = buildOrderBy(sort, &joins);
-        if (!fragment.isEmpty()) {
-            fragments.append(buildOrderBy(sort, &joins));
-        }
+        buildOrderBy(sort, &joins, &terms);
     }
 
     *join = joins.join(QLatin1String(" "));
 
-    fragments.append(QLatin1String("displayLabel"));
+    // The final terms make the order total, so that a page can be resumed from its last contact
+    terms.append(orderTerm(QLatin1String("Contacts.displayLabelSortKey"), QString(), true));
+    terms.append(orderTerm(QLatin1String("Contacts.contactId"), QString(), true));
+
+    QStringList fragments;
+    foreach (const OrderTerm &term, terms) {
+        fragments.append(collatedExpression(term) + QLatin1String(term.ascending ? " ASC" : " DESC"));
+    }
+
+    if (orderTerms)
+        *orderTerms = terms;
+
     return fragments.join(QLatin1String(", "));
 }
 
-static void debugFilterExpansion(const QString &description, const QString &query, const QVariantList &bindings)
+static QString continuationToken(const QString &orderBy, const QVariantList &values)
+{
+    QByteArray data;
+    {
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream << qHash(orderBy) << values;
+    }
+    return QString::fromLatin1(data.toBase64());
+}
+
+static bool parseContinuationToken(const QString &token, const QString &orderBy, QVariantList *values)
+{
+    QByteArray data(QByteArray::fromBase64(token.toLatin1()));
+    QDataStream stream(&data, QIODevice::ReadOnly);
+
+    uint orderHash = 0;
+    stream >> orderHash >> *values;
+
+    // A token is only valid for the sort order of the fetch that produced it
+    return stream.status() == QDataStream::Ok && orderHash == qHash(orderBy);
+}
+
+static QString buildContinuationWhere(const QList<OrderTerm> &terms, const QVariantList &values, QVariantList *bindings)
+{
+    QVariantList continuationBindings;
+
+    // Match rows that sort after the row having the given values: those equal in
+    // the leading terms and following it in the next term.  NULL sorts first.
+    QStringList alternatives;
+    QStringList equalities;
+    QVariantList equalityBindings;
+    for (int i = 0; i < terms.count(); ++i) {
+        const OrderTerm &term(terms.at(i));
+        const QVariant &value(values.at(i));
+        const QString expression(collatedExpression(term));
+
+        QString following;
+        QVariantList followingBindings;
+        if (value.isNull()) {
+            if (term.ascending)
+                following = QString::fromLatin1("%1 IS NOT NULL").arg(term.expression);
+        } else if (term.ascending) {
+            following = QString::fromLatin1("%1 > ?").arg(expression);
+            followingBindings.append(value);
+        } else {
+            following = QString::fromLatin1("(%1 < ? OR %2 IS NULL)").arg(expression).arg(term.expression);
+            followingBindings.append(value);
+        }
+
+        if (!following.isEmpty()) {
+            alternatives.append(QString::fromLatin1("(%1)").arg(QStringList(equalities + (QStringList() << following)).join(QLatin1String(" AND "))));
+            continuationBindings.append(equalityBindings);
+            continuationBindings.append(followingBindings);
+        }
+
+        if (value.isNull()) {
+            equalities.append(QString::fromLatin1("%1 IS NULL").arg(term.expression));
+        } else {
+            equalities.append(QString::fromLatin1("%1 = ?").arg(expression));
+            equalityBindings.append(value);
+        }
+    }
+
+    QString where(QString::fromLatin1("(%1)").arg(alternatives.isEmpty() ? QString::fromLatin1("0") : alternatives.join(QLatin1String(" OR "))));
+
+    // Bound the leading term as well, so that the range can be found in an index
+    const OrderTerm &first(terms.first());
+    if (first.ascending && !values.first().isNull()) {
+        where.prepend(QString::fromLatin1("%1 >= ? AND ").arg(collatedExpression(first)));
+        continuationBindings.prepend(values.first());
+    }
+
+    bindings->append(continuationBindings);
+    return where;
+}
+
+static QString readContinuationToken(
+        QSqlDatabase *db, const QString &join, const QList<OrderTerm> &terms, const QString &orderBy, quint32 contactId)
 {
-    static const bool debugFilters = !qgetenv("QTCONTACTS_SQLITE_DEBUG_FILTERS").isEmpty();
+    QStringList expressions;
+    foreach (const OrderTerm &term, terms) {
+        expressions.append(term.expression);
+    }
+
+    QSqlQuery query(*db);
+    query.setForwardOnly(true);
+    const QString statement = QString(QLatin1String(
+            "\n SELECT %1"
+            "\n FROM Contacts %2"
+            "\n WHERE Contacts.contactId = :contactId;"))
+            .arg(expressions.join(QLatin1String(", "))).arg(join);
+    if (!query.prepare(statement)) {
+        qWarning() << "Failed to prepare continuation query";
+        qWarning() << query.lastError();
+        qWarning() << statement;
+        return QString();
+    }
+
+    query.bindValue(0, contactId);
+    if (!query.exec() || !query.next()) {
+        qWarning() << "Failed to query continuation values";
+        qWarning() << query.lastError();
+        return QString();
+    }
+
+    QVariantList values;
+    for (int i = 0; i < terms.count(); ++i) {
+        values.append(query.value(i));
+    }
+    query.finish();
+
+    return continuationToken(orderBy, values);
+}
+
+static bool appendContinuationWhere(
+        QString *where, const QString &continuation, const QList<OrderTerm> &terms, const QString &orderBy, QVariantList *bindings)
+{
+    QVariantList values;
+    if (!parseContinuationToken(continuation, orderBy, &values) || values.count() != terms.count()) {
+        qWarning() << "Invalid continuation token for the requested sort order";
+        return false;
+    }
 
-    if (debugFilters) {
+    const QString continuationWhere = buildContinuationWhere(terms, values, bindings);
+    if (where->isEmpty()) {
+        *where = QLatin1String("WHERE ") + continuationWhere;
+    } else {
+        where->append(QLatin1String(" AND ")).append(continuationWhere);
+    }
+    return true;
+}
+
+static bool debugFilters()
+{
+    static const bool debug = !qgetenv("QTCONTACTS_SQLITE_DEBUG_FILTERS").isEmpty();
+    return debug;
+}
+
+static void debugFilterExpansion(const QString &description, const QString &query, const QVariantList &bindings)
+{
+    if (debugFilters()) {
         qDebug() << description << ContactsDatabase::expandQuery(query, bindings);
     }
 }
 
 ContactReader::ContactReader(const QSqlDatabase &database)
     : m_database(database)
+    , m_searchIndex(ContactsDatabase::hasSearchIndex(database))
+    , m_cachedQueryHits(0)
+    , m_cachedQueryMisses(0)
 {
 }
 
 ContactReader::~ContactReader()
 {
+    if (debugFilters()) {
+        qDebug() << "Cached query hits:" << m_cachedQueryHits << "misses:" << m_cachedQueryMisses;
+    }
+}
+
+int ContactReader::cachedQueryHits() const
+{
+    return m_cachedQueryHits;
+}
+
+int ContactReader::cachedQueryMisses() const
+{
+    return m_cachedQueryMisses;
+}
+
+bool ContactReader::prepareCachedQuery(const QString &statement, QSqlQuery *query)
+{
+    // Statements are keyed by their text; filter values are bound rather than
+    // embedded, so repeated filters of the same shape share a prepared statement.
+    QHash<QString, QSqlQuery>::const_iterator it = m_cachedQueries.constFind(statement);
+    if (it != m_cachedQueries.constEnd()) {
+        ++m_cachedQueryHits;
+        m_cachedQueryOrder.removeOne(statement);
+        m_cachedQueryOrder.append(statement);
+        *query = *it;
+        return true;
+    }
+
+    ++m_cachedQueryMisses;
+    QSqlQuery newQuery(m_database);
+    newQuery.setForwardOnly(true);
+    if (!newQuery.prepare(statement)) {
+        *query = newQuery;
+        return false;
+    }
+
+    // evict the least recently used statement
+    if (m_cachedQueryOrder.count() >= MaximumCachedQueries) {
+        m_cachedQueries.remove(m_cachedQueryOrder.takeFirst());
+    }
+    m_cachedQueries.insert(statement, newQuery);
+    m_cachedQueryOrder.append(statement);
+
+    *query = newQuery;
+    return true;
 }
 
 struct Table
@@ -1338,53 +1719,101 @@ struct Table
     quint32 currentId;
 };
 
-static QContactManager::Error createTemporaryContactIdsTable(
-        QSqlDatabase *db, const QString &table, bool filter, // required for both "filter" and "by id"
-        const QVariantList &boundIds,                        // for "read contacts by id" only
-        const QString &join, const QString &where, const QString &orderBy, const QVariantList boundValues)
-{
-    // Create the temporary table (if we haven't already).
-    QSqlQuery tableQuery(*db);
-    const QString createStatement = QString(QLatin1String(
-            "\n CREATE TABLE IF NOT EXISTS temp.%1 ("
-            "\n contactId INTEGER);")).arg(table);
-    if (!tableQuery.prepare(createStatement)) {
-        qWarning() << "Failed to prepare temporary table query";
-        qWarning() << tableQuery.lastError();
-        qWarning() << createStatement;
-        return QContactManager::UnspecifiedError;
+static int tableColumnCount(QSqlDatabase *db, const char *table)
+{
+    QSqlQuery query(*db);
+    query.setForwardOnly(true);
+    if (!query.exec(QString(QLatin1String("PRAGMA table_info(%1)")).arg(QLatin1String(table)))) {
+        qWarning() << "Failed to query columns for table" << table;
+        qWarning() << query.lastError();
+        return -1;
     }
-    if (!tableQuery.exec()) {
-        qWarning() << "Failed to create temporary table";
-        qWarning() << tableQuery.lastError();
-        qWarning() << createStatement;
-        return QContactManager::UnspecifiedError;
+
+    int count = 0;
+    while (query.next())
+        ++count;
+    return count;
+}
+
+static QString buildSingleDetailQuery(QSqlDatabase *db, const QString &tableName, const QList<int> &detailIndices)
+{
+    // Each detail table has a different number of columns, so pad every
+    // subquery to the width of the widest table.  The detail values are
+    // located at the same offsets as in the per-table queries, and each
+    // row is tagged with the index of its detailInfo entry in the last column.
+    // Rows are ordered by contact, then by detail type, then by detailId, so
+    // that details of the same type are returned in the order they were saved.
+    QList<int> columnCounts;
+    int maximumColumns = 0;
+    foreach (int index, detailIndices) {
+        const int count = tableColumnCount(db, detailInfo[index].table);
+        if (count < 0)
+            return QString();
+
+        columnCounts.append(count);
+        maximumColumns = qMax(maximumColumns, count);
     }
-    tableQuery.finish();
 
-    // Delete all existing records.  This is just in case the
-    // previous clearTemporaryContactIdsTable function failed.
-    // XXX TODO: for performance reasons, should remove this query.
-    QSqlQuery deleteRecordsQuery(*db);
-    const QString deleteRecordsStatement = QString(QLatin1String(
-            "\n DELETE FROM temp.%1")).arg(table);
-    if (!deleteRecordsQuery.prepare(deleteRecordsStatement)) {
-        qWarning() << "Failed to prepare delete records query";
-        qWarning() << deleteRecordsQuery.lastError();
-        qWarning() << deleteRecordsStatement;
-        return QContactManager::UnspecifiedError;
+    const QString subqueryTemplate = QString(QLatin1String(
+            "\n SELECT"
+            "\n  Details.detailUri,"
+            "\n  Details.linkedDetailUris,"
+            "\n  Details.contexts,"
+            "\n  Details.accessConstraints,"
+            "\n  %2.*,%3"
+            "\n  temp.%1.rowId AS contactOrder,"
+            "\n  %4 AS detailIndex"
+            "\n FROM temp.%1"
+            "\n  INNER JOIN %2 ON temp.%1.contactId = %2.contactId"
+            "\n  LEFT JOIN Details ON %2.detailId = Details.detailId AND Details.detail = ?")).arg(tableName);
+
+    QStringList subqueries;
+    for (int i = 0; i < detailIndices.count(); ++i) {
+        const int index = detailIndices.at(i);
+
+        QString padding;
+        for (int j = columnCounts.at(i); j < maximumColumns; ++j)
+            padding.append(QLatin1String(" NULL,"));
+
+        subqueries.append(subqueryTemplate.arg(QLatin1String(detailInfo[index].table)).arg(padding).arg(index));
     }
-    if (!deleteRecordsQuery.exec()) {
-        qWarning() << "Failed to delete temporary records";
-        qWarning() << deleteRecordsQuery.lastError();
-        qWarning() << deleteRecordsStatement;
-        return QContactManager::UnspecifiedError;
+
+    return subqueries.join(QLatin1String("\n UNION ALL"))
+         + QLatin1String("\n ORDER BY contactOrder ASC, detailIndex ASC, detailId ASC;");
+}
+
+QContactManager::Error ContactReader::createTemporaryContactIdsTable(
+        const QString &table, bool filter,                   // required for both "filter" and "by id"
+        const QVariantList &boundIds,                        // for "read contacts by id" only
+        const QString &join, const QString &where, const QString &orderBy, const QVariantList &boundValues)
+{
+    // Create the temporary table the first time it is used by this connection.  The table
+    // is not dropped after use, so that statements which refer to it remain valid between
+    // reads; clearTemporaryContactIdsTable() empties it after each read.
+    if (!m_temporaryTables.contains(table)) {
+        QSqlQuery tableQuery(m_database);
+        const QString createStatement = QString(QLatin1String(
+                "\n CREATE TABLE IF NOT EXISTS temp.%1 ("
+                "\n contactId INTEGER);")).arg(table);
+        if (!tableQuery.prepare(createStatement)) {
+            qWarning() << "Failed to prepare temporary table query";
+            qWarning() << tableQuery.lastError();
+            qWarning() << createStatement;
+            return QContactManager::UnspecifiedError;
+        }
+        if (!tableQuery.exec()) {
+            qWarning() << "Failed to create temporary table";
+            qWarning() << tableQuery.lastError();
+            qWarning() << createStatement;
+            return QContactManager::UnspecifiedError;
+        }
+        tableQuery.finish();
+        m_temporaryTables.insert(table);
     }
-    deleteRecordsQuery.finish();
 
     // insert into the temporary table, all of the ids
     // which will be specified either by id list, or by filter.
-    QSqlQuery insertQuery(*db);
+    QSqlQuery insertQuery;
     if (filter) {
         // specified by filter
         const QString insertStatement = QString(QLatin1String(
@@ -1394,7 +1823,7 @@ static QContactManager::Error createTemporaryContactIdsTable(
                 "\n %3"
                 "\n ORDER BY %4;"))
                 .arg(table).arg(join).arg(where).arg(orderBy);
-        if (!insertQuery.prepare(insertStatement)) {
+        if (!prepareCachedQuery(insertStatement, &insertQuery)) {
             qWarning() << "Failed to prepare temporary contact ids";
             qWarning() << insertQuery.lastError();
             qWarning() << insertStatement;
@@ -1421,7 +1850,7 @@ static QContactManager::Error createTemporaryContactIdsTable(
                 "\n INSERT INTO temp.%1 (contactId)"
                 "\n VALUES(:contactId);"))
                 .arg(table);
-        if (!insertQuery.prepare(insertStatement)) {
+        if (!prepareCachedQuery(insertStatement, &insertQuery)) {
             qWarning() << "Failed to prepare temporary contact ids";
             qWarning() << insertQuery.lastError();
             qWarning() << insertStatement;
@@ -1439,25 +1868,34 @@ static QContactManager::Error createTemporaryContactIdsTable(
     return QContactManager::NoError;
 }
 
-static void clearTemporaryContactIdsTable(QSqlDatabase *db, const QString &table)
-{
-    QSqlQuery dropTableQuery(*db);
-    const QString dropTableStatement = QString(QLatin1String(
-            "\n DROP TABLE temp.%1")).arg(table);
-    if (!dropTableQuery.prepare(dropTableStatement) || !dropTableQuery.exec()) {
-        // couldn't drop the table, just delete all entries instead.
-        QSqlQuery deleteRecordsQuery(*db);
-        const QString deleteRecordsStatement = QString(QLatin1String(
-                "\n DELETE FROM temp.%1")).arg(table);
-        if (!deleteRecordsQuery.prepare(deleteRecordsStatement)) {
-            qWarning() << "FATAL ERROR: Failed to prepare delete records query - the next query may return spurious results";
-            qWarning() << deleteRecordsQuery.lastError();
-            qWarning() << deleteRecordsStatement;
-        }
-        if (!deleteRecordsQuery.exec()) {
-            qWarning() << "FATAL ERROR: Failed to delete temporary records - the next query may return spurious results";
-            qWarning() << deleteRecordsQuery.lastError();
-            qWarning() << deleteRecordsStatement;
+void ContactReader::clearTemporaryTables()
+{
+    foreach (const QString &table, m_temporaryTables) {
+        clearTemporaryContactIdsTable(table);
+    }
+}
+
+void ContactReader::clearTemporaryContactIdsTable(const QString &table)
+{
+    // Delete all entries, but retain the table for the next read.
+    QSqlQuery deleteRecordsQuery(m_database);
+    const QString deleteRecordsStatement = QString(QLatin1String(
+            "\n DELETE FROM temp.%1")).arg(table);
+    if (!deleteRecordsQuery.prepare(deleteRecordsStatement) || !deleteRecordsQuery.exec()) {
+        // couldn't delete the entries, drop the table instead so that it is recreated empty.
+        qWarning() << "Failed to delete temporary records";
+        qWarning() << deleteRecordsQuery.lastError();
+        qWarning() << deleteRecordsStatement;
+
+        QSqlQuery dropTableQuery(m_database);
+        const QString dropTableStatement = QString(QLatin1String(
+                "\n DROP TABLE temp.%1")).arg(table);
+        if (!dropTableQuery.prepare(dropTableStatement) || !dropTableQuery.exec()) {
+            qWarning() << "FATAL ERROR: Failed to drop temporary table - the next query may return spurious results";
+            qWarning() << dropTableQuery.lastError();
+            qWarning() << dropTableStatement;
+        } else {
+            m_temporaryTables.remove(table);
         }
     }
 }
@@ -1568,13 +2006,16 @@ QContactManager::Error ContactReader::readContacts(
         QList<QContact> *contacts,
         const QContactFilter &filter,
         const QList<QContactSortOrder> &order,
-        const QContactFetchHint &fetchHint)
+        const QContactFetchHint &fetchHint,
+        const QString &continuation,
+        QString *nextContinuation)
 {
     QString join;
-    const QString orderBy = buildOrderBy(order, &join);
+    QList<OrderTerm> terms;
+    const QString orderBy = buildOrderBy(order, &join, &terms);
     bool whereFailed = false;
     QVariantList bindings;
-    QString where = buildWhere(filter, &bindings, &whereFailed);
+    QString where = buildWhere(filter, m_searchIndex, &bindings, &whereFailed);
     if (whereFailed) {
         qWarning() << "Failed to create WHERE expression: invalid filter specification";
         return QContactManager::UnspecifiedError;
@@ -1582,14 +2023,36 @@ QContactManager::Error ContactReader::readContacts(
 
     where = expandWhere(where, filter);
 
+    if (!continuation.isEmpty() && !appendContinuationWhere(&where, continuation, terms, orderBy, &bindings))
+        return QContactManager::BadArgumentError;
+
+    // Only the requested number of contacts need to be selected; the limit is bound, so
+    // that the statement is shared by every page size
+    const int maximumCount = fetchHint.maxCountHint();
+    QString limitedOrderBy(orderBy);
+    if (maximumCount > 0) {
+        limitedOrderBy.append(QLatin1String(" LIMIT ?"));
+        bindings.append(maximumCount);
+    }
+
     QContactManager::Error createTempError = createTemporaryContactIdsTable(
-            &m_database, table, true, QVariantList(), join, where, orderBy, bindings);
+            table, true, QVariantList(), join, where, limitedOrderBy, bindings);
 
+    const int contactCount = contacts->count();
     QContactManager::Error error = (createTempError == QContactManager::NoError)
             ? queryContacts(table, contacts, fetchHint)
             : createTempError;
 
-    clearTemporaryContactIdsTable(&m_database, table);
+    clearTemporaryContactIdsTable(table);
+
+    if (nextContinuation) {
+        // A full page may be followed by further results
+        nextContinuation->clear();
+        if (error == QContactManager::NoError && maximumCount > 0 && contacts->count() - contactCount == maximumCount) {
+            *nextContinuation = readContinuationToken(
+                    &m_database, join, terms, orderBy, ContactId::databaseId(contacts->last().id()));
+        }
+    }
 
     return error;
 }
@@ -1606,14 +2069,14 @@ QContactManager::Error ContactReader::readContacts(
     }
 
     QContactManager::Error createTempError = createTemporaryContactIdsTable(
-            &m_database, table, false, boundIds, QString(), QString(), QString(), QVariantList());
+            table, false, boundIds, QString(), QString(), QString(), QVariantList());
 
     contacts->reserve(contactIds.size());
     QContactManager::Error error = (createTempError == QContactManager::NoError)
             ? queryContacts(table, contacts, fetchHint)
             : createTempError;
 
-    clearTemporaryContactIdsTable(&m_database, table);
+    clearTemporaryContactIdsTable(table);
 
     // the ordering of the queried contacts is identical to
     // the ordering of the input contact ids list.
@@ -1643,7 +2106,7 @@ QContactManager::Error ContactReader::queryContacts(
     QSqlQuery query(m_database);
     query.setForwardOnly(true);
     if (!query.exec(QString(QLatin1String(
-            "\n SELECT Contacts.*"
+            "\n SELECT Contacts.*, Contacts.contactId IN (SELECT contactId FROM DeferredAggregates)"
             "\n FROM temp.%1 INNER JOIN Contacts ON temp.%1.contactId = Contacts.contactId"
             "\n ORDER BY temp.%1.rowId ASC;")).arg(tableName))) {
         qWarning() << "Failed to query from" << tableName;
@@ -1651,6 +2114,9 @@ QContactManager::Error ContactReader::queryContacts(
         return QContactManager::UnspecifiedError;
     }
 
+    // The final column reports whether an aggregate is awaiting deferred regeneration
+    const int pendingAggregationColumn = query.record().count() - 1;
+
     const QString tableTemplate = QString(QLatin1String(
             "\n SELECT"
             "\n  Details.detailUri,"
@@ -1661,7 +2127,7 @@ QContactManager::Error ContactReader::queryContacts(
             "\n FROM temp.%1"
             "\n  INNER JOIN %2 ON temp.%1.contactId = %2.contactId"
             "\n  LEFT JOIN Details ON %2.detailId = Details.detailId AND Details.detail = :detail"
-            "\n ORDER BY temp.%1.rowId ASC;")).arg(tableName);
+            "\n ORDER BY temp.%1.rowId ASC, %2.detailId ASC;")).arg(tableName);
 
 #ifdef USING_QTPIM
     const ContactWriter::DetailList &details = fetchHint.detailTypesHint();
@@ -1669,10 +2135,63 @@ QContactManager::Error ContactReader::queryContacts(
     const ContactWriter::DetailList &details = fetchHint.detailDefinitionsHint();
 #endif
 
+    QContactFetchHint::OptimizationHints optimizationHints(fetchHint.optimizationHints());
+    const bool singleDetailQuery = (optimizationHints & QContactFetchHint__SingleDetailQuery) != 0;
+
+    // When requested, read all detail rows in a single query ordered by contact and
+    // tagged with their detail type, rather than stepping a cursor for each table
+    QSqlQuery detailQuery;
+    quint32 detailCurrentId = 0;
+    int detailIndexColumn = -1;
+    if (singleDetailQuery) {
+        QList<int> detailIndices;
+        QString cacheKey(QLatin1String("SingleDetailQuery"));
+        for (int i = 0; i < lengthOf(detailInfo); ++i) {
+            const DetailInfo &detail = detailInfo[i];
+            if (detail.read && (details.isEmpty() || details.contains(detail.detail))) {
+                detailIndices.append(i);
+                cacheKey.append(QChar::fromLatin1(':')).append(QString::number(i));
+            }
+        }
+
+        if (!detailIndices.isEmpty()) {
+            bool haveCachedQuery = m_cachedDetailTableQueries[tableName].contains(cacheKey);
+            detailQuery = haveCachedQuery ? m_cachedDetailTableQueries[tableName].value(cacheKey) : QSqlQuery(m_database);
+
+            if (!haveCachedQuery) {
+                const QString detailQueryStatement(buildSingleDetailQuery(&m_database, tableName, detailIndices));
+                detailQuery.setForwardOnly(true);
+                if (detailQueryStatement.isEmpty() || !detailQuery.prepare(detailQueryStatement)) {
+                    qWarning() << "Failed to prepare single detail query";
+                    qWarning() << detailQueryStatement;
+                    qWarning() << detailQuery.lastError();
+                    return QContactManager::UnspecifiedError;
+                }
+                m_cachedDetailTableQueries[tableName].insert(cacheKey, detailQuery);
+            }
+
+            for (int i = 0; i < detailIndices.count(); ++i) {
+#ifdef USING_QTPIM
+                detailQuery.bindValue(i, QString::fromLatin1(detailInfo[detailIndices.at(i)].detailName));
+#else
+                detailQuery.bindValue(i, detailInfo[detailIndices.at(i)].detail);
+#endif
+            }
+            if (!detailQuery.exec()) {
+                qWarning() << "Failed to query single detail query";
+                qWarning() << detailQuery.lastError();
+                return QContactManager::UnspecifiedError;
+            } else if (detailQuery.next()) {
+                detailCurrentId = detailQuery.value(5).toUInt();
+                detailIndexColumn = detailQuery.record().count() - 1;
+            }
+        }
+    }
+
     QList<Table> tables;
     for (int i = 0; i < lengthOf(detailInfo); ++i) {
         const DetailInfo &detail = detailInfo[i];
-        if (!detail.read)
+        if (!detail.read || singleDetailQuery)
             continue;
 
         if (details.isEmpty() || details.contains(detail.detail)) {
@@ -1716,8 +2235,6 @@ QContactManager::Error ContactReader::queryContacts(
         }
     }
 
-    QContactFetchHint::OptimizationHints optimizationHints(fetchHint.optimizationHints());
-
     // Skip relationships if they're able to be left out
     if ((optimizationHints & QContactFetchHint::NoRelationships) == 0) {
         const QString relationshipQuery = QString::fromLatin1(
@@ -1829,12 +2346,27 @@ QContactManager::Error ContactReader::queryContacts(
             flags.setFlag(QContactStatusFlags::HasEmailAddress, query.value(16).toBool());
             flags.setFlag(QContactStatusFlags::HasOnlineAccount, query.value(17).toBool());
             flags.setFlag(QContactStatusFlags::IsOnline, query.value(18).toBool());
+            flags.setFlag(QContactStatusFlags::IsPendingAggregation, query.value(pendingAggregationColumn).toBool());
             QContactManagerEngine::setDetailAccessConstraints(&flags, QContactDetail::ReadOnly | QContactDetail::Irremovable);
             contact.saveDetail(&flags);
 
             contacts->append(contact);
         }
 
+        if (detailQuery.isValid()) {
+            QList<QContact>::iterator it = contacts->begin() + contactCount;
+            for (QList<QContact>::iterator end = contacts->end(); it != end; ++it) {
+                QContact &contact(*it);
+                quint32 contactId = ContactId::databaseId(contact.id());
+
+                while (detailQuery.isValid() && (detailCurrentId == contactId)) {
+                    detailInfo[detailQuery.value(detailIndexColumn).toInt()].readRow(&contact, &detailQuery);
+                    if (detailQuery.next())
+                        detailCurrentId = detailQuery.value(5).toUInt();
+                }
+            }
+        }
+
         for (int j = 0; j < tables.count(); ++j) {
             Table &table = tables[j];
             QList<QContact>::iterator it = contacts->begin() + contactCount;
@@ -1848,28 +2380,40 @@ QContactManager::Error ContactReader::queryContacts(
             }
         }
 
-        contactsAvailable(*contacts);
-    } while (query.isValid() && (maximumCount < 0));
+        // only report the contacts read in this batch
+        contactsAvailable(contacts->mid(contactCount));
+    } while (query.isValid() && (maximumCount < 0) && !cancelled());
 
     query.finish();
+    detailQuery.finish();
     for (int k = 0; k < tables.count(); ++k) {
         Table &table = tables[k];
         table.query.finish();
     }
 
-    return QContactManager::NoError;
+    return cancelled() ? QContactManager::UnspecifiedError : QContactManager::NoError;
 }
 
 QContactManager::Error ContactReader::readContactIds(
         QList<QContactIdType> *contactIds,
         const QContactFilter &filter,
-        const QList<QContactSortOrder> &order)
-{
+        const QList<QContactSortOrder> &order,
+        const QString &continuation,
+        int pageSize,
+        QString *nextContinuation)
+{
+    if (filter.type() == QContactFilter::ChangeLogFilter) {
+        const QContactChangeLogFilter &changeLogFilter(static_cast<const QContactChangeLogFilter &>(filter));
+        if (changeLogFilter.eventType() == QContactChangeLogFilter::EventRemoved)
+            return readRemovedContactIds(contactIds, dateString(false, changeLogFilter.since()));
+    }
+
     QString join;
-    const QString orderBy = buildOrderBy(order, &join);
+    QList<OrderTerm> terms;
+    const QString orderBy = buildOrderBy(order, &join, &terms);
     bool failed = false;
     QVariantList bindings;
-    QString where = buildWhere(filter, &bindings, &failed);
+    QString where = buildWhere(filter, m_searchIndex, &bindings, &failed);
 
     if (failed) {
         qWarning() << "Failed to create WHERE expression: invalid filter specification";
@@ -1878,15 +2422,20 @@ QContactManager::Error ContactReader::readContactIds(
 
     where = expandWhere(where, filter);
 
+    if (!continuation.isEmpty() && !appendContinuationWhere(&where, continuation, terms, orderBy, &bindings))
+        return QContactManager::BadArgumentError;
+
     const QString queryString = QString(QLatin1String(
                 "\n SELECT DISTINCT Contacts.contactId"
                 "\n FROM Contacts %1"
                 "\n %2"
-                "\n ORDER BY %3;")).arg(join).arg(where).arg(orderBy);
+                "\n ORDER BY %3%4;")).arg(join).arg(where).arg(orderBy)
+                .arg(pageSize > 0 ? QLatin1String(" LIMIT ?") : QLatin1String(""));
+    if (pageSize > 0)
+        bindings.append(pageSize);
 
-    QSqlQuery query(m_database);
-    query.setForwardOnly(true);
-    if (!query.prepare(queryString)) {
+    QSqlQuery query;
+    if (!prepareCachedQuery(queryString, &query)) {
         qWarning() << "Failed to prepare contacts ids";
         qWarning() << query.lastError();
         qWarning() << queryString;
@@ -1905,13 +2454,178 @@ QContactManager::Error ContactReader::readContactIds(
         debugFilterExpansion("Contact IDs selection:", queryString, bindings);
     }
 
+    const int initialCount = contactIds->count();
+    quint32 lastId = 0;
     do {
+        int contactIdCount = contactIds->count();
         for (int i = 0; i < ReportBatchSize && query.next(); ++i) {
-            contactIds->append(ContactId::apiId(query.value(0).toUInt()));
+            lastId = query.value(0).toUInt();
+            contactIds->append(ContactId::apiId(lastId));
+        }
+        contactIdsAvailable(contactIds->mid(contactIdCount));
+    } while (query.isValid() && !cancelled());
+
+    query.finish();
+
+    if (cancelled())
+        return QContactManager::UnspecifiedError;
+
+    if (nextContinuation) {
+        nextContinuation->clear();
+        if (pageSize > 0 && contactIds->count() - initialCount == pageSize) {
+            *nextContinuation = readContinuationToken(&m_database, join, terms, orderBy, lastId);
+        }
+    }
+
+    return QContactManager::NoError;
+}
+
+QContactManager::Error ContactReader::readRemovedContactIds(
+        QList<QContactIdType> *contactIds, const QString &since)
+{
+    const QString queryString(QLatin1String(
+                "\n SELECT contactId FROM Tombstones"
+                "\n WHERE removed >= coalesce(julianday(?), 0)"
+                "\n ORDER BY contactId;"));
+
+    QSqlQuery query;
+    if (!prepareCachedQuery(queryString, &query)) {
+        qWarning() << "Failed to prepare removed contact ids";
+        qWarning() << query.lastError();
+        return QContactManager::UnspecifiedError;
+    }
+
+    query.bindValue(0, since);
+    if (!query.exec()) {
+        qWarning() << "Failed to select removed contact ids";
+        qWarning() << query.lastError();
+        return QContactManager::UnspecifiedError;
+    }
+
+    const int initialCount = contactIds->count();
+    while (query.next())
+        contactIds->append(ContactId::apiId(query.value(0).toUInt()));
+    query.finish();
+
+    contactIdsAvailable(contactIds->mid(initialCount));
+    return QContactManager::NoError;
+}
+
+// A changes token holds the change sequence of the latest write that has been reported
+static bool parseChangesToken(const QString &token, qlonglong *sequence)
+{
+    bool ok = false;
+    *sequence = token.toLongLong(&ok);
+    return ok && *sequence >= 0;
+}
+
+QContactManager::Error ContactReader::readContactChanges(
+        QList<QContactIdType> *addedIds,
+        QList<QContactIdType> *changedIds,
+        QList<QContactIdType> *removedIds,
+        const QString &syncTarget,
+        const QString &token,
+        QString *nextToken)
+{
+    enum { Added = 0, Changed, Removed, Sequence, Pruned };
+
+    qlonglong since = 0;
+    if (!token.isEmpty() && !parseChangesToken(token, &since)) {
+        qWarning() << "Invalid contact changes token:" << token;
+        return QContactManager::BadArgumentError;
+    }
+
+    const QString syncTargetCondition(QLatin1String("syncTarget = ?"));
+    QStringList contactConditions;
+    QStringList tombstoneConditions;
+    QVariantList bindings;
+
+    // Writes are serialized, so the sequence orders them as committed.  The current sequence is read
+    // with the changes, in the same statement, so every write it covers is either reported here or
+    // was reported already.
+    QString classification(QString::fromLatin1("%1").arg(Added));
+    if (!token.isEmpty()) {
+        classification = QString::fromLatin1("CASE WHEN createdSequence > ? THEN %1 ELSE %2 END").arg(Added).arg(Changed);
+        bindings.append(since);
+        contactConditions.append(QLatin1String("changeSequence > ?"));
+        bindings.append(since);
+    }
+    if (!syncTarget.isEmpty()) {
+        contactConditions.append(syncTargetCondition);
+        bindings.append(syncTarget);
+    }
+    if (!token.isEmpty()) {
+        tombstoneConditions.append(QLatin1String("changeSequence > ?"));
+        bindings.append(since);
+    }
+    if (!syncTarget.isEmpty()) {
+        tombstoneConditions.append(syncTargetCondition);
+        bindings.append(syncTarget);
+    }
+
+    const QString queryString = QString(QLatin1String(
+                "\n SELECT contactId, %1 FROM Contacts%2"
+                "\n UNION ALL"
+                "\n SELECT contactId, %3 FROM Tombstones%4"
+                "\n UNION ALL"
+                "\n SELECT sequence, %5 FROM ChangeSequence"
+                "\n UNION ALL"
+                "\n SELECT pruned, %6 FROM ChangeSequence;"))
+            .arg(classification)
+            .arg(contactConditions.isEmpty() ? QString() : QString::fromLatin1(" WHERE ") + contactConditions.join(QLatin1String(" AND ")))
+            .arg(Removed)
+            .arg(tombstoneConditions.isEmpty() ? QString() : QString::fromLatin1(" WHERE ") + tombstoneConditions.join(QLatin1String(" AND ")))
+            .arg(Sequence)
+            .arg(Pruned);
+
+    QSqlQuery query;
+    if (!prepareCachedQuery(queryString, &query)) {
+        qWarning() << "Failed to prepare contact changes";
+        qWarning() << query.lastError();
+        qWarning() << queryString;
+        return QContactManager::UnspecifiedError;
+    }
+
+    for (int i = 0; i < bindings.count(); ++i)
+        query.bindValue(i, bindings.at(i));
+
+    if (!query.exec()) {
+        qWarning() << "Failed to select contact changes";
+        qWarning() << query.lastError();
+        qWarning() << queryString;
+        return QContactManager::UnspecifiedError;
+    }
+
+    QList<QContactIdType> added;
+    QList<QContactIdType> changed;
+    QList<QContactIdType> removed;
+    qlonglong sequence = 0;
+    qlonglong pruned = 0;
+    while (query.next()) {
+        switch (query.value(1).toInt()) {
+            case Added: added.append(ContactId::apiId(query.value(0).toUInt())); break;
+            case Changed: changed.append(ContactId::apiId(query.value(0).toUInt())); break;
+            case Removed: removed.append(ContactId::apiId(query.value(0).toUInt())); break;
+            case Sequence: sequence = query.value(0).toLongLong(); break;
+            default: pruned = query.value(0).toLongLong(); break;
         }
-        contactIdsAvailable(*contactIds);
-    } while (query.isValid());
+    }
+    query.finish();
+
+    // Removals following the token may have been pruned, so its changes can no longer be reported
+    if (!token.isEmpty() && since < pruned) {
+        qWarning() << "Contact changes token has expired:" << token;
+        return QContactManager::DoesNotExistError;
+    }
+    if (since > sequence) {
+        qWarning() << "Contact changes token is not yet valid:" << token;
+        return QContactManager::BadArgumentError;
+    }
 
+    addedIds->append(added);
+    changedIds->append(changed);
+    removedIds->append(removed);
+    *nextToken = QString::number(sequence);
     return QContactManager::NoError;
 }
 
@@ -2011,3 +2725,8 @@ void ContactReader::contactsAvailable(const QList<QContact> &)
 void ContactReader::contactIdsAvailable(const QList<QContactIdType> &)
 {
 }
+
+bool ContactReader::cancelled() const
+{
+    return false;
+}
@@ -38,8 +38,11 @@
 #include <QContact>
 #include <QContactManager>
 
+#include <QHash>
+#include <QSet>
 #include <QSqlDatabase>
 #include <QSqlQuery>
+#include <QStringList>
 
 USE_CONTACTS_NAMESPACE
 
@@ -49,12 +52,16 @@ public:
     ContactReader(const QSqlDatabase &database);
     virtual ~ContactReader();
 
+    // A continuation token returned by a paged read resumes reading after the last
+    // result of that page, given the same filter and sort order
     QContactManager::Error readContacts(
             const QString &table,
             QList<QContact> *contacts,
             const QContactFilter &filter,
             const QList<QContactSortOrder> &order,
-            const QContactFetchHint &fetchHint);
+            const QContactFetchHint &fetchHint,
+            const QString &continuation = QString(),
+            QString *nextContinuation = 0);
 
     QContactManager::Error readContacts(
             const QString &table,
@@ -65,7 +72,20 @@ public:
     QContactManager::Error readContactIds(
             QList<QContactIdType> *contactIds,
             const QContactFilter &filter,
-            const QList<QContactSortOrder> &order);
+            const QList<QContactSortOrder> &order,
+            const QString &continuation = QString(),
+            int pageSize = -1,
+            QString *nextContinuation = 0);
+
+    // Reports the contacts added, changed and removed since the change sequence recorded in the token,
+    // and provides the token for the next call; an empty token reports every contact as added
+    QContactManager::Error readContactChanges(
+            QList<QContactIdType> *addedIds,
+            QList<QContactIdType> *changedIds,
+            QList<QContactIdType> *removedIds,
+            const QString &syncTarget,
+            const QString &token,
+            QString *nextToken);
 
     QContactManager::Error getIdentity(
             ContactsDatabase::Identity identity, QContactIdType *contactId);
@@ -76,16 +96,43 @@ public:
             const QContactId &first,
             const QContactId &second);
 
+    int cachedQueryHits() const;
+    int cachedQueryMisses() const;
+
+    // Empties the temporary tables of the connection, which an aborted read may not have cleared
+    void clearTemporaryTables();
+
 protected:
     QContactManager::Error queryContacts(
             const QString &table, QList<QContact> *contacts, const QContactFetchHint &fetchHint);
 
+    // Called for each batch read, with only the results added since the previous call
     virtual void contactsAvailable(const QList<QContact> &contacts);
     virtual void contactIdsAvailable(const QList<QContactIdType> &contactIds);
 
+    // Checked after each batch read; a cancelled read stops without reading further results
+    virtual bool cancelled() const;
+
 private:
+    QContactManager::Error createTemporaryContactIdsTable(
+            const QString &table, bool filter,
+            const QVariantList &boundIds,
+            const QString &join, const QString &where, const QString &orderBy, const QVariantList &boundValues);
+    void clearTemporaryContactIdsTable(const QString &table);
+
+    QContactManager::Error readRemovedContactIds(
+            QList<QContactIdType> *contactIds, const QString &since);
+
+    bool prepareCachedQuery(const QString &statement, QSqlQuery *query);
+
     QSqlDatabase m_database;
+    bool m_searchIndex;
     QMap<QString, QMap<QString, QSqlQuery> > m_cachedDetailTableQueries;
+    QHash<QString, QSqlQuery> m_cachedQueries;
+    QStringList m_cachedQueryOrder;
+    int m_cachedQueryHits;
+    int m_cachedQueryMisses;
+    QSet<QString> m_temporaryTables;
 };
 
 #endif
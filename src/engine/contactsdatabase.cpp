@@ -68,7 +68,12 @@ static const char *createContactsTable =
         "\n hasPhoneNumber BOOL DEFAULT 0,"
         "\n hasEmailAddress BOOL DEFAULT 0,"
         "\n hasOnlineAccount BOOL DEFAULT 0,"
-        "\n isOnline BOOL DEFAULT 0);";
+        "\n isOnline BOOL DEFAULT 0,"
+        "\n displayLabelSortKey TEXT,"
+        "\n firstNameSortKey TEXT,"
+        "\n lastNameSortKey TEXT,"
+        "\n createdSequence INTEGER DEFAULT 0,"
+        "\n changeSequence INTEGER DEFAULT 0);";
 
 static const char *createAddressesTable =
         "\n CREATE TABLE Addresses ("
@@ -176,7 +181,8 @@ static const char *createPhoneNumbersTable =
         "\n contactId INTEGER KEY,"
         "\n phoneNumber TEXT,"
         "\n subTypes TEXT,"
-        "\n normalizedNumber TEXT);";
+        "\n normalizedNumber TEXT,"
+        "\n reversedNumber TEXT);";
 
 static const char *createPresencesTable =
         "\n CREATE TABLE Presences ("
@@ -280,10 +286,17 @@ static const char *createRelationshipsTable =
         "\n type TEXT,"
         "\n PRIMARY KEY (firstId, secondId, type));";
 
+// Contacts staged in BulkRemovals have their details, index entries and tombstones
+// maintained by set-based statements before deletion, so the per-row triggers skip them
+static const char *createBulkRemovalsTable =
+        "\n CREATE TABLE BulkRemovals ("
+        "\n contactId INTEGER PRIMARY KEY);";
+
 static const char *createRemoveTrigger =
         "\n CREATE TRIGGER RemoveContactDetails"
         "\n BEFORE DELETE"
         "\n ON Contacts"
+        "\n WHEN NOT EXISTS (SELECT contactId FROM BulkRemovals WHERE contactId = old.contactId)"
         "\n BEGIN"
         "\n  DELETE FROM Addresses WHERE contactId = old.contactId;"
         "\n  DELETE FROM Anniversaries WHERE contactId = old.contactId;"
@@ -422,6 +435,18 @@ static const char *createContactsFirstNameIndex =
 static const char *createContactsLastNameIndex =
         "\n CREATE INDEX ContactsLastNameIndex ON Contacts(lowerLastName);";
 
+static const char *createContactsFirstNameSortIndex =
+        "\n CREATE INDEX ContactsFirstNameSortIndex ON Contacts(firstNameSortKey, lastNameSortKey, displayLabelSortKey);";
+
+static const char *createContactsLastNameSortIndex =
+        "\n CREATE INDEX ContactsLastNameSortIndex ON Contacts(lastNameSortKey, firstNameSortKey, displayLabelSortKey);";
+
+static const char *createContactsDisplayLabelSortIndex =
+        "\n CREATE INDEX ContactsDisplayLabelSortIndex ON Contacts(displayLabelSortKey);";
+
+static const char *createContactsChangeSequenceIndex =
+        "\n CREATE INDEX ContactsChangeSequenceIndex ON Contacts(changeSequence);";
+
 static const char *createRelationshipsFirstIdIndex =
         "\n CREATE INDEX RelationshipsFirstIdIndex ON Relationships(firstId);";
 
@@ -431,6 +456,9 @@ static const char *createRelationshipsSecondIdIndex =
 static const char *createPhoneNumbersIndex =
         "\n CREATE INDEX PhoneNumbersIndex ON PhoneNumbers(normalizedNumber);";
 
+static const char *createPhoneNumbersReversedIndex =
+        "\n CREATE INDEX PhoneNumbersReversedIndex ON PhoneNumbers(reversedNumber);";
+
 static const char *createEmailAddressesIndex =
         "\n CREATE INDEX EmailAddressesIndex ON EmailAddresses(lowerEmailAddress);";
 
@@ -490,6 +518,7 @@ static const char *createTables[] =
     createTpMetadataDetailsContactIdIndex,
     createIdentitiesTable,
     createRelationshipsTable,
+    createBulkRemovalsTable,
     createRemoveTrigger,
     createLocalSelfContact,
 #ifdef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
@@ -499,9 +528,14 @@ static const char *createTables[] =
     createContactsSyncTargetIndex,
     createContactsFirstNameIndex,
     createContactsLastNameIndex,
+    createContactsFirstNameSortIndex,
+    createContactsLastNameSortIndex,
+    createContactsDisplayLabelSortIndex,
+    createContactsChangeSequenceIndex,
     createRelationshipsFirstIdIndex,
     createRelationshipsSecondIdIndex,
     createPhoneNumbersIndex,
+    createPhoneNumbersReversedIndex,
     createEmailAddressesIndex,
     createOnlineAccountsIndex,
     createNicknamesIndex,
@@ -576,12 +610,130 @@ static bool setContactsIsOnline(QSqlDatabase &database)
 
 static const ExtraColumn contactsIsOnline = { "Contacts", "isOnline", "BOOL", &setContactsIsOnline };
 
+static bool setPhoneNumbersReversedNumber(QSqlDatabase &database)
+{
+    // The reversal cannot be expressed in SQL, so each existing number is rewritten here
+    QSqlQuery select(database);
+    if (!select.exec(QString::fromLatin1("SELECT detailId, phoneNumber FROM PhoneNumbers"))) {
+        qWarning() << "Unable to select phone numbers";
+        qWarning() << select.lastError();
+        return false;
+    }
+
+    QVariantList detailIds;
+    QVariantList reversedNumbers;
+    while (select.next()) {
+        detailIds.append(select.value(0));
+        reversedNumbers.append(ContactsDatabase::reversedPhoneNumber(select.value(1).toString()));
+    }
+    select.finish();
+
+    if (!detailIds.isEmpty()) {
+        QSqlQuery update(database);
+        if (!update.prepare(QString::fromLatin1("UPDATE PhoneNumbers SET reversedNumber = :reversedNumber WHERE detailId = :detailId"))) {
+            qWarning() << "Unable to prepare phone number update";
+            qWarning() << update.lastError();
+            return false;
+        }
+
+        update.addBindValue(reversedNumbers);
+        update.addBindValue(detailIds);
+        if (!update.execBatch()) {
+            qWarning() << "Unable to update phone numbers";
+            qWarning() << update.lastError();
+            return false;
+        }
+    }
+
+    return execute(database, QLatin1String(createPhoneNumbersReversedIndex));
+}
+
+static const ExtraColumn phoneNumbersReversedNumber = { "PhoneNumbers", "reversedNumber", "TEXT", &setPhoneNumbersReversedNumber };
+
+static bool setContactsSortKey(QSqlDatabase &database, const QString &column)
+{
+    QSqlQuery select(database);
+    if (!select.exec(QString::fromLatin1("SELECT contactId, %1 FROM Contacts").arg(column))) {
+        qWarning() << "Unable to select contact column:" << column;
+        qWarning() << select.lastError();
+        return false;
+    }
+
+    QVariantList contactIds;
+    QVariantList sortKeys;
+    while (select.next()) {
+        contactIds.append(select.value(0));
+        sortKeys.append(ContactsDatabase::sortKey(select.value(1).toString()));
+    }
+    select.finish();
+
+    if (contactIds.isEmpty())
+        return true;
+
+    QSqlQuery update(database);
+    if (!update.prepare(QString::fromLatin1("UPDATE Contacts SET %1SortKey = :sortKey WHERE contactId = :contactId").arg(column))) {
+        qWarning() << "Unable to prepare sort key update for column:" << column;
+        qWarning() << update.lastError();
+        return false;
+    }
+
+    update.addBindValue(sortKeys);
+    update.addBindValue(contactIds);
+    if (!update.execBatch()) {
+        qWarning() << "Unable to update sort keys for column:" << column;
+        qWarning() << update.lastError();
+        return false;
+    }
+    return true;
+}
+
+static bool setContactsDisplayLabelSortKey(QSqlDatabase &database)
+{
+    return setContactsSortKey(database, QString::fromLatin1("displayLabel"));
+}
+
+static const ExtraColumn contactsDisplayLabelSortKey = { "Contacts", "displayLabelSortKey", "TEXT", &setContactsDisplayLabelSortKey };
+
+static bool setContactsFirstNameSortKey(QSqlDatabase &database)
+{
+    return setContactsSortKey(database, QString::fromLatin1("firstName"));
+}
+
+static const ExtraColumn contactsFirstNameSortKey = { "Contacts", "firstNameSortKey", "TEXT", &setContactsFirstNameSortKey };
+
+static bool setContactsLastNameSortKey(QSqlDatabase &database)
+{
+    // This is the last of the sort key columns to be added, so the indexes can now be created
+    return setContactsSortKey(database, QString::fromLatin1("lastName"))
+        && execute(database, QLatin1String(createContactsFirstNameSortIndex))
+        && execute(database, QLatin1String(createContactsLastNameSortIndex))
+        && execute(database, QLatin1String(createContactsDisplayLabelSortIndex));
+}
+
+static const ExtraColumn contactsLastNameSortKey = { "Contacts", "lastNameSortKey", "TEXT", &setContactsLastNameSortKey };
+
+static const ExtraColumn contactsCreatedSequence = { "Contacts", "createdSequence", "INTEGER DEFAULT 0", 0 };
+
+static bool setContactsChangeSequence(QSqlDatabase &database)
+{
+    // Existing contacts keep sequence zero, so they are reported as changed only once written again
+    return execute(database, QLatin1String(createContactsChangeSequenceIndex));
+}
+
+static const ExtraColumn contactsChangeSequence = { "Contacts", "changeSequence", "INTEGER DEFAULT 0", &setContactsChangeSequence };
+
 static const ExtraColumn *extraColumns[] =
 {
     &contactsHasPhoneNumber,
     &contactsHasEmailAddress,
     &contactsHasOnlineAccount,
-    &contactsIsOnline
+    &contactsIsOnline,
+    &phoneNumbersReversedNumber,
+    &contactsDisplayLabelSortKey,
+    &contactsFirstNameSortKey,
+    &contactsLastNameSortKey,
+    &contactsCreatedSequence,
+    &contactsChangeSequence
 };
 
 static bool addColumn(const ExtraColumn *columnDef, QSqlDatabase &database)
@@ -664,6 +816,494 @@ static bool upgradeDatabase(QSqlDatabase &database)
     }
 }
 
+static const char *createSearchIndexTable =
+        "\n CREATE VIRTUAL TABLE SearchIndex USING fts4("
+        "\n displayLabel,"
+        "\n firstName,"
+        "\n middleName,"
+        "\n lastName,"
+        "\n nickname,"
+        "\n emailAddress,"
+        "\n note,"
+        "\n organization);";
+
+static const char *populateSearchIndex =
+        "\n INSERT INTO SearchIndex ("
+        "\n docid,"
+        "\n displayLabel,"
+        "\n firstName,"
+        "\n middleName,"
+        "\n lastName,"
+        "\n nickname,"
+        "\n emailAddress,"
+        "\n note,"
+        "\n organization)"
+        "\n SELECT"
+        "\n  Contacts.contactId,"
+        "\n  Contacts.displayLabel,"
+        "\n  Contacts.firstName,"
+        "\n  Contacts.middleName,"
+        "\n  Contacts.lastName,"
+        "\n  (SELECT group_concat(nickname, ' ') FROM Nicknames WHERE Nicknames.contactId = Contacts.contactId),"
+        "\n  (SELECT group_concat(emailAddress, ' ') FROM EmailAddresses WHERE EmailAddresses.contactId = Contacts.contactId),"
+        "\n  (SELECT group_concat(note, ' ') FROM Notes WHERE Notes.contactId = Contacts.contactId),"
+        "\n  (SELECT group_concat(name, ' ') FROM Organizations WHERE Organizations.contactId = Contacts.contactId)"
+        "\n FROM Contacts;";
+
+static const char *createSearchIndexRemoveTrigger =
+        "\n CREATE TRIGGER RemoveContactSearchIndex"
+        "\n BEFORE DELETE"
+        "\n ON Contacts"
+        "\n WHEN NOT EXISTS (SELECT contactId FROM BulkRemovals WHERE contactId = old.contactId)"
+        "\n BEGIN"
+        "\n  DELETE FROM SearchIndex WHERE docid = old.contactId;"
+        "\n END;";
+
+static const char *createSearchIndex[] =
+{
+    createSearchIndexTable,
+    populateSearchIndex,
+    createSearchIndexRemoveTrigger
+};
+
+static const char *createKeypadIndexTable =
+        "\n CREATE TABLE KeypadIndex ("
+        "\n contactId INTEGER KEY,"
+        "\n field TEXT,"
+        "\n keypad TEXT);";
+
+static const char *createKeypadIndexValueIndex =
+        "\n CREATE INDEX KeypadIndexValueIndex ON KeypadIndex(field, keypad);";
+
+static const char *createKeypadIndexContactIdIndex =
+        "\n CREATE INDEX KeypadIndexContactIdIndex ON KeypadIndex(contactId);";
+
+static const char *createKeypadIndexRemoveTrigger =
+        "\n CREATE TRIGGER RemoveContactKeypadIndex"
+        "\n BEFORE DELETE"
+        "\n ON Contacts"
+        "\n WHEN NOT EXISTS (SELECT contactId FROM BulkRemovals WHERE contactId = old.contactId)"
+        "\n BEGIN"
+        "\n  DELETE FROM KeypadIndex WHERE contactId = old.contactId;"
+        "\n END;";
+
+static const char *createKeypadIndex[] =
+{
+    createKeypadIndexTable,
+    createKeypadIndexValueIndex,
+    createKeypadIndexContactIdIndex,
+    createKeypadIndexRemoveTrigger
+};
+
+static void appendKeypadRow(QVariantList *contactIds, QVariantList *fields, QVariantList *values,
+                            const QVariant &contactId, const char *field, const QVariant &value)
+{
+    const QString keypad(ContactsDatabase::keypadDigits(value.toString()));
+    if (!keypad.isEmpty()) {
+        contactIds->append(contactId);
+        fields->append(QString::fromLatin1(field));
+        values->append(keypad);
+    }
+}
+
+static bool populateKeypadIndex(QSqlDatabase &database)
+{
+    // The keypad encoding cannot be expressed in SQL, so the existing names are encoded here
+    QVariantList contactIds;
+    QVariantList fields;
+    QVariantList values;
+
+    QSqlQuery query(database);
+    if (!query.exec(QString::fromLatin1("SELECT contactId, displayLabel, firstName, middleName, lastName FROM Contacts"))) {
+        qWarning() << "Unable to select contact names";
+        qWarning() << query.lastError();
+        return false;
+    }
+    while (query.next()) {
+        const QVariant contactId(query.value(0));
+        appendKeypadRow(&contactIds, &fields, &values, contactId, "displayLabel", query.value(1));
+        appendKeypadRow(&contactIds, &fields, &values, contactId, "firstName", query.value(2));
+        appendKeypadRow(&contactIds, &fields, &values, contactId, "middleName", query.value(3));
+        appendKeypadRow(&contactIds, &fields, &values, contactId, "lastName", query.value(4));
+    }
+    query.finish();
+
+    if (!query.exec(QString::fromLatin1("SELECT contactId, nickname FROM Nicknames"))) {
+        qWarning() << "Unable to select contact nicknames";
+        qWarning() << query.lastError();
+        return false;
+    }
+    while (query.next()) {
+        appendKeypadRow(&contactIds, &fields, &values, query.value(0), "nickname", query.value(1));
+    }
+    query.finish();
+
+    if (contactIds.isEmpty())
+        return true;
+
+    QSqlQuery insert(database);
+    if (!insert.prepare(QString::fromLatin1("INSERT INTO KeypadIndex (contactId, field, keypad) VALUES (:contactId, :field, :keypad)"))) {
+        qWarning() << "Unable to prepare keypad index insert";
+        qWarning() << insert.lastError();
+        return false;
+    }
+
+    insert.addBindValue(contactIds);
+    insert.addBindValue(fields);
+    insert.addBindValue(values);
+    if (!insert.execBatch()) {
+        qWarning() << "Unable to populate keypad index";
+        qWarning() << insert.lastError();
+        return false;
+    }
+    return true;
+}
+
+// The change sequence is advanced by every write transaction, and recorded in the rows it writes;
+// since writers are serialized, the sequence orders changes as they were committed.  The pruned
+// sequence is the latest of the removals whose tombstones have been discarded.
+static const char *createChangeSequenceTable =
+        "\n CREATE TABLE ChangeSequence ("
+        "\n sequence INTEGER NOT NULL,"
+        "\n pruned INTEGER NOT NULL);";
+
+static const char *initializeChangeSequence =
+        "\n INSERT INTO ChangeSequence (sequence, pruned) VALUES (0, 0);";
+
+static const char *createChangeSequence[] =
+{
+    createChangeSequenceTable,
+    initializeChangeSequence
+};
+
+static const char *createTombstonesTable =
+        "\n CREATE TABLE Tombstones ("
+        "\n contactId INTEGER PRIMARY KEY,"
+        "\n syncTarget TEXT,"
+        "\n removed REAL,"
+        "\n changeSequence INTEGER);";
+
+static const char *createTombstonesRemovedIndex =
+        "\n CREATE INDEX TombstonesRemovedIndex ON Tombstones(removed);";
+
+static const char *createTombstonesChangeSequenceIndex =
+        "\n CREATE INDEX TombstonesChangeSequenceIndex ON Tombstones(changeSequence);";
+
+static const char *createContactsCreatedIndex =
+        "\n CREATE INDEX ContactsCreatedIndex ON Contacts(created);";
+
+static const char *createContactsModifiedIndex =
+        "\n CREATE INDEX ContactsModifiedIndex ON Contacts(modified);";
+
+// The removal time is stored as a julian day number, since the format of the
+// timestamps written by the SQL driver differs between Qt versions
+static const char *createTombstoneTrigger =
+        "\n CREATE TRIGGER RecordContactTombstone"
+        "\n BEFORE DELETE"
+        "\n ON Contacts"
+        "\n WHEN NOT EXISTS (SELECT contactId FROM BulkRemovals WHERE contactId = old.contactId)"
+        "\n BEGIN"
+        "\n  INSERT OR REPLACE INTO Tombstones (contactId, syncTarget, removed, changeSequence)"
+        "\n  VALUES (old.contactId, old.syncTarget, julianday('now'), (SELECT sequence FROM ChangeSequence));"
+        "\n END;";
+
+static const char *createTombstones[] =
+{
+    createTombstonesTable,
+    createTombstonesRemovedIndex,
+    createTombstonesChangeSequenceIndex,
+    createContactsCreatedIndex,
+    createContactsModifiedIndex,
+    createTombstoneTrigger
+};
+
+static const char *createFingerprintsTable =
+        "\n CREATE TABLE Fingerprints ("
+        "\n contactId INTEGER PRIMARY KEY,"
+        "\n fingerprint BLOB);";
+
+static const char *createFingerprintsRemoveTrigger =
+        "\n CREATE TRIGGER RemoveContactFingerprint"
+        "\n BEFORE DELETE"
+        "\n ON Contacts"
+        "\n WHEN NOT EXISTS (SELECT contactId FROM BulkRemovals WHERE contactId = old.contactId)"
+        "\n BEGIN"
+        "\n  DELETE FROM Fingerprints WHERE contactId = old.contactId;"
+        "\n END;";
+
+static const char *createFingerprints[] =
+{
+    createFingerprintsTable,
+    createFingerprintsRemoveTrigger
+};
+
+static const char *createMatchKeysTable =
+        "\n CREATE TABLE MatchKeys ("
+        "\n contactId INTEGER KEY,"
+        "\n keyType INTEGER,"
+        "\n matchKey TEXT);";
+
+static const char *createMatchKeysKeyIndex =
+        "\n CREATE INDEX MatchKeysKeyIndex ON MatchKeys(keyType, matchKey, contactId);";
+
+static const char *createMatchKeysContactIdIndex =
+        "\n CREATE INDEX MatchKeysContactIdIndex ON MatchKeys(contactId);";
+
+static const char *createMatchKeysRemoveTrigger =
+        "\n CREATE TRIGGER RemoveContactMatchKeys"
+        "\n BEFORE DELETE"
+        "\n ON Contacts"
+        "\n WHEN NOT EXISTS (SELECT contactId FROM BulkRemovals WHERE contactId = old.contactId)"
+        "\n BEGIN"
+        "\n  DELETE FROM MatchKeys WHERE contactId = old.contactId;"
+        "\n END;";
+
+static const char *createMatchKeys[] =
+{
+    createMatchKeysTable,
+    createMatchKeysKeyIndex,
+    createMatchKeysContactIdIndex,
+    createMatchKeysRemoveTrigger
+};
+
+static bool populateMatchKeys(QSqlDatabase &database)
+{
+    // Only aggregate contacts are candidates for matching
+    const QString statement(QString::fromLatin1(
+            "INSERT INTO MatchKeys (contactId, keyType, matchKey)"
+            " SELECT contactId, %1, lowerLastName FROM Contacts"
+            "  WHERE syncTarget = 'aggregate' AND lowerLastName != ''"
+            " UNION SELECT Nicknames.contactId, %2, lowerNickname FROM Nicknames"
+            "  JOIN Contacts ON Contacts.contactId = Nicknames.contactId"
+            "  WHERE syncTarget = 'aggregate' AND lowerNickname != ''"
+            " UNION SELECT PhoneNumbers.contactId, %3, normalizedNumber FROM PhoneNumbers"
+            "  JOIN Contacts ON Contacts.contactId = PhoneNumbers.contactId"
+            "  WHERE syncTarget = 'aggregate' AND normalizedNumber != ''"
+            " UNION SELECT EmailAddresses.contactId, %4, lowerEmailAddress FROM EmailAddresses"
+            "  JOIN Contacts ON Contacts.contactId = EmailAddresses.contactId"
+            "  WHERE syncTarget = 'aggregate' AND lowerEmailAddress != ''"
+            " UNION SELECT OnlineAccounts.contactId, %5, lowerAccountUri FROM OnlineAccounts"
+            "  JOIN Contacts ON Contacts.contactId = OnlineAccounts.contactId"
+            "  WHERE syncTarget = 'aggregate' AND lowerAccountUri != ''"));
+    if (!execute(database, statement.arg(ContactsDatabase::LastNameKey)
+                                    .arg(ContactsDatabase::NicknameKey)
+                                    .arg(ContactsDatabase::PhoneNumberKey)
+                                    .arg(ContactsDatabase::EmailAddressKey)
+                                    .arg(ContactsDatabase::AccountUriKey))) {
+        return false;
+    }
+
+    // The name prefixes cannot be expressed in SQL, so they are generated here
+    QVariantList contactIds;
+    QVariantList keyTypes;
+    QVariantList keys;
+
+    QSqlQuery query(database);
+    if (!query.exec(QString::fromLatin1("SELECT contactId, lowerFirstName FROM Contacts WHERE syncTarget = 'aggregate'"))) {
+        qWarning() << "Unable to select aggregate names";
+        qWarning() << query.lastError();
+        return false;
+    }
+    while (query.next()) {
+        foreach (const QString &prefix, ContactsDatabase::namePrefixes(query.value(1).toString())) {
+            contactIds.append(query.value(0));
+            keyTypes.append(static_cast<int>(ContactsDatabase::FirstNamePrefixKey));
+            keys.append(prefix);
+        }
+    }
+    query.finish();
+
+    if (contactIds.isEmpty())
+        return true;
+
+    QSqlQuery insert(database);
+    if (!insert.prepare(QString::fromLatin1("INSERT INTO MatchKeys (contactId, keyType, matchKey) VALUES (:contactId, :keyType, :matchKey)"))) {
+        qWarning() << "Unable to prepare match key insert";
+        qWarning() << insert.lastError();
+        return false;
+    }
+
+    insert.addBindValue(contactIds);
+    insert.addBindValue(keyTypes);
+    insert.addBindValue(keys);
+    if (!insert.execBatch()) {
+        qWarning() << "Unable to populate match keys";
+        qWarning() << insert.lastError();
+        return false;
+    }
+    return true;
+}
+
+static const char *createDeferredAggregatesTable =
+        "\n CREATE TABLE DeferredAggregates ("
+        "\n contactId INTEGER PRIMARY KEY);";
+
+static const char *createDeferredAggregatesRemoveTrigger =
+        "\n CREATE TRIGGER RemoveDeferredAggregate"
+        "\n BEFORE DELETE"
+        "\n ON Contacts"
+        "\n WHEN NOT EXISTS (SELECT contactId FROM BulkRemovals WHERE contactId = old.contactId)"
+        "\n BEGIN"
+        "\n  DELETE FROM DeferredAggregates WHERE contactId = old.contactId;"
+        "\n END;";
+
+static const char *createDeferredAggregates[] =
+{
+    createDeferredAggregatesTable,
+    createDeferredAggregatesRemoveTrigger
+};
+
+static const char *createBulkRemovals[] =
+{
+    createBulkRemovalsTable
+};
+
+struct ExtraTable {
+    const char *name;
+    const char **statements;
+    int statementCount;
+    bool (*postInstall)(QSqlDatabase &);
+    bool optional;
+};
+
+static const ExtraTable searchIndexTable = { "SearchIndex", createSearchIndex, lengthOf(createSearchIndex), 0, true };
+static const ExtraTable keypadIndexTable = { "KeypadIndex", createKeypadIndex, lengthOf(createKeypadIndex), &populateKeypadIndex, false };
+static const ExtraTable changeSequenceTable = { "ChangeSequence", createChangeSequence, lengthOf(createChangeSequence), 0, false };
+static const ExtraTable tombstonesTable = { "Tombstones", createTombstones, lengthOf(createTombstones), 0, false };
+static const ExtraTable fingerprintsTable = { "Fingerprints", createFingerprints, lengthOf(createFingerprints), 0, false };
+static const ExtraTable matchKeysTable = { "MatchKeys", createMatchKeys, lengthOf(createMatchKeys), &populateMatchKeys, false };
+static const ExtraTable deferredAggregatesTable = { "DeferredAggregates", createDeferredAggregates, lengthOf(createDeferredAggregates), 0, false };
+static const ExtraTable bulkRemovalsTable = { "BulkRemovals", createBulkRemovals, lengthOf(createBulkRemovals), 0, false };
+
+// BulkRemovals is added first, since the removal triggers of the other tables refer to it;
+// likewise ChangeSequence precedes the tombstone trigger
+static const ExtraTable *extraTables[] =
+{
+    &bulkRemovalsTable,
+    &changeSequenceTable,
+    &searchIndexTable,
+    &keypadIndexTable,
+    &tombstonesTable,
+    &fingerprintsTable,
+    &matchKeysTable,
+    &deferredAggregatesTable
+};
+
+// Databases created before BulkRemovals existed have removal triggers which do not skip the
+// contacts staged for set-based removal; each existing trigger is replaced with its current form
+struct GuardedTrigger {
+    const char *name;
+    const char *statement;
+};
+
+static const GuardedTrigger guardedTriggers[] =
+{
+    { "RemoveContactDetails", createRemoveTrigger },
+    { "RemoveContactSearchIndex", createSearchIndexRemoveTrigger },
+    { "RemoveContactKeypadIndex", createKeypadIndexRemoveTrigger },
+    { "RecordContactTombstone", createTombstoneTrigger },
+    { "RemoveContactFingerprint", createFingerprintsRemoveTrigger },
+    { "RemoveContactMatchKeys", createMatchKeysRemoveTrigger },
+    { "RemoveDeferredAggregate", createDeferredAggregatesRemoveTrigger }
+};
+
+static bool upgradeTriggers(QSqlDatabase &database)
+{
+    static const QLatin1String sql("SELECT sql FROM sqlite_master WHERE type = 'trigger' and name = '%1'");
+
+    if (!database.transaction())
+        return false;
+
+    for (int i = 0; i < lengthOf(guardedTriggers); ++i) {
+        const GuardedTrigger &trigger(guardedTriggers[i]);
+
+        QSqlQuery query(database);
+        if (!query.exec(QString(sql).arg(QString::fromLatin1(trigger.name)))) {
+            qWarning() << "Unable to query trigger:" << trigger.name;
+            qWarning() << query.lastError();
+            database.rollback();
+            return false;
+        }
+        const bool replace = query.next() && !query.value(0).toString().contains(QLatin1String("BulkRemovals"));
+        query.finish();
+
+        if (replace) {
+            if (!execute(database, QString::fromLatin1("DROP TRIGGER %1").arg(QString::fromLatin1(trigger.name)))
+                    || !execute(database, QLatin1String(trigger.statement))) {
+                qWarning() << "Unable to replace trigger:" << trigger.name;
+                database.rollback();
+                return false;
+            }
+            qDebug() << "Replaced trigger:" << trigger.name;
+        }
+    }
+
+    return database.commit();
+}
+
+static bool tableExists(const char *table, QSqlDatabase &database)
+{
+    static const QLatin1String sql("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' and name = '%1'");
+
+    QSqlQuery query(database);
+    if (!query.exec(QString(sql).arg(QString::fromLatin1(table))) || !query.next()) {
+        qWarning() << "Unable to query existence of table:" << table;
+        return false;
+    }
+    return query.value(0).toInt() > 0;
+}
+
+static bool addTable(const ExtraTable *tableDef, QSqlDatabase &database)
+{
+    if (!database.transaction())
+        return false;
+
+    if (tableExists(tableDef->name, database)) {
+        database.rollback();
+        return true;
+    }
+
+    for (int i = 0; i < tableDef->statementCount; ++i) {
+        QSqlQuery query(database);
+
+        if (!query.exec(QLatin1String(tableDef->statements[i]))) {
+            qWarning() << "Unable to create table:" << tableDef->name;
+            qWarning() << query.lastError();
+            qWarning() << tableDef->statements[i];
+            database.rollback();
+            return false;
+        }
+    }
+
+    if (tableDef->postInstall && !(*tableDef->postInstall)(database)) {
+        qWarning() << "Unable to run post install function for table:" << tableDef->name;
+        database.rollback();
+        return false;
+    }
+
+    if (!database.commit())
+        return false;
+
+    qDebug() << "Added table:" << tableDef->name;
+    return true;
+}
+
+static bool addTables(QSqlDatabase &database)
+{
+    // Optional tables that fail to be created are omitted; in particular, the search index
+    // is not available if the full-text search module is not available, in which
+    // case filters are evaluated against the detail tables directly.  The other tables
+    // are used by queries and writes unconditionally, so failing to create them is fatal.
+    for (int i = 0; i < lengthOf(extraTables); ++i) {
+        const ExtraTable *tableDef = extraTables[i];
+        if (!addTable(tableDef, database) && !tableDef->optional) {
+            qWarning() << "Unable to add required table:" << tableDef->name;
+            return false;
+        }
+    }
+    return true;
+}
+
 static bool prepareDatabase(QSqlDatabase &database)
 {
     if (!execute(database, QLatin1String(setupEncoding))
@@ -695,7 +1335,7 @@ static bool prepareDatabase(QSqlDatabase &database)
     }
 }
 
-QSqlDatabase ContactsDatabase::open(const QString &databaseName)
+QSqlDatabase ContactsDatabase::open(const QString &databaseName, bool readOnly)
 {
     // horrible hack: Qt4 didn't have GenericDataLocation so we hardcode DATA_DIR location.
     QString privilegedDataDir(QString("%1/%2/")
@@ -722,6 +1362,23 @@ QSqlDatabase ContactsDatabase::open(const QString &databaseName)
     QSqlDatabase database = QSqlDatabase::addDatabase(QString::fromLatin1("QSQLITE"), databaseName);
     database.setDatabaseName(databaseFile);
 
+    if (readOnly) {
+        // Read-only connections rely on a read-write connection having already prepared
+        // the schema; they may still create temporary tables
+        if (!exists) {
+            qWarning() << "Cannot open nonexistent contacts database read-only:" << databaseFile;
+            return database;
+        }
+        database.setConnectOptions(QString::fromLatin1("QSQLITE_OPEN_READONLY"));
+        if (!database.open()) {
+            qWarning() << "Failed to open contacts database read-only";
+            qWarning() << database.lastError();
+        } else {
+            database.exec(QLatin1String(setupTempStore));
+        }
+        return database;
+    }
+
     if (!database.open()) {
         qWarning() << "Failed to open contacts database";
         qWarning() << database.lastError();
@@ -737,7 +1394,11 @@ QSqlDatabase ContactsDatabase::open(const QString &databaseName)
 
         return database;
     } else {
-        upgradeDatabase(database);
+        if (!upgradeDatabase(database) || !addTables(database) || !upgradeTriggers(database)) {
+            qWarning() << "Failed to upgrade contacts database:" << databaseFile;
+            database.close();
+            return database;
+        }
 
         database.exec(QLatin1String(setupTempStore));
         database.exec(QLatin1String(setupJournal));
@@ -746,6 +1407,110 @@ QSqlDatabase ContactsDatabase::open(const QString &databaseName)
     return database;
 }
 
+bool ContactsDatabase::hasSearchIndex(const QSqlDatabase &database)
+{
+    QSqlDatabase db(database);
+    return tableExists("SearchIndex", db);
+}
+
+QString ContactsDatabase::reversedPhoneNumber(const QString &input)
+{
+    // Remove the same formatting characters that phone number filters ignore
+    QString reversed;
+    reversed.reserve(input.size());
+    for (int i = input.size() - 1; i >= 0; --i) {
+        const QChar c(input.at(i));
+        if (c != QChar::fromLatin1('+') && c != QChar::fromLatin1('-') && c != QChar::fromLatin1('#')
+                && c != QChar::fromLatin1('(') && c != QChar::fromLatin1(')') && c != QChar::fromLatin1(' ')) {
+            reversed.append(c);
+        }
+    }
+    return reversed;
+}
+
+QString ContactsDatabase::sortKey(const QString &input)
+{
+    // Blank values are keyed to sort after all others, so that the common case of
+    // ascending order with blanks last can be satisfied directly from an index.
+    // Accents are removed and case folded, so that names sort by their base letters.
+    if (input.isEmpty())
+        return QString::fromLatin1("1");
+
+    const QString decomposed(input.normalized(QString::NormalizationForm_D));
+
+    QString key(QString::fromLatin1("0"));
+    key.reserve(decomposed.size() + 1);
+    for (int i = 0; i < decomposed.size(); ++i) {
+        const QChar c(decomposed.at(i));
+        if (c.category() != QChar::Mark_NonSpacing) {
+            key.append(c);
+        }
+    }
+    return key.toCaseFolded();
+}
+
+// The number of leading characters of each name token used to match names
+static const int NamePrefixLength = 4;
+
+static QStringList nameTokens(const QString &input)
+{
+    QStringList tokens;
+    QString token;
+    for (int i = 0; i <= input.size(); ++i) {
+        if (i < input.size() && input.at(i).isLetterOrNumber()) {
+            token.append(input.at(i));
+        } else if (!token.isEmpty()) {
+            tokens.append(token.toLower());
+            token.clear();
+        }
+    }
+    return tokens;
+}
+
+QStringList ContactsDatabase::namePrefixes(const QString &input)
+{
+    // Every prefix of every token is a key, so that a name can be found
+    // by the leading characters of any of its tokens
+    QStringList prefixes;
+    foreach (const QString &token, nameTokens(input)) {
+        for (int length = 1; length <= qMin(token.size(), NamePrefixLength); ++length) {
+            const QString prefix(token.left(length));
+            if (!prefixes.contains(prefix))
+                prefixes.append(prefix);
+        }
+    }
+    return prefixes;
+}
+
+QString ContactsDatabase::namePrefix(const QString &input)
+{
+    const QStringList tokens(nameTokens(input));
+    return tokens.isEmpty() ? QString() : tokens.first().left(NamePrefixLength);
+}
+
+QString ContactsDatabase::keypadDigits(const QString &input)
+{
+    // ITU-T E.161 keypad: 2 = abc, 3 = def, 4 = ghi, 5 = jkl, 6 = mno, 7 = pqrs, 8 = tuv, 9 = wxyz, 0 = space
+    static const char letterKeys[] = "22233344455566677778889999";
+
+    // Decompose accented letters so that they map to the key of their base letter
+    const QString decomposed(input.normalized(QString::NormalizationForm_D).toLower());
+
+    QString digits;
+    digits.reserve(decomposed.size());
+    for (int i = 0; i < decomposed.size(); ++i) {
+        const ushort c = decomposed.at(i).unicode();
+        if (c >= 'a' && c <= 'z') {
+            digits.append(QChar::fromLatin1(letterKeys[c - 'a']));
+        } else if ((c >= '0' && c <= '9') || c == '*' || c == '#') {
+            digits.append(QChar(c));
+        } else if (c == ' ') {
+            digits.append(QChar::fromLatin1('0'));
+        }
+    }
+    return digits;
+}
+
 QSqlQuery ContactsDatabase::prepare(const char *statement, const QSqlDatabase &database)
 {
     QSqlQuery query(database);
@@ -33,6 +33,7 @@
 #define QTCONTACTSSQLITE_CONTACTSDATABASE
 
 #include <QSqlDatabase>
+#include <QStringList>
 #include <QVariantList>
 
 class ContactsDatabase
@@ -42,7 +43,23 @@ public:
         SelfContactId
     };
 
-    static QSqlDatabase open(const QString &databaseName);
+    // The types of key by which aggregate contacts are matched to new contacts
+    enum MatchKeyType {
+        FirstNamePrefixKey = 1,
+        LastNameKey,
+        NicknameKey,
+        PhoneNumberKey,
+        EmailAddressKey,
+        AccountUriKey
+    };
+
+    static QSqlDatabase open(const QString &databaseName, bool readOnly = false);
+    static bool hasSearchIndex(const QSqlDatabase &database);
+    static QString reversedPhoneNumber(const QString &input);
+    static QString keypadDigits(const QString &input);
+    static QString sortKey(const QString &input);
+    static QStringList namePrefixes(const QString &input);
+    static QString namePrefix(const QString &input);
     static QSqlQuery prepare(const char *statement, const QSqlDatabase &database);
 
     static QString expandQuery(const QString &queryString, const QVariantList &bindings);
@@ -41,6 +41,8 @@
 
 #include <QCoreApplication>
 #include <QMutex>
+#include <QSqlDriver>
+#include <QSqlQuery>
 #include <QThread>
 #include <QWaitCondition>
 #include <QElapsedTimer>
@@ -61,10 +63,22 @@
 
 #include <QtDebug>
 
+#include <sqlite3.h>
+
 class Job
 {
 public:
     Job()
+        : m_lane(QContactAbstractRequest__NormalPriority)
+        , m_enqueueTime(0)
+        , m_deadlineTime(-1)
+        , m_queueWait(0)
+        , m_cachedQueryHits(0)
+        , m_cachedQueryMisses(0)
+        , m_ticket(0)
+        , m_predecessorThread(0)
+        , m_predecessorType(QContactAbstractRequest::InvalidRequest)
+        , m_predecessorTicket(0)
     {
     }
 
@@ -85,6 +99,75 @@ public:
 
     virtual QString description() const = 0;
     virtual QContactManager::Error error() const = 0;
+
+    // Jobs which write to the database may be committed together with adjacent writes
+    virtual bool writes() const { return false; }
+
+    // Scheduling state, with times measured by the clock of the executing thread
+    void schedule(int lane, qint64 enqueueTime, qint64 deadlineTime)
+    {
+        m_lane = lane;
+        m_enqueueTime = enqueueTime;
+        m_deadlineTime = deadlineTime;
+    }
+
+    void promote() { m_lane = QContactAbstractRequest__InteractivePriority; }
+
+    // Adopts the more urgent scheduling of a job whose request this job will also serve
+    void raise(const Job *other)
+    {
+        m_lane = qMax(m_lane, other->m_lane);
+        if (other->m_deadlineTime >= 0 && (m_deadlineTime < 0 || other->m_deadlineTime < m_deadlineTime))
+            m_deadlineTime = other->m_deadlineTime;
+    }
+
+    // A job may provide its results to the requests of equivalent jobs, which are then discarded
+    virtual bool share(Job *) { return false; }
+    virtual bool serves(QContactAbstractRequest *request) { return this->request() == request; }
+
+    // Stops serving a request; returns false if the job serves no other request
+    virtual bool release(QContactAbstractRequest *) { return false; }
+
+    int lane() const { return m_lane; }
+    qint64 enqueueTime() const { return m_enqueueTime; }
+    qint64 deadlineTime() const { return m_deadlineTime; }
+
+    qint64 queueWait() const { return m_queueWait; }
+    void setQueueWait(qint64 wait) { m_queueWait = wait; }
+
+    // Prepared statement cache counts of the connection, recorded when the job was executed
+    int cachedQueryHits() const { return m_cachedQueryHits; }
+    int cachedQueryMisses() const { return m_cachedQueryMisses; }
+    void setCachedQueryCounts(int hits, int misses) { m_cachedQueryHits = hits; m_cachedQueryMisses = misses; }
+
+    // The order in which the job was enqueued in its thread
+    int ticket() const { return m_ticket; }
+    void setTicket(int ticket) { m_ticket = ticket; }
+
+    // A job queued in a different thread from the earlier unfinished requests of its type must
+    // not execute until the jobs of that type enqueued in that thread up to a ticket have finished
+    void follow(JobThread *thread, QContactAbstractRequest::RequestType type, int ticket)
+    {
+        m_predecessorThread = thread;
+        m_predecessorType = type;
+        m_predecessorTicket = ticket;
+    }
+
+    JobThread *predecessorThread() const { return m_predecessorThread; }
+    QContactAbstractRequest::RequestType predecessorType() const { return m_predecessorType; }
+    int predecessorTicket() const { return m_predecessorTicket; }
+
+private:
+    int m_lane;
+    qint64 m_enqueueTime;
+    qint64 m_deadlineTime;
+    qint64 m_queueWait;
+    int m_cachedQueryHits;
+    int m_cachedQueryMisses;
+    int m_ticket;
+    JobThread *m_predecessorThread;
+    QContactAbstractRequest::RequestType m_predecessorType;
+    int m_predecessorTicket;
 };
 
 template <typename T>
@@ -133,6 +216,9 @@ public:
 #else
         , m_definitionMask(request->definitionMask())
 #endif
+        , m_import(request->property(QContactSaveRequest__BulkImport).toBool())
+        , m_unchangedCount(0)
+        , m_detailStatementCount(0)
     {
     }
 
@@ -140,15 +226,30 @@ public:
     {
         if (!writer)
             writer = new ContactWriter(engine, database, reader);
-        m_error = writer->save(&m_contacts, m_definitionMask, 0, &m_errorMap, false, false);
+        if (m_import) {
+            m_error = writer->import(&m_contacts, &m_errorMap);
+        } else {
+            m_error = writer->save(&m_contacts, m_definitionMask, 0, &m_errorMap, false, false);
+        }
+        m_unchangedCount = writer->unchangedCount();
+        m_detailStatementCount = writer->detailStatementCount();
     }
 
     void updateState(QContactAbstractRequest::State state)
     {
+        if (m_request && state == QContactAbstractRequest::FinishedState) {
+            m_request->setProperty(QContactSaveRequest__UnchangedCount, m_unchangedCount);
+            m_request->setProperty(QContactSaveRequest__DetailStatementCount, m_detailStatementCount);
+        }
          QContactManagerEngine::updateContactSaveRequest(
                      m_request, m_contacts, m_error, m_errorMap, state);
     }
 
+    bool writes() const
+    {
+        return true;
+    }
+
     QString description() const
     {
         QString s(QLatin1String("Save"));
@@ -161,6 +262,9 @@ public:
 private:
     QList<QContact> m_contacts;
     ContactWriter::DetailList m_definitionMask;
+    bool m_import;
+    int m_unchangedCount;
+    int m_detailStatementCount;
     QMap<int, QContactManager::Error> m_errorMap;
 };
 
@@ -190,6 +294,11 @@ public:
                 state);
     }
 
+    bool writes() const
+    {
+        return true;
+    }
+
     QString description() const
     {
         QString s(QLatin1String("Remove"));
@@ -204,6 +313,19 @@ private:
     QMap<int, QContactManager::Error> m_errorMap;
 };
 
+static bool fetchHintsEqual(const QContactFetchHint &lhs, const QContactFetchHint &rhs)
+{
+    return lhs.optimizationHints() == rhs.optimizationHints()
+        && lhs.maxCountHint() == rhs.maxCountHint()
+        && lhs.preferredImageSize() == rhs.preferredImageSize()
+        && lhs.relationshipTypesHint() == rhs.relationshipTypesHint()
+#ifdef USING_QTPIM
+        && lhs.detailTypesHint() == rhs.detailTypesHint();
+#else
+        && lhs.detailDefinitionsHint() == rhs.detailDefinitionsHint();
+#endif
+}
+
 class ContactFetchJob : public TemplateJob<QContactFetchRequest>
 {
 public:
@@ -212,6 +334,7 @@ public:
         , m_filter(request->filter())
         , m_fetchHint(request->fetchHint())
         , m_sorting(request->sorting())
+        , m_continuation(request->property(QContactAbstractRequest__ContinuationToken).toString())
     {
     }
 
@@ -223,35 +346,102 @@ public:
                 &contacts,
                 m_filter,
                 m_sorting,
-                m_fetchHint);
+                m_fetchHint,
+                m_continuation,
+                &m_nextContinuation);
     }
 
     void update(QMutex *mutex)
     {
-        QList<QContact> contacts;      {
+        QList<QContact> contacts;
+        {
             QMutexLocker locker(mutex);
-            contacts = m_contacts;
+            contacts.swap(m_pendingContacts);
         }
+        m_contacts.append(contacts);
         QContactManagerEngine::updateContactFetchRequest(
                 m_request,
-                contacts,
+                m_contacts,
                 QContactManager::NoError,
                 QContactAbstractRequest::ActiveState);
+        foreach (QContactFetchRequest *request, m_sharedRequests) {
+            QContactManagerEngine::updateContactFetchRequest(
+                    request,
+                    m_contacts,
+                    QContactManager::NoError,
+                    QContactAbstractRequest::ActiveState);
+        }
     }
 
     void updateState(QContactAbstractRequest::State state)
     {
+        m_contacts.append(m_pendingContacts);
+        m_pendingContacts.clear();
+        if (m_request && state == QContactAbstractRequest::FinishedState)
+            m_request->setProperty(QContactAbstractRequest__NextContinuationToken, m_nextContinuation);
         QContactManagerEngine::updateContactFetchRequest(m_request, m_contacts, m_error, state);
+        foreach (QContactFetchRequest *request, m_sharedRequests) {
+            if (state == QContactAbstractRequest::FinishedState)
+                request->setProperty(QContactAbstractRequest__NextContinuationToken, m_nextContinuation);
+            QContactManagerEngine::updateContactFetchRequest(request, m_contacts, m_error, state);
+        }
     }
 
     void contactsAvailable(const QList<QContact> &contacts)
     {
-        m_contacts = contacts;
+        m_pendingContacts.append(contacts);
+    }
+
+    bool share(Job *other)
+    {
+        if (!m_request || !other->request() || other->request()->type() != QContactAbstractRequest::ContactFetchRequest)
+            return false;
+
+        const ContactFetchJob *fetch = static_cast<const ContactFetchJob *>(other);
+        if (fetch->m_filter == m_filter
+                && fetch->m_sorting == m_sorting
+                && fetch->m_continuation == m_continuation
+                && fetchHintsEqual(fetch->m_fetchHint, m_fetchHint)) {
+            m_sharedRequests.append(fetch->m_request);
+            return true;
+        }
+        return false;
+    }
+
+    bool serves(QContactAbstractRequest *request)
+    {
+        if (request == m_request)
+            return true;
+        foreach (QContactFetchRequest *shared, m_sharedRequests) {
+            if (shared == request)
+                return true;
+        }
+        return false;
+    }
+
+    bool release(QContactAbstractRequest *request)
+    {
+        if (m_sharedRequests.isEmpty())
+            return false;
+
+        if (request == m_request) {
+            m_request = m_sharedRequests.takeFirst();
+            return true;
+        }
+        for (int i = 0; i < m_sharedRequests.count(); ++i) {
+            if (m_sharedRequests.at(i) == request) {
+                m_sharedRequests.removeAt(i);
+                return true;
+            }
+        }
+        return false;
     }
 
     QString description() const
     {
         QString s(QLatin1String("Fetch"));
+        if (!m_sharedRequests.isEmpty())
+            s.append(QString::fromLatin1(" (shared by %1 requests)").arg(m_sharedRequests.count() + 1));
         return s;
     }
 
@@ -259,7 +449,11 @@ private:
     QContactFilter m_filter;
     QContactFetchHint m_fetchHint;
     QList<QContactSortOrder> m_sorting;
+    QString m_continuation;
+    QString m_nextContinuation;
     QList<QContact> m_contacts;
+    QList<QContact> m_pendingContacts;
+    QList<QContactFetchRequest *> m_sharedRequests;
 };
 
 #ifdef USING_QTPIM
@@ -277,13 +471,25 @@ public:
         : TemplateJob(request)
         , m_filter(request->filter())
         , m_sorting(request->sorting())
+        , m_continuation(request->property(QContactAbstractRequest__ContinuationToken).toString())
+        , m_pageSize(request->property(QContactAbstractRequest__PageSize).isValid()
+                     ? request->property(QContactAbstractRequest__PageSize).toInt() : -1)
+        , m_changes(request->property(QContactIdFetchRequest__ChangesToken).isValid())
+        , m_changesToken(request->property(QContactIdFetchRequest__ChangesToken).toString())
+        , m_changesSyncTarget(request->property(QContactIdFetchRequest__ChangesSyncTarget).toString())
     {
     }
 
     void execute(const ContactsEngine &, QSqlDatabase &, ContactReader *reader, ContactWriter *&)
     {
+        if (m_changes) {
+            m_error = reader->readContactChanges(
+                        &m_addedIds, &m_changedIds, &m_removedIds, m_changesSyncTarget, m_changesToken, &m_nextChangesToken);
+            return;
+        }
+
         QList<QContactIdType> contactIds;
-        m_error = reader->readContactIds(&contactIds, m_filter, m_sorting);
+        m_error = reader->readContactIds(&contactIds, m_filter, m_sorting, m_continuation, m_pageSize, &m_nextContinuation);
     }
 
     void update(QMutex *mutex)
@@ -291,21 +497,35 @@ public:
         QList<QContactIdType> contactIds;
         {
             QMutexLocker locker(mutex);
-            contactIds = m_contactIds;
+            contactIds.swap(m_pendingContactIds);
         }
+        m_contactIds.append(contactIds);
 #ifdef USING_QTPIM
         QContactManagerEngine::updateContactIdFetchRequest(
 #else
         QContactManagerEngine::updateContactLocalIdFetchRequest(
 #endif
                 m_request,
-                contactIds,
+                m_contactIds,
                 QContactManager::NoError,
                 QContactAbstractRequest::ActiveState);
     }
 
     void updateState(QContactAbstractRequest::State state)
     {
+        m_contactIds.append(m_pendingContactIds);
+        m_pendingContactIds.clear();
+        if (m_request && state == QContactAbstractRequest::FinishedState) {
+            if (m_changes) {
+                m_contactIds = m_addedIds + m_changedIds;
+                m_request->setProperty(QContactIdFetchRequest__AddedIds, QVariant::fromValue(m_addedIds));
+                m_request->setProperty(QContactIdFetchRequest__ChangedIds, QVariant::fromValue(m_changedIds));
+                m_request->setProperty(QContactIdFetchRequest__RemovedIds, QVariant::fromValue(m_removedIds));
+                m_request->setProperty(QContactIdFetchRequest__NextChangesToken, m_nextChangesToken);
+            } else {
+                m_request->setProperty(QContactAbstractRequest__NextContinuationToken, m_nextContinuation);
+            }
+        }
 #ifdef USING_QTPIM
         QContactManagerEngine::updateContactIdFetchRequest(
 #else
@@ -316,7 +536,7 @@ public:
 
     void contactIdsAvailable(const QList<QContactIdType> &contactIds)
     {
-        m_contactIds = contactIds;
+        m_pendingContactIds.append(contactIds);
     }
 
     QString description() const
@@ -328,7 +548,18 @@ public:
 private:
     QContactFilter m_filter;
     QList<QContactSortOrder> m_sorting;
+    QString m_continuation;
+    int m_pageSize;
+    QString m_nextContinuation;
+    bool m_changes;
+    QString m_changesToken;
+    QString m_changesSyncTarget;
+    QString m_nextChangesToken;
+    QList<QContactIdType> m_addedIds;
+    QList<QContactIdType> m_changedIds;
+    QList<QContactIdType> m_removedIds;
     QList<QContactIdType> m_contactIds;
+    QList<QContactIdType> m_pendingContactIds;
 };
 
 class ContactFetchByIdJob : public TemplateJob<QContactFetchByIdRequest>
@@ -360,15 +591,16 @@ public:
         QList<QContact> contacts;
         {
             QMutexLocker locker(mutex);
-            contacts = m_contacts;
+            contacts.swap(m_pendingContacts);
         }
+        m_contacts.append(contacts);
 #ifdef USING_QTPIM
         QContactManagerEngine::updateContactFetchByIdRequest(
 #else
         QContactManagerEngineV2::updateContactFetchByIdRequest(
 #endif
                 m_request,
-                contacts,
+                m_contacts,
                 QContactManager::NoError,
                 QMap<int, QContactManager::Error>(),
                 QContactAbstractRequest::ActiveState);
@@ -376,6 +608,8 @@ public:
 
     void updateState(QContactAbstractRequest::State state)
     {
+        m_contacts.append(m_pendingContacts);
+        m_pendingContacts.clear();
 #ifdef USING_QTPIM
         QContactManagerEngine::updateContactFetchByIdRequest(
 #else
@@ -390,7 +624,7 @@ public:
 
     void contactsAvailable(const QList<QContact> &contacts)
     {
-        m_contacts = contacts;
+        m_pendingContacts.append(contacts);
     }
 
     QString description() const
@@ -406,6 +640,7 @@ private:
     QList<QContactIdType> m_contactIds;
     QContactFetchHint m_fetchHint;
     QList<QContact> m_contacts;
+    QList<QContact> m_pendingContacts;
 };
 
 
@@ -431,6 +666,11 @@ public:
                      m_request, m_relationships, m_error, m_errorMap, state);
     }
 
+    bool writes() const
+    {
+        return true;
+    }
+
     QString description() const
     {
         QString s(QLatin1String("Relationship Save"));
@@ -464,6 +704,11 @@ public:
                 m_request, m_error, m_errorMap, state);
     }
 
+    bool writes() const
+    {
+        return true;
+    }
+
     QString description() const
     {
         QString s(QLatin1String("Relationship Remove"));
@@ -519,16 +764,82 @@ private:
     QList<QContactRelationship> m_relationships;
 };
 
+// Regenerates the aggregates whose regeneration was deferred; it has no associated request
+class AggregationJob : public Job
+{
+public:
+    AggregationJob()
+        : m_error(QContactManager::NoError)
+    {
+    }
+
+    QContactAbstractRequest *request()
+    {
+        return 0;
+    }
+
+    void clear()
+    {
+    }
+
+    void execute(const ContactsEngine &engine, QSqlDatabase &database, ContactReader *reader, ContactWriter *&writer)
+    {
+        if (!writer)
+            writer = new ContactWriter(engine, database, reader);
+        m_error = writer->regenerateDeferredAggregates();
+    }
+
+    void updateState(QContactAbstractRequest::State)
+    {
+    }
+
+    QString description() const
+    {
+        return QLatin1String("Aggregation");
+    }
+
+    QContactManager::Error error() const
+    {
+        return m_error;
+    }
+
+private:
+    QContactManager::Error m_error;
+};
+
+// Read-only requests are distributed over at most this many threads, each with its own connection
+static const int maximumReaderThreads = 3;
+
+// The number of virtual machine instructions SQLite executes between checks for an interrupted read
+static const int interruptCheckInterval = 1000;
+
+static int interruptHandler(void *interrupt)
+{
+    return static_cast<QAtomicInt *>(interrupt)->fetchAndAddRelaxed(0);
+}
+
+// At most this many consecutive write jobs are committed in a single transaction
+static const int maximumTransactionGroup = 50;
+
 class JobThread : public QThread
 {
 public:
-    JobThread(ContactsEngine *engine, const QString &databaseUuid)
+    JobThread(ContactsEngine *engine, const QString &connectionName, bool readOnly)
         : m_currentJob(0)
+        , m_aggregationJob(0)
+        , m_currentJobCancelled(false)
+        , m_interrupt(0)
+        , m_currentJobWriteGeneration(0)
         , m_engine(engine)
         , m_updatePending(false)
         , m_running(true)
-        , m_databaseUuid(databaseUuid)
+        , m_readOnly(readOnly)
+        , m_connectionName(connectionName)
+        , m_sharedJobs(0)
+        , m_enqueuedJobs(0)
+        , m_groupCommits(0)
     {
+        m_clock.start();
         start(QThread::IdlePriority);
     }
 
@@ -546,27 +857,130 @@ public:
 
     void enqueue(Job *job)
     {
+        // Read the scheduling properties here, in the thread owning the request
+        QContactAbstractRequest *request = job->request();
+        const QVariant priority(request->property(QContactAbstractRequest__Priority));
+        const QVariant deadline(request->property(QContactAbstractRequest__Deadline));
+        const int lane = priority.isValid()
+                ? qBound(QContactAbstractRequest__BackgroundPriority, priority.toInt(), QContactAbstractRequest__InteractivePriority)
+                : QContactAbstractRequest__NormalPriority;
+
         QMutexLocker locker(&m_mutex);
+        const qint64 now = m_clock.elapsed();
+        job->schedule(lane, now, deadline.isValid() ? now + qMax(0, deadline.toInt()) : -1);
+        job->setTicket(++m_enqueuedJobs);
+
+        // An equivalent job which has not yet finished can provide the results for this request,
+        // unless a write will be committed after it executes and before this job would have:
+        // jobs queued ahead of a pending write, or executing after a write was committed
+        int firstUnordered = m_pendingJobs.count();
+        while (firstUnordered > 0 && !m_pendingJobs.at(firstUnordered - 1)->writes())
+            --firstUnordered;
+
+        QList<Job*> unfinishedJobs(m_pendingJobs.mid(firstUnordered));
+        if (firstUnordered == 0 && m_currentJob && !m_currentJobCancelled && m_currentJobWriteGeneration == m_engine->writeGeneration())
+            unfinishedJobs.append(m_currentJob);
+        foreach (Job *unfinished, unfinishedJobs) {
+            if (unfinished->share(job)) {
+                unfinished->raise(job);
+                ++m_sharedJobs;
+                qDebug() << "Job shared:" << unfinished->description() << ":" << m_sharedJobs << "of" << m_enqueuedJobs << "jobs shared";
+                delete job;
+                return;
+            }
+        }
+
         m_pendingJobs.append(job);
         m_wait.wakeOne();
     }
 
+    void enqueueAggregation()
+    {
+        QMutexLocker locker(&m_mutex);
+        appendAggregationJob();
+    }
+
+    // Returns the number of jobs queued or executing in this thread
+    int load()
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_pendingJobs.count() + (m_currentJob ? 1 : 0);
+    }
+
+    bool hasUnfinishedRequest(QContactAbstractRequest::RequestType type)
+    {
+        QMutexLocker locker(&m_mutex);
+        return unfinishedTicket(type, INT_MAX) != 0;
+    }
+
+    // Returns the ticket of the latest unfinished job of the type, or zero if there is none
+    int lastUnfinishedTicket(QContactAbstractRequest::RequestType type)
+    {
+        QMutexLocker locker(&m_mutex);
+        return unfinishedTicket(type, INT_MAX);
+    }
+
+    // Waits until the jobs of the type enqueued up to the ticket have finished or been cancelled
+    void waitForUnfinished(QContactAbstractRequest::RequestType type, int ticket)
+    {
+        QMutexLocker locker(&m_mutex);
+        while (unfinishedTicket(type, ticket) != 0)
+            m_finishedWait.wait(&m_mutex);
+    }
+
+    // Returns true if a write requested through this thread has not yet been committed
+    bool hasUnfinishedWrite()
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_groupedJobs.isEmpty() || (m_currentJob && m_currentJob->writes()))
+            return true;
+        foreach (Job *job, m_pendingJobs) {
+            if (job->writes())
+                return true;
+        }
+        return false;
+    }
+
+    bool hasRequest(QContactAbstractRequest *request)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_currentJob && m_currentJob->serves(request))
+            return true;
+        foreach (Job *job, m_pendingJobs + m_groupedJobs + m_finishedJobs + m_cancelledJobs) {
+            if (job->serves(request))
+                return true;
+        }
+        return false;
+    }
+
     bool requestDestroyed(QContactAbstractRequest *request)
     {
         QMutexLocker locker(&m_mutex);
+        if (releaseSharedRequest(request, true))
+            return false;
+
         for (QList<Job*>::iterator it = m_pendingJobs.begin(); it != m_pendingJobs.end(); it++) {
             if ((*it)->request() == request) {
                 delete *it;
                 m_pendingJobs.erase(it);
+                m_finishedWait.wakeAll();
                 return true;
             }
         }
 
         if (m_currentJob && m_currentJob->request() == request) {
             m_currentJob->clear();
+            interruptCurrentJob();
             return false;
         }
 
+        foreach (Job *job, m_groupedJobs) {
+            if (job->request() == request) {
+                job->clear();
+                return false;
+            }
+        }
+
         for (QList<Job*>::iterator it = m_finishedJobs.begin(); it != m_finishedJobs.end(); it++) {
             if ((*it)->request() == request) {
                 delete *it;
@@ -587,15 +1001,33 @@ public:
 
     bool cancelRequest(QContactAbstractRequest *request)
     {
-        QMutexLocker locker(&m_mutex);
-        for (QList<Job*>::iterator it = m_pendingJobs.begin(); it != m_pendingJobs.end(); it++) {
-            if ((*it)->request() == request) {
-                m_cancelledJobs.append(*it);
-                m_pendingJobs.erase(it);
-                return true;
+        {
+            QMutexLocker locker(&m_mutex);
+            if (!releaseSharedRequest(request, false)) {
+                for (QList<Job*>::iterator it = m_pendingJobs.begin(); it != m_pendingJobs.end(); it++) {
+                    if ((*it)->request() == request) {
+                        m_cancelledJobs.append(*it);
+                        m_pendingJobs.erase(it);
+                        m_finishedWait.wakeAll();
+                        return true;
+                    }
+                }
+
+                if (m_currentJob && m_currentJob->request() == request)
+                    return interruptCurrentJob();
+                return false;
             }
         }
-        return false;
+
+        // The shared job continues for its other requests
+        QContactManagerEngine::updateRequestState(request, QContactAbstractRequest::CanceledState);
+        return true;
+    }
+
+    bool currentJobCancelled()
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_currentJobCancelled;
     }
 
     bool waitForFinished(QContactAbstractRequest *request, const int msecs)
@@ -609,19 +1041,24 @@ public:
             QMutexLocker locker(&m_mutex);
             for (;;) {
                 bool pendingJob = false;
-                if (m_currentJob && m_currentJob->request() == request) {
+                if ((m_currentJob && m_currentJob->serves(request)) || groupServes(request)) {
                     qDebug() << "Wait for current job" << timeout;
                     // wait for the current job to updateState.
                     if (!m_finishedWait.wait(&m_mutex, timeout))
                         return false;
                 } else for (int i = 0; i < m_pendingJobs.size(); i++) {
                     Job *job = m_pendingJobs[i];
-                    if (job->request() == request) {
-                        // If the job is pending, move it to the front of the queue and wait for
-                        // the current job to end.
+                    if (job->serves(request)) {
+                        // If the job is pending, move it to the front of the queue unless that
+                        // would pass a write, and wait for the current job to end.
                         QElapsedTimer timer;
                         timer.start();
-                        m_pendingJobs.move(i, 0);
+                        job->promote();
+                        bool keepPosition = job->writes();
+                        for (int j = 0; j < i && !keepPosition; ++j)
+                            keepPosition = m_pendingJobs.at(j)->writes();
+                        if (!keepPosition)
+                            m_pendingJobs.move(i, 0);
                         if (!m_finishedWait.wait(&m_mutex, timeout))
                             return false;
                         timeout -= timer.elapsed();
@@ -638,7 +1075,7 @@ public:
             }
 
             for (QList<Job*>::iterator it = m_finishedJobs.begin(); it != m_finishedJobs.end(); it++) {
-                if ((*it)->request() == request) {
+                if ((*it)->serves(request)) {
                     finishedJob = *it;
                     m_finishedJobs.erase(it);
                     break;
@@ -646,11 +1083,12 @@ public:
             }
         }
         if (finishedJob) {
+            reportStatistics(finishedJob);
             finishedJob->updateState(QContactAbstractRequest::FinishedState);
             delete finishedJob;
             return true;
         } else for (QList<Job*>::iterator it = m_cancelledJobs.begin(); it != m_cancelledJobs.end(); it++) {
-            if ((*it)->request() == request) {
+            if ((*it)->serves(request)) {
                 (*it)->updateState(QContactAbstractRequest::CanceledState);
                 delete *it;
                 m_cancelledJobs.erase(it);
@@ -701,6 +1139,7 @@ public:
 
             while (!finishedJobs.isEmpty()) {
                 Job *job = finishedJobs.takeFirst();
+                reportStatistics(job);
                 job->updateState(QContactAbstractRequest::FinishedState);
                 delete job;
             }
@@ -720,17 +1159,175 @@ public:
     }
 
 private:
+    struct LaneStatistics
+    {
+        LaneStatistics() : jobs(0), totalWait(0), maximumWait(0) {}
+
+        int jobs;
+        qint64 totalWait;
+        qint64 maximumWait;
+    };
+
+    int unfinishedTicket(QContactAbstractRequest::RequestType type, int maximumTicket) const
+    {
+        int ticket = 0;
+        QList<Job*> jobs(m_pendingJobs);
+        if (m_currentJob)
+            jobs.append(m_currentJob);
+        foreach (Job *job, jobs) {
+            if (job->request() && job->request()->type() == type && job->ticket() <= maximumTicket)
+                ticket = qMax(ticket, job->ticket());
+        }
+        return ticket;
+    }
+
+    // Returns true if a job executed but not yet committed serves the request
+    bool groupServes(QContactAbstractRequest *request)
+    {
+        foreach (Job *job, m_groupedJobs) {
+            if (job->serves(request))
+                return true;
+        }
+        return false;
+    }
+
+    // Detaches a request from a job shared with other requests, which continues for them
+    bool releaseSharedRequest(QContactAbstractRequest *request, bool includeCompleted)
+    {
+        QList<Job*> jobs(m_pendingJobs);
+        if (m_currentJob)
+            jobs.append(m_currentJob);
+        if (includeCompleted)
+            jobs += m_finishedJobs + m_cancelledJobs;
+        foreach (Job *job, jobs) {
+            if (job->serves(request))
+                return job->release(request);
+        }
+        return false;
+    }
+
+    // Stops a read in progress, to free this thread for other jobs: the statement executing
+    // is aborted, and the reader stops at its next batch of results; writes are not interrupted
+    bool interruptCurrentJob()
+    {
+        if (!m_currentJob || m_currentJob->writes())
+            return false;
+
+        m_currentJobCancelled = true;
+        m_interrupt.fetchAndStoreOrdered(1);
+        return true;
+    }
+
+    void installInterruptHandler(QSqlDatabase &database)
+    {
+        // The handler is installed through the driver's connection handle, which is only valid
+        // for this plugin's SQLite library if the driver uses the same one
+        const QVariant handle(database.driver()->handle());
+        if (!handle.isValid() || qstrcmp(handle.typeName(), "sqlite3*") != 0)
+            return;
+
+        QSqlQuery versionQuery(database);
+        if (!versionQuery.exec(QLatin1String("SELECT sqlite_version()")) || !versionQuery.next()
+                || versionQuery.value(0).toString() != QLatin1String(sqlite3_libversion())) {
+            qWarning() << "SQLite driver does not use the library linked by this plugin: reads in progress cannot be interrupted";
+            return;
+        }
+        versionQuery.finish();
+
+        sqlite3 *connection = *static_cast<sqlite3 * const *>(handle.constData());
+        if (connection)
+            sqlite3_progress_handler(connection, interruptCheckInterval, interruptHandler, &m_interrupt);
+    }
+
+    static void reportStatistics(Job *job)
+    {
+        if (QContactAbstractRequest *request = job->request()) {
+            request->setProperty(QContactAbstractRequest__QueueWait, job->queueWait());
+            request->setProperty(QContactAbstractRequest__CachedQueryHits, job->cachedQueryHits());
+            request->setProperty(QContactAbstractRequest__CachedQueryMisses, job->cachedQueryMisses());
+        }
+    }
+
+    void appendAggregationJob()
+    {
+        // Deferred aggregates are coalesced in the database, so one pending job processes all of them
+        if (!m_aggregationJob) {
+            m_aggregationJob = new AggregationJob;
+            m_aggregationJob->schedule(QContactAbstractRequest__BackgroundPriority, m_clock.elapsed(), -1);
+            m_pendingJobs.append(m_aggregationJob);
+            m_wait.wakeOne();
+        }
+    }
+
+    int nextJobIndex() const
+    {
+        // Of the reads queued ahead of the first write, a job whose deadline has passed is taken
+        // first; otherwise, the oldest job in the highest lane.  Writes are taken in the order they
+        // were requested, and reads queued behind a write must observe it, so no job passes a write.
+        const qint64 now = m_clock.elapsed();
+        int next = -1;
+        for (int i = 0; i < m_pendingJobs.count(); ++i) {
+            const Job *job = m_pendingJobs.at(i);
+            if (job->writes())
+                return next == -1 ? i : next;
+            if (job->deadlineTime() >= 0 && job->deadlineTime() <= now) {
+                next = i;
+                break;
+            }
+            if (next == -1 || job->lane() > m_pendingJobs.at(next)->lane())
+                next = i;
+        }
+        return next;
+    }
+
+    bool nextJobWrites() const
+    {
+        return !m_pendingJobs.isEmpty() && m_pendingJobs.at(nextJobIndex())->writes();
+    }
+
+    Job *takeNextJob()
+    {
+        const qint64 now = m_clock.elapsed();
+        Job *job = m_pendingJobs.takeAt(nextJobIndex());
+        if (job == m_aggregationJob) {
+            // Aggregates deferred from now on require another job
+            m_aggregationJob = 0;
+        }
+
+        const qint64 wait = now - job->enqueueTime();
+        job->setQueueWait(wait);
+
+        LaneStatistics &statistics(m_laneStatistics[job->lane()]);
+        statistics.jobs += 1;
+        statistics.totalWait += wait;
+        statistics.maximumWait = qMax(statistics.maximumWait, wait);
+        qDebug() << "Job waited" << wait << "ms in lane" << job->lane() << ": lane average"
+                 << (statistics.totalWait / statistics.jobs) << "ms, maximum" << statistics.maximumWait << "ms over" << statistics.jobs << "jobs";
+        return job;
+    }
+
     QMutex m_mutex;
     QWaitCondition m_wait;
     QWaitCondition m_finishedWait;
     QList<Job*> m_pendingJobs;
+    QList<Job*> m_groupedJobs;
     QList<Job*> m_finishedJobs;
     QList<Job*> m_cancelledJobs;
     Job *m_currentJob;
+    Job *m_aggregationJob;
+    bool m_currentJobCancelled;
+    QAtomicInt m_interrupt;
+    int m_currentJobWriteGeneration;
     ContactsEngine *m_engine;
     bool m_updatePending;
     bool m_running;
-    QString m_databaseUuid;
+    bool m_readOnly;
+    QString m_connectionName;
+    QElapsedTimer m_clock;
+    int m_sharedJobs;
+    int m_enqueuedJobs;
+    int m_groupCommits;
+    LaneStatistics m_laneStatistics[QContactAbstractRequest__InteractivePriority + 1];
 };
 
 class JobContactReader : public ContactReader
@@ -752,24 +1349,29 @@ public:
         m_thread->contactIdsAvailable(contactIds);
     }
 
+    bool cancelled() const
+    {
+        return m_thread->currentJobCancelled();
+    }
+
 private:
     JobThread *m_thread;
 };
 
 void JobThread::run()
 {
-    QSqlDatabase database = ContactsDatabase::open(QString(QLatin1String("qtcontacts-sqlite-job-%1")).arg(m_databaseUuid));
+    QSqlDatabase database = ContactsDatabase::open(m_connectionName, m_readOnly);
     if (!database.isOpen()) {
         while (m_running) {
             if (m_pendingJobs.isEmpty()) {
                 m_wait.wait(&m_mutex);
             } else {
-                m_currentJob = m_pendingJobs.takeFirst();
+                m_currentJob = takeNextJob();
                 m_currentJob->setError(QContactManager::UnspecifiedError);
                 m_finishedJobs.append(m_currentJob);
                 m_currentJob = 0;
                 postUpdate();
-                m_finishedWait.wakeOne();
+                m_finishedWait.wakeAll();
             }
         }
 
@@ -779,32 +1381,90 @@ void JobThread::run()
     JobContactReader reader(database, this);
     ContactWriter *writer = 0;
 
+    installInterruptHandler(database);
+
     QMutexLocker locker(&m_mutex);
 
     while (m_running) {
         if (m_pendingJobs.isEmpty()) {
             m_wait.wait(&m_mutex);
         } else {
-            m_currentJob = m_pendingJobs.takeFirst();
-            locker.unlock();
-            QElapsedTimer timer;
-            timer.start();
-            m_currentJob->execute(*m_engine, database, &reader, writer);
-            qDebug() << "Job executed in" << timer.elapsed() << ":" << m_currentJob->description() << ":" << m_currentJob->error();
-            locker.relock();
-            m_finishedJobs.append(m_currentJob);
-            m_currentJob = 0;
-            postUpdate();
-            m_finishedWait.wakeOne();
+            m_currentJob = takeNextJob();
+            m_currentJobWriteGeneration = m_engine->writeGeneration();
+            m_interrupt.fetchAndStoreOrdered(0);
+
+            // Consecutive queued writes are committed in a single transaction
+            bool grouped = false;
+            QElapsedTimer groupTimer;
+            if (m_currentJob->writes() && nextJobWrites()) {
+                locker.unlock();
+                if (!writer)
+                    writer = new ContactWriter(*m_engine, database, &reader);
+                groupTimer.start();
+                grouped = writer->beginTransactionGroup();
+                locker.relock();
+            }
+
+            while (m_currentJob) {
+                locker.unlock();
+                if (JobThread *predecessor = m_currentJob->predecessorThread())
+                    predecessor->waitForUnfinished(m_currentJob->predecessorType(), m_currentJob->predecessorTicket());
+                QElapsedTimer timer;
+                timer.start();
+                m_currentJob->execute(*m_engine, database, &reader, writer);
+                m_currentJob->setCachedQueryCounts(reader.cachedQueryHits(), reader.cachedQueryMisses());
+                if (m_interrupt.fetchAndStoreOrdered(0)) {
+                    // Clearing the temporary tables may itself have been aborted
+                    reader.clearTemporaryTables();
+                }
+                qDebug() << "Job executed in" << timer.elapsed() << ":" << m_currentJob->description() << ":" << m_currentJob->error();
+                locker.relock();
+                if (writer && writer->takeDeferredAggregation())
+                    appendAggregationJob();
+
+                if (grouped) {
+                    // The job is complete when the group is committed
+                    m_groupedJobs.append(m_currentJob);
+                    m_currentJob = (m_groupedJobs.count() < maximumTransactionGroup && nextJobWrites()) ? takeNextJob() : 0;
+                } else {
+                    if (m_currentJobCancelled) {
+                        m_currentJobCancelled = false;
+                        m_cancelledJobs.append(m_currentJob);
+                    } else {
+                        m_finishedJobs.append(m_currentJob);
+                    }
+                    m_currentJob = 0;
+                    postUpdate();
+                    m_finishedWait.wakeAll();
+                }
+            }
+
+            if (grouped) {
+                locker.unlock();
+                const bool committed = writer->commitTransactionGroup();
+                locker.relock();
+                ++m_groupCommits;
+                qDebug() << "Group of" << m_groupedJobs.count() << "jobs committed in" << groupTimer.elapsed() << ":" << committed << ":" << m_groupCommits << "group commits";
+                foreach (Job *job, m_groupedJobs) {
+                    if (!committed)
+                        job->setError(QContactManager::UnspecifiedError);
+                    m_finishedJobs.append(job);
+                }
+                m_groupedJobs.clear();
+                postUpdate();
+                m_finishedWait.wakeAll();
+            }
         }
     }
 }
 
-ContactsEngine::ContactsEngine(const QString &name)
+ContactsEngine::ContactsEngine(const QString &name, const QMap<QString, QString> &parameters)
     : m_name(name)
+    , m_deferAggregation(parameters.value(QLatin1String(QContactManager__DeferAggregation)) == QLatin1String("true"))
     , m_synchronousReader(0)
     , m_synchronousWriter(0)
     , m_jobThread(0)
+    , m_writeGeneration(0)
 {
 #ifdef USING_QTPIM
     static bool registered = qRegisterMetaType<QList<int> >("QList<int>");
@@ -817,6 +1477,7 @@ ContactsEngine::~ContactsEngine()
     delete m_synchronousWriter;
     delete m_synchronousReader;
     delete m_jobThread;
+    qDeleteAll(m_readerThreads);
 }
 
 QString ContactsEngine::databaseUuid()
@@ -832,6 +1493,11 @@ QContactManager::Error ContactsEngine::open()
 {
     m_database = ContactsDatabase::open(QString(QLatin1String("qtcontacts-sqlite-%1")).arg(databaseUuid()));
     if (m_database.isOpen()) {
+        if (m_deferAggregation) {
+            // Complete any regeneration deferred by a previous session
+            scheduleDeferredAggregation();
+        }
+
         ContactNotifier::initialize();
         ContactNotifier::connect("contactsAdded", "au", this, SLOT(_q_contactsAdded(QVector<quint32>)));
         ContactNotifier::connect("contactsChanged", "au", this, SLOT(_q_contactsChanged(QVector<quint32>)));
@@ -964,6 +1630,27 @@ bool ContactsEngine::saveContacts(
     }
 
     QContactManager::Error err = m_synchronousWriter->save(contacts, definitionMask, 0, errorMap, false, false);
+    if (m_synchronousWriter->takeDeferredAggregation())
+        scheduleDeferredAggregation();
+
+    if (error)
+        *error = err;
+    return err == QContactManager::NoError;
+}
+
+bool ContactsEngine::importContacts(
+            QList<QContact> *contacts,
+            QMap<int, QContactManager::Error> *errorMap,
+            QContactManager::Error *error)
+{
+    if (!m_synchronousWriter) {
+        if (!m_synchronousReader) {
+            m_synchronousReader = new ContactReader(m_database);
+        }
+        m_synchronousWriter = new ContactWriter(*this, m_database, m_synchronousReader);
+    }
+
+    QContactManager::Error err = m_synchronousWriter->import(contacts, errorMap);
 
     if (error)
         *error = err;
@@ -990,6 +1677,9 @@ bool ContactsEngine::removeContacts(
     }
 
     QContactManager::Error err = m_synchronousWriter->remove(contactIds, errorMap, false);
+    if (m_synchronousWriter->takeDeferredAggregation())
+        scheduleDeferredAggregation();
+
     if (error)
         *error = err;
     return err == QContactManager::NoError;
@@ -1109,11 +1799,14 @@ void ContactsEngine::requestDestroyed(QContactAbstractRequest* req)
 {
     if (m_jobThread)
         m_jobThread->requestDestroyed(req);
+    foreach (JobThread *thread, m_readerThreads)
+        thread->requestDestroyed(req);
 }
 
 bool ContactsEngine::startRequest(QContactAbstractRequest* request)
 {
     Job *job = 0;
+    bool readOnly = false;
 
     switch (request->type()) {
     case QContactAbstractRequest::ContactSaveRequest:
@@ -1124,21 +1817,26 @@ bool ContactsEngine::startRequest(QContactAbstractRequest* request)
         break;
     case QContactAbstractRequest::ContactFetchRequest:
         job = new ContactFetchJob(qobject_cast<QContactFetchRequest *>(request));
+        readOnly = true;
         break;
 #ifdef USING_QTPIM
     case QContactAbstractRequest::ContactIdFetchRequest:
         job = new IdFetchJob(qobject_cast<QContactIdFetchRequest *>(request));
+        readOnly = true;
         break;
 #else
     case QContactAbstractRequest::ContactLocalIdFetchRequest:
         job = new IdFetchJob(qobject_cast<QContactLocalIdFetchRequest *>(request));
+        readOnly = true;
         break;
 #endif
     case QContactAbstractRequest::ContactFetchByIdRequest:
         job = new ContactFetchByIdJob(qobject_cast<QContactFetchByIdRequest *>(request));
+        readOnly = true;
         break;
     case QContactAbstractRequest::RelationshipFetchRequest:
         job = new RelationshipFetchJob(qobject_cast<QContactRelationshipFetchRequest *>(request));
+        readOnly = true;
         break;
     case QContactAbstractRequest::RelationshipSaveRequest:
         job = new RelationshipSaveJob(qobject_cast<QContactRelationshipSaveRequest *>(request));
@@ -1150,27 +1848,93 @@ bool ContactsEngine::startRequest(QContactAbstractRequest* request)
         return false;
     }
 
-    if (!m_jobThread)
-        m_jobThread = new JobThread(this, databaseUuid());
+    JobThread *thread = readOnly ? readerThread(job) : writerThread();
     job->updateState(QContactAbstractRequest::ActiveState);
-    m_jobThread->enqueue(job);
+    thread->enqueue(job);
 
     return true;
 }
 
+JobThread *ContactsEngine::writerThread()
+{
+    if (!m_jobThread)
+        m_jobThread = new JobThread(this, QString(QLatin1String("qtcontacts-sqlite-job-%1")).arg(databaseUuid()), false);
+    return m_jobThread;
+}
+
+JobThread *ContactsEngine::readerThread(Job *job)
+{
+    const QContactAbstractRequest::RequestType type(job->request()->type());
+
+    if (m_readerThreads.isEmpty()) {
+        const int count = qBound(1, QThread::idealThreadCount(), maximumReaderThreads);
+        for (int i = 0; i < count; ++i) {
+            const QString connectionName(QString(QLatin1String("qtcontacts-sqlite-reader%1-%2")).arg(i).arg(databaseUuid()));
+            m_readerThreads.append(new JobThread(this, connectionName, true));
+        }
+    }
+
+    // Requests of the same type complete in the order they were started, so a request must
+    // follow any earlier unfinished request of its type
+    JobThread *predecessor = 0;
+    int predecessorTicket = 0;
+    foreach (JobThread *thread, m_readerThreads) {
+        if ((predecessorTicket = thread->lastUnfinishedTicket(type)) != 0) {
+            predecessor = thread;
+            break;
+        }
+    }
+
+    // A read must observe the writes requested before it, so it is queued in the writer thread
+    // behind any write not yet committed; it then waits for the earlier request of its type
+    // in a reader thread, so that the two complete in order
+    if (m_jobThread && (m_jobThread->hasUnfinishedWrite() || m_jobThread->hasUnfinishedRequest(type))) {
+        if (predecessor)
+            job->follow(predecessor, type, predecessorTicket);
+        return m_jobThread;
+    }
+    if (predecessor)
+        return predecessor;
+
+    // Otherwise, use the least loaded thread
+    JobThread *leastLoaded = 0;
+    int minimumLoad = INT_MAX;
+    foreach (JobThread *thread, m_readerThreads) {
+        const int load = thread->load();
+        if (load < minimumLoad) {
+            leastLoaded = thread;
+            minimumLoad = load;
+        }
+    }
+    return leastLoaded;
+}
+
+void ContactsEngine::scheduleDeferredAggregation()
+{
+    writerThread()->enqueueAggregation();
+}
+
 bool ContactsEngine::cancelRequest(QContactAbstractRequest* req)
 {
-    if (m_jobThread)
-        return m_jobThread->cancelRequest(req);
+    if (m_jobThread && m_jobThread->cancelRequest(req))
+        return true;
+    foreach (JobThread *thread, m_readerThreads) {
+        if (thread->cancelRequest(req))
+            return true;
+    }
 
     return false;
 }
 
 bool ContactsEngine::waitForRequestFinished(QContactAbstractRequest* req, int msecs)
 {
-    if (m_jobThread)
+    if (m_jobThread && m_jobThread->hasRequest(req))
         return m_jobThread->waitForFinished(req, msecs);
-    return true;
+    foreach (JobThread *thread, m_readerThreads) {
+        if (thread->hasRequest(req))
+            return thread->waitForFinished(req, msecs);
+    }
+    return !m_jobThread && m_readerThreads.isEmpty();
 }
 
 #ifndef USING_QTPIM
@@ -1294,6 +2058,23 @@ QStringList ContactsEngine::supportedContactTypes() const
 #endif
 }
 
+bool ContactsEngine::aggregationDeferred() const
+{
+    return m_deferAggregation;
+}
+
+int ContactsEngine::writeGeneration() const
+{
+    QMutexLocker locker(&m_writeGenerationMutex);
+    return m_writeGeneration;
+}
+
+void ContactsEngine::writeCommitted() const
+{
+    QMutexLocker locker(&m_writeGenerationMutex);
+    ++m_writeGeneration;
+}
+
 void ContactsEngine::regenerateDisplayLabel(QContact &contact) const
 {
     QContactManager::Error displayLabelError = QContactManager::NoError;
@@ -1399,16 +2180,19 @@ static QList<QContactIdType> idList(const QVector<quint32> &contactIds)
 
 void ContactsEngine::_q_contactsAdded(const QVector<quint32> &contactIds)
 {
+    writeCommitted();
     emit contactsAdded(idList(contactIds));
 }
 
 void ContactsEngine::_q_contactsChanged(const QVector<quint32> &contactIds)
 {
+    writeCommitted();
     emit contactsChanged(idList(contactIds));
 }
 
 void ContactsEngine::_q_contactsRemoved(const QVector<quint32> &contactIds)
 {
+    writeCommitted();
     emit contactsRemoved(idList(contactIds));
 }
 
@@ -1419,10 +2203,12 @@ void ContactsEngine::_q_selfContactIdChanged(quint32 oldId, quint32 newId)
 
 void ContactsEngine::_q_relationshipsAdded(const QVector<quint32> &contactIds)
 {
+    writeCommitted();
     emit relationshipsAdded(idList(contactIds));
 }
 
 void ContactsEngine::_q_relationshipsRemoved(const QVector<quint32> &contactIds)
 {
+    writeCommitted();
     emit relationshipsRemoved(idList(contactIds));
 }
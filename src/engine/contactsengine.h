@@ -38,6 +38,7 @@
 #include <QContactManagerEngineV2>
 #endif
 
+#include <QMutex>
 #include <QSqlDatabase>
 
 #include "contactreader.h"
@@ -55,6 +56,7 @@ USE_CONTACTS_NAMESPACE
 // It does not compare correctly if the values contains QList<int>
 inline void operator==(const QContactDetail &, const QContactDetail &) {}
 
+class Job;
 class JobThread;
 
 class ContactsEngine
@@ -66,7 +68,7 @@ class ContactsEngine
 {
     Q_OBJECT
 public:
-    ContactsEngine(const QString &name);
+    ContactsEngine(const QString &name, const QMap<QString, QString> &parameters);
     ~ContactsEngine();
 
     QContactManager::Error open();
@@ -108,6 +110,10 @@ public:
                 const ContactWriter::DetailList &definitionMask,
                 QMap<int, QContactManager::Error> *errorMap,
                 QContactManager::Error *error);
+    bool importContacts(
+                QList<QContact> *contacts,
+                QMap<int, QContactManager::Error> *errorMap,
+                QContactManager::Error *error);
     bool removeContact(const QContactIdType& contactId, QContactManager::Error* error);
     bool removeContacts(
                 const QList<QContactIdType> &contactIds,
@@ -155,6 +161,12 @@ public:
 
     void regenerateDisplayLabel(QContact &contact) const;
 
+    bool aggregationDeferred() const;
+
+    // Incremented whenever a write to the database is committed, by this or another process
+    int writeGeneration() const;
+    void writeCommitted() const;
+
 #ifdef USING_QTPIM
     static bool setContactDisplayLabel(QContact *contact, const QString &label);
 #endif
@@ -176,12 +188,20 @@ private slots:
 
 private:
     QString databaseUuid();
+    void scheduleDeferredAggregation();
+    JobThread *writerThread();
+    JobThread *readerThread(Job *job);
+
     QString m_databaseUuid;
     const QString m_name;
+    const bool m_deferAggregation;
     QSqlDatabase m_database;
     mutable ContactReader *m_synchronousReader;
     ContactWriter *m_synchronousWriter;
     JobThread *m_jobThread;
+    QList<JobThread *> m_readerThreads;
+    mutable QMutex m_writeGenerationMutex;
+    mutable int m_writeGeneration;
 };
 
 
@@ -52,7 +52,10 @@
 #include <QContactVersion>
 #endif
 
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QSqlError>
+#include <QVector>
 
 #include <QtDebug>
 
@@ -60,10 +63,19 @@
 using namespace Conversion;
 #endif
 
+// The number of contacts written together by a bulk import
+static const int ImportBatchSize = 250;
+
 static const char *findConstituentsForAggregate =
         "\n SELECT contactId FROM Contacts WHERE contactId IN ("
         "\n SELECT secondId FROM Relationships WHERE firstId = :aggregateId AND type = 'Aggregates')";
 
+static const char *findConstituentsForAggregates =
+        "\n SELECT Relationships.firstId, Relationships.secondId FROM Relationships"
+        "\n INNER JOIN Contacts ON Contacts.contactId = Relationships.secondId"
+        "\n WHERE Relationships.type = 'Aggregates' AND Relationships.firstId IN (%1)"
+        "\n ORDER BY Relationships.firstId, Relationships.secondId";
+
 static const char *findLocalForAggregate =
         "\n SELECT contactId FROM Contacts WHERE syncTarget = 'local' AND contactId IN ("
         "\n SELECT secondId FROM Relationships WHERE firstId = :aggregateId AND type = 'Aggregates')";
@@ -74,43 +86,24 @@ static const char *findAggregateForContact =
 static const char *findMaximumContactId =
         "\n SELECT max(contactId) FROM Contacts";
 
-static const char *findMatchForContact =
-        "\n SELECT Matches.contactId, sum(Matches.score) AS total FROM ("
-        "\n   SELECT contactId, 20 as score FROM Contacts"
-        "\n      WHERE lowerLastName != '' AND lowerLastName = :lastName"
-        "\n      AND lowerFirstName != '' AND :firstName != '' AND (lowerFirstName = :firstName OR lowerFirstName LIKE :firstPartial)"
-        "\n   UNION"
-        "\n   SELECT contactId, 12 as score FROM Contacts"
-        "\n      WHERE (lowerLastName = '' OR :lastName = '')"
-        "\n      AND lowerFirstName != '' AND (lowerFirstName = :firstName OR lowerFirstName LIKE :firstPartial)"
-        "\n   UNION"
-        "\n   SELECT contactId, 12 as score FROM Contacts"
-        "\n      WHERE lowerLastName != '' AND lowerLastName = :lastName"
-        "\n      AND (lowerFirstName = '' OR :firstName = '')"
-        "\n   UNION"
-        "\n   SELECT contactId, 3 as score FROM EmailAddresses WHERE lowerEmailAddress IN ( :email )"
-        "\n   UNION"
-        "\n   SELECT contactId, 3 as score FROM PhoneNumbers WHERE normalizedNumber IN ( :number )"
-        "\n   UNION"
-        "\n   SELECT contactId, 3 as score FROM OnlineAccounts WHERE lowerAccountUri IN ( :uri )"
-        "\n   UNION"
-        "\n   SELECT contactId, 1 as score FROM Nicknames WHERE lowerNickname != '' AND lowerNickname = :nickname"
-        "\n ) AS Matches"
-        "\n JOIN Contacts ON Contacts.contactId = Matches.contactId"
-        "\n WHERE Contacts.syncTarget = 'aggregate'"
-        "\n AND Matches.contactId <= :maxAggregateId"
-        "\n AND Matches.contactId NOT IN ("
-        "\n   SELECT DISTINCT secondId FROM Relationships WHERE firstId = :id AND type = 'IsNot'"
-        "\n   UNION"
-        "\n   SELECT DISTINCT firstId FROM Relationships WHERE secondId = :id AND type = 'IsNot'"
-        "\n   UNION"
-        "\n   SELECT DISTINCT firstId FROM Relationships WHERE type = 'Aggregates' AND secondId IN ("
-        "\n     SELECT contactId FROM Contacts WHERE syncTarget = :syncTarget"
-        "\n   )"
-        "\n )"
-        "\n GROUP BY Matches.contactId"
-        "\n ORDER BY total DESC"
-        "\n LIMIT 1";
+// Candidate aggregates for a new contact are found from the match keys of the aggregates
+static const char *selectMatchCandidates =
+        "\n SELECT contactId FROM MatchKeys"
+        "\n WHERE keyType = :keyType AND matchKey = :matchKey AND contactId <= :maxAggregateId;";
+
+static const char *selectMatchNames =
+        "\n SELECT lowerFirstName, lowerLastName FROM Contacts WHERE contactId = :contactId;";
+
+static const char *selectUnmatchableAggregates =
+        "\n SELECT secondId FROM Relationships WHERE firstId = :id AND type = 'IsNot'"
+        "\n UNION"
+        "\n SELECT firstId FROM Relationships WHERE secondId = :id AND type = 'IsNot'";
+
+static const char *checkAggregateSyncTarget =
+        "\n SELECT COUNT(*) FROM Relationships"
+        "\n JOIN Contacts ON Contacts.contactId = Relationships.secondId"
+        "\n WHERE Relationships.firstId = :aggregateId AND Relationships.type = 'Aggregates'"
+        "\n AND Contacts.syncTarget = :syncTarget;";
 
 static const char *selectAggregateContactIds =
         "\n SELECT contactId FROM Contacts WHERE syncTarget = 'aggregate' AND contactId = :possibleAggregateId";
@@ -129,6 +122,18 @@ static const char *checkContactExists =
 static const char *existingContactIds =
         "\n SELECT DISTINCT contactId FROM Contacts;";
 
+static const char *createStagedContactIds =
+        "\n CREATE TABLE IF NOT EXISTS temp.StagedContactIds ("
+        "\n contactId INTEGER PRIMARY KEY);";
+
+static const char *insertStagedContactId =
+        "\n INSERT OR IGNORE INTO temp.StagedContactIds (contactId)"
+        "\n VALUES (:contactId);";
+
+static const char *selectStagedExistingContactIds =
+        "\n SELECT Contacts.contactId FROM temp.StagedContactIds"
+        "\n INNER JOIN Contacts ON Contacts.contactId = temp.StagedContactIds.contactId;";
+
 static const char *selfContactId =
         "\n SELECT DISTINCT contactId FROM Identities WHERE identity = :identity;";
 
@@ -151,7 +156,12 @@ static const char *insertContact =
         "\n  hasPhoneNumber,"
         "\n  hasEmailAddress,"
         "\n  hasOnlineAccount,"
-        "\n  isOnline)"
+        "\n  isOnline,"
+        "\n  displayLabelSortKey,"
+        "\n  firstNameSortKey,"
+        "\n  lastNameSortKey,"
+        "\n  createdSequence,"
+        "\n  changeSequence)"
         "\n VALUES ("
         "\n  :displayLabel,"
         "\n  :firstName,"
@@ -170,7 +180,12 @@ static const char *insertContact =
         "\n  :hasPhoneNumber,"
         "\n  :hasEmailAccount,"
         "\n  :hasOnlineAccount,"
-        "\n  :isOnline);";
+        "\n  :isOnline,"
+        "\n  :displayLabelSortKey,"
+        "\n  :firstNameSortKey,"
+        "\n  :lastNameSortKey,"
+        "\n  (SELECT sequence FROM ChangeSequence),"
+        "\n  (SELECT sequence FROM ChangeSequence));";
 
 static const char *updateContact =
         "\n UPDATE Contacts SET"
@@ -191,12 +206,77 @@ static const char *updateContact =
         "\n  hasPhoneNumber = CASE WHEN :valueKnown = 1 THEN :value ELSE hasPhoneNumber END, "
         "\n  hasEmailAddress = CASE WHEN :valueKnown = 1 THEN :value ELSE hasEmailAddress END, "
         "\n  hasOnlineAccount = CASE WHEN :valueKnown = 1 THEN :value ELSE hasOnlineAccount END, "
-        "\n  isOnline = CASE WHEN :valueKnown = 1 THEN :value ELSE isOnline END "
+        "\n  isOnline = CASE WHEN :valueKnown = 1 THEN :value ELSE isOnline END, "
+        "\n  displayLabelSortKey = :displayLabelSortKey,"
+        "\n  firstNameSortKey = :firstNameSortKey,"
+        "\n  lastNameSortKey = :lastNameSortKey,"
+        "\n  changeSequence = (SELECT sequence FROM ChangeSequence)"
         "\n WHERE contactId = :contactId;";
 
 static const char *removeContact =
         "\n DELETE FROM Contacts WHERE contactId = :contactId;";
 
+template <typename T, int N> static int lengthOf(const T(&)[N]) { return N; }
+
+// Beyond this many contacts, details are removed by set-based statements rather than the per-row trigger
+static const int bulkRemovalThreshold = 20;
+
+static const char *insertBulkRemoval =
+        "\n INSERT OR IGNORE INTO BulkRemovals (contactId)"
+        "\n VALUES (:contactId);";
+
+static const char *advanceChangeSequence =
+        "\n UPDATE ChangeSequence SET sequence = sequence + 1;";
+
+// Tombstones are retained long enough for sync adapters to collect the removals they record;
+// the latest sequence pruned is recorded, so that tokens preceding it can be rejected
+static const char *recordPrunedSequence =
+        "\n UPDATE ChangeSequence SET pruned = max(pruned, coalesce("
+        "\n  (SELECT max(changeSequence) FROM Tombstones WHERE removed < julianday('now', '-30 days')), 0));";
+
+static const char *pruneTombstones =
+        "\n DELETE FROM Tombstones WHERE removed < julianday('now', '-30 days');";
+
+static const char *bulkRemoveStatements[] =
+{
+    "INSERT OR REPLACE INTO Tombstones (contactId, syncTarget, removed, changeSequence)"
+    " SELECT contactId, syncTarget, julianday('now'), (SELECT sequence FROM ChangeSequence)"
+    " FROM Contacts WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM KeypadIndex WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Fingerprints WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM MatchKeys WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM DeferredAggregates WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Addresses WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Anniversaries WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Avatars WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Birthdays WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM EmailAddresses WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM GlobalPresences WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Guids WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Hobbies WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Nicknames WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Notes WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM OnlineAccounts WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Organizations WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM PhoneNumbers WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Presences WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Ringtones WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Tags WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Urls WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM TpMetadata WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Details WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Identities WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    // Each relationship column is deleted separately, so that both indexes are used
+    "DELETE FROM Relationships WHERE firstId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Relationships WHERE secondId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM Contacts WHERE contactId IN (SELECT contactId FROM BulkRemovals);",
+    "DELETE FROM BulkRemovals;"
+};
+
+// The search index is optional, so its set-based removal is executed only if it exists
+static const char *bulkRemoveSearchIndex =
+        "\n DELETE FROM SearchIndex WHERE docid IN (SELECT contactId FROM BulkRemovals);";
+
 static const char *existingRelationships =
         "\n SELECT firstId, secondId, type FROM Relationships;";
 
@@ -371,12 +451,14 @@ static const char *insertPhoneNumber =
         "\n  contactId,"
         "\n  phoneNumber,"
         "\n  subTypes,"
-        "\n  normalizedNumber)"
+        "\n  normalizedNumber,"
+        "\n  reversedNumber)"
         "\n VALUES ("
         "\n  :contactId,"
         "\n  :phoneNumber,"
         "\n  :subTypes,"
-        "\n  :normalizedNumber)";
+        "\n  :normalizedNumber,"
+        "\n  :reversedNumber)";
 
 static const char *insertPresence =
         "\n INSERT INTO Presences ("
@@ -458,6 +540,104 @@ static const char *insertIdentity =
         "\n  :identity,"
         "\n  :contactId);";
 
+static const char *selectKeypadNames =
+        "\n SELECT displayLabel, firstName, middleName, lastName FROM Contacts WHERE contactId = :contactId;";
+
+static const char *selectKeypadNicknames =
+        "\n SELECT nickname FROM Nicknames WHERE contactId = :contactId;";
+
+static const char *insertKeypadIndex =
+        "\n INSERT INTO KeypadIndex ("
+        "\n  contactId,"
+        "\n  field,"
+        "\n  keypad)"
+        "\n VALUES ("
+        "\n  :contactId,"
+        "\n  :field,"
+        "\n  :keypad);";
+
+static const char *removeSearchIndex =
+        "\n DELETE FROM SearchIndex WHERE docid = :contactId;";
+
+#define INSERT_SEARCH_INDEX \
+        "\n INSERT INTO SearchIndex (" \
+        "\n docid," \
+        "\n displayLabel," \
+        "\n firstName," \
+        "\n middleName," \
+        "\n lastName," \
+        "\n nickname," \
+        "\n emailAddress," \
+        "\n note," \
+        "\n organization)" \
+        "\n SELECT" \
+        "\n  Contacts.contactId," \
+        "\n  Contacts.displayLabel," \
+        "\n  Contacts.firstName," \
+        "\n  Contacts.middleName," \
+        "\n  Contacts.lastName," \
+        "\n  (SELECT group_concat(nickname, ' ') FROM Nicknames WHERE Nicknames.contactId = Contacts.contactId)," \
+        "\n  (SELECT group_concat(emailAddress, ' ') FROM EmailAddresses WHERE EmailAddresses.contactId = Contacts.contactId)," \
+        "\n  (SELECT group_concat(note, ' ') FROM Notes WHERE Notes.contactId = Contacts.contactId)," \
+        "\n  (SELECT group_concat(name, ' ') FROM Organizations WHERE Organizations.contactId = Contacts.contactId)" \
+        "\n FROM Contacts"
+
+static const char *insertSearchIndex =
+        INSERT_SEARCH_INDEX
+        "\n WHERE Contacts.contactId = :contactId;";
+
+static const char *insertSearchIndexRange =
+        INSERT_SEARCH_INDEX
+        "\n WHERE Contacts.contactId BETWEEN :firstId AND :lastId;";
+
+static const char *selectKeypadNamesRange =
+        "\n SELECT contactId, displayLabel, firstName, middleName, lastName FROM Contacts WHERE contactId BETWEEN :firstId AND :lastId;";
+
+static const char *selectKeypadNicknamesRange =
+        "\n SELECT contactId, nickname FROM Nicknames WHERE contactId BETWEEN :firstId AND :lastId;";
+
+static const char *insertMatchKeys =
+        "\n INSERT INTO MatchKeys (contactId, keyType, matchKey)"
+        "\n  SELECT contactId, %1, lowerLastName FROM Contacts"
+        "\n   WHERE contactId = :contactId AND lowerLastName != ''"
+        "\n  UNION SELECT contactId, %2, lowerNickname FROM Nicknames"
+        "\n   WHERE contactId = :contactId AND lowerNickname != ''"
+        "\n  UNION SELECT contactId, %3, normalizedNumber FROM PhoneNumbers"
+        "\n   WHERE contactId = :contactId AND normalizedNumber != ''"
+        "\n  UNION SELECT contactId, %4, lowerEmailAddress FROM EmailAddresses"
+        "\n   WHERE contactId = :contactId AND lowerEmailAddress != ''"
+        "\n  UNION SELECT contactId, %5, lowerAccountUri FROM OnlineAccounts"
+        "\n   WHERE contactId = :contactId AND lowerAccountUri != ''";
+
+static const char *insertMatchKey =
+        "\n INSERT INTO MatchKeys (contactId, keyType, matchKey)"
+        "\n VALUES (:contactId, :keyType, :matchKey);";
+
+static QString matchKeysStatement()
+{
+    return QString::fromLatin1(insertMatchKeys).arg(ContactsDatabase::LastNameKey)
+                                               .arg(ContactsDatabase::NicknameKey)
+                                               .arg(ContactsDatabase::PhoneNumberKey)
+                                               .arg(ContactsDatabase::EmailAddressKey)
+                                               .arg(ContactsDatabase::AccountUriKey);
+}
+
+static const char *selectFingerprint =
+        "\n SELECT fingerprint FROM Fingerprints WHERE contactId = :contactId;";
+
+static const char *insertFingerprint =
+        "\n INSERT OR REPLACE INTO Fingerprints (contactId, fingerprint)"
+        "\n VALUES (:contactId, :fingerprint);";
+
+static const char *insertDeferredAggregate =
+        "\n INSERT OR IGNORE INTO DeferredAggregates (contactId)"
+        "\n VALUES (:contactId);";
+
+static const char *selectDeferredAggregates =
+        "\n SELECT contactId FROM DeferredAggregates"
+        "\n ORDER BY contactId"
+        "\n LIMIT :limit;";
+
 
 static QSqlQuery prepare(const char *statement, const QSqlDatabase &database)
 {
@@ -503,7 +683,10 @@ ContactWriter::ContactWriter(const ContactsEngine &engine, const QSqlDatabase &d
     , m_findLocalForAggregate(prepare(findLocalForAggregate, database))
     , m_findAggregateForContact(prepare(findAggregateForContact, database))
     , m_findMaximumContactId(prepare(findMaximumContactId, database))
-    , m_findMatchForContact(prepare(findMatchForContact, database))
+    , m_selectMatchCandidates(prepare(selectMatchCandidates, database))
+    , m_selectMatchNames(prepare(selectMatchNames, database))
+    , m_selectUnmatchableAggregates(prepare(selectUnmatchableAggregates, database))
+    , m_checkAggregateSyncTarget(prepare(checkAggregateSyncTarget, database))
     , m_selectAggregateContactIds(prepare(selectAggregateContactIds, database))
     , m_childlessAggregateIds(prepare(childlessAggregateIds, database))
     , m_orphanContactIds(prepare(orphanContactIds, database))
@@ -513,6 +696,10 @@ ContactWriter::ContactWriter(const ContactsEngine &engine, const QSqlDatabase &d
     , m_insertContact(prepare(insertContact, database))
     , m_updateContact(prepare(updateContact, database))
     , m_removeContact(prepare(removeContact, database))
+    , m_insertBulkRemoval(prepare(insertBulkRemoval, database))
+    , m_advanceChangeSequence(prepare(advanceChangeSequence, database))
+    , m_recordPrunedSequence(prepare(recordPrunedSequence, database))
+    , m_pruneTombstones(prepare(pruneTombstones, database))
     , m_existingRelationships(prepare(existingRelationships, database))
     , m_insertRelationship(prepare(insertRelationship, database))
     , m_removeRelationship(prepare(removeRelationship, database))
@@ -555,24 +742,120 @@ ContactWriter::ContactWriter(const ContactsEngine &engine, const QSqlDatabase &d
     , m_removeUrl(prepare("DELETE FROM Urls WHERE contactId = :contactId;", database))
     , m_removeOriginMetadata(prepare("DELETE FROM TpMetadata WHERE contactId = :contactId;", database))
     , m_removeDetail(prepare("DELETE FROM Details WHERE contactId = :contactId AND detail = :detail;", database))
+    , m_removeDetailRow(prepare("DELETE FROM Details WHERE detailId = :detailId AND detail = :detail;", database))
     , m_removeIdentity(prepare("DELETE FROM Identities WHERE identity = :identity;", database))
+    , m_selectKeypadNames(prepare(selectKeypadNames, database))
+    , m_selectKeypadNicknames(prepare(selectKeypadNicknames, database))
+    , m_insertKeypadIndex(prepare(insertKeypadIndex, database))
+    , m_removeKeypadIndex(prepare("DELETE FROM KeypadIndex WHERE contactId = :contactId;", database))
+    , m_selectKeypadNamesRange(prepare(selectKeypadNamesRange, database))
+    , m_selectKeypadNicknamesRange(prepare(selectKeypadNicknamesRange, database))
+    , m_insertMatchKeys(prepare(matchKeysStatement().toLatin1().constData(), database))
+    , m_insertMatchKey(prepare(insertMatchKey, database))
+    , m_removeMatchKeys(prepare("DELETE FROM MatchKeys WHERE contactId = :contactId;", database))
+    , m_selectFingerprint(prepare(selectFingerprint, database))
+    , m_insertFingerprint(prepare(insertFingerprint, database))
+    , m_insertDeferredAggregate(prepare(insertDeferredAggregate, database))
+    , m_selectDeferredAggregates(prepare(selectDeferredAggregates, database))
+    , m_removeDeferredAggregate(prepare("DELETE FROM DeferredAggregates WHERE contactId = :contactId;", database))
     , m_reader(reader)
+    , m_searchIndex(ContactsDatabase::hasSearchIndex(database))
+    , m_deferAggregation(engine.aggregationDeferred())
+    , m_aggregationDeferred(false)
+    , m_transactionGroup(false)
+    , m_detailStatementCount(0)
+    , m_unchangedCount(0)
+    , m_savepointAggregationDeferred(false)
 {
+    if (m_searchIndex) {
+        m_removeSearchIndex = prepare(removeSearchIndex, database);
+        m_insertSearchIndex = prepare(insertSearchIndex, database);
+        m_insertSearchIndexRange = prepare(insertSearchIndexRange, database);
+    }
+
+    // The temporary table must exist before statements referring to it can be prepared
+    QSqlQuery createStagedIdsQuery(database);
+    if (!createStagedIdsQuery.exec(QLatin1String(createStagedContactIds))) {
+        qWarning() << "Failed to create staged contact ids table";
+        qWarning() << createStagedIdsQuery.lastError();
+    }
+    m_insertStagedContactId = prepare(insertStagedContactId, database);
+    m_selectStagedExistingContactIds = prepare(selectStagedExistingContactIds, database);
+    m_clearStagedContactIds = prepare("DELETE FROM temp.StagedContactIds;", database);
 }
 
 ContactWriter::~ContactWriter()
 {
 }
 
+int ContactWriter::detailStatementCount() const
+{
+    return m_detailStatementCount;
+}
+
+int ContactWriter::unchangedCount() const
+{
+    return m_unchangedCount;
+}
+
+bool ContactWriter::takeDeferredAggregation()
+{
+    const bool deferred = m_aggregationDeferred;
+    m_aggregationDeferred = false;
+    return deferred;
+}
+
+static const char *beginSavepoint = "SAVEPOINT GroupedWrite;";
+static const char *releaseSavepoint = "RELEASE SAVEPOINT GroupedWrite;";
+static const char *rollbackSavepoint = "ROLLBACK TO SAVEPOINT GroupedWrite;";
+
+bool ContactWriter::beginTransactionGroup()
+{
+    if (!beginTransaction())
+        return false;
+
+    m_transactionGroup = true;
+    return true;
+}
+
+bool ContactWriter::commitTransactionGroup()
+{
+    m_transactionGroup = false;
+    return commitTransaction();
+}
+
 bool ContactWriter::beginTransaction()
 {
+    if (m_transactionGroup) {
+        QSqlQuery query(m_database);
+        if (!query.exec(QLatin1String(beginSavepoint))) {
+            qWarning() << "Savepoint error:" << query.lastError();
+            return false;
+        }
+
+        m_savepointAggregationDeferred = m_aggregationDeferred;
+        m_savepointAddedIds = m_addedIds;
+        m_savepointRemovedIds = m_removedIds;
+        m_savepointChangedIds = m_changedIds;
+        return true;
+    }
+
     // We use a cross-process mutex to ensure only one process can
     // write to the DB at once.  Without locking, sqlite will back off
     // on write contention, and the backed-off process may never get access
     // if other processes are performing regular writes.
     if (m_databaseMutex->lock()) {
-        if (m_database.transaction())
-            return true;
+        if (m_database.transaction()) {
+            // Every row written in this transaction records the advanced sequence
+            if (m_advanceChangeSequence.exec()) {
+                m_advanceChangeSequence.finish();
+                return true;
+            }
+
+            qWarning() << "Failed to advance change sequence";
+            qWarning() << m_advanceChangeSequence.lastError();
+            m_database.rollback();
+        }
 
         m_databaseMutex->unlock();
     }
@@ -582,11 +865,23 @@ bool ContactWriter::beginTransaction()
 
 bool ContactWriter::commitTransaction()
 {
+    if (m_transactionGroup) {
+        // Changes are reported when the group is committed
+        QSqlQuery query(m_database);
+        if (!query.exec(QLatin1String(releaseSavepoint))) {
+            qWarning() << "Savepoint release error:" << query.lastError();
+            rollbackTransaction();
+            return false;
+        }
+        return true;
+    }
+
     if (!m_database.commit()) {
         qWarning() << "Commit error:" << m_database.lastError();
         rollbackTransaction();
         return false;
     }
+    m_engine.writeCommitted();
 
     if (m_databaseMutex->isLocked()) {
         m_databaseMutex->unlock();
@@ -611,6 +906,19 @@ bool ContactWriter::commitTransaction()
 
 void ContactWriter::rollbackTransaction()
 {
+    if (m_transactionGroup) {
+        QSqlQuery query(m_database);
+        if (!query.exec(QLatin1String(rollbackSavepoint)) || !query.exec(QLatin1String(releaseSavepoint))) {
+            qWarning() << "Savepoint rollback error:" << query.lastError();
+        }
+
+        m_aggregationDeferred = m_savepointAggregationDeferred;
+        m_addedIds = m_savepointAddedIds;
+        m_removedIds = m_savepointRemovedIds;
+        m_changedIds = m_savepointChangedIds;
+        return;
+    }
+
     m_database.rollback();
     if (m_databaseMutex->isLocked()) {
         m_databaseMutex->unlock();
@@ -621,6 +929,7 @@ void ContactWriter::rollbackTransaction()
     m_removedIds.clear();
     m_changedIds.clear();
     m_addedIds.clear();
+    m_aggregationDeferred = false;
 }
 
 QContactManager::Error ContactWriter::setIdentity(
@@ -1045,6 +1354,103 @@ QContactManager::Error ContactWriter::removeRelationships(
     return QContactManager::NoError;
 }
 
+bool ContactWriter::removeContacts(const QVariantList &contactIds)
+{
+    if (!m_recordPrunedSequence.exec()) {
+        qWarning() << "Failed to record pruned contact tombstones";
+        qWarning() << m_recordPrunedSequence.lastError();
+        return false;
+    }
+    m_recordPrunedSequence.finish();
+
+    if (!m_pruneTombstones.exec()) {
+        qWarning() << "Failed to prune contact tombstones";
+        qWarning() << m_pruneTombstones.lastError();
+        return false;
+    }
+    m_pruneTombstones.finish();
+
+    if (contactIds.size() < bulkRemovalThreshold) {
+        // Small removals are handled per-row, by the RemoveContactDetails trigger
+        m_removeContact.bindValue(QLatin1String(":contactId"), contactIds);
+        if (!m_removeContact.execBatch()) {
+            qWarning() << m_removeContact.lastError();
+            return false;
+        }
+        m_removeContact.finish();
+        return true;
+    }
+
+    // Stage the ids in BulkRemovals, which exempts them from the per-row triggers,
+    // then remove the rows for all of them with one statement per table
+    m_insertBulkRemoval.bindValue(QLatin1String(":contactId"), contactIds);
+    if (!m_insertBulkRemoval.execBatch()) {
+        qWarning() << "Failed to stage contact ids for bulk removal";
+        qWarning() << m_insertBulkRemoval.lastError();
+        return false;
+    }
+    m_insertBulkRemoval.finish();
+
+    if (m_searchIndex) {
+        QSqlQuery query(m_database);
+        if (!query.exec(QLatin1String(bulkRemoveSearchIndex))) {
+            qWarning() << query.lastError();
+            qWarning() << bulkRemoveSearchIndex;
+            return false;
+        }
+    }
+
+    for (int i = 0; i < lengthOf(bulkRemoveStatements); ++i) {
+        QSqlQuery query(m_database);
+        if (!query.exec(QLatin1String(bulkRemoveStatements[i]))) {
+            qWarning() << query.lastError();
+            qWarning() << bulkRemoveStatements[i];
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ContactWriter::selectExistingContactIds(const QVariantList &contactIds, QSet<quint32> *existingIds, QContactManager::Error *error)
+{
+    if (contactIds.isEmpty())
+        return true;
+
+    // Stage the ids in a temporary table, and join against the primary key of Contacts
+    bool selected = true;
+    m_insertStagedContactId.bindValue(0, contactIds);
+    if (!m_insertStagedContactId.execBatch()) {
+        qWarning() << "Failed to stage contact ids for existence check";
+        qWarning() << m_insertStagedContactId.lastError();
+        selected = false;
+    } else {
+        m_insertStagedContactId.finish();
+
+        if (!m_selectStagedExistingContactIds.exec()) {
+            qWarning() << "Failed to select existing staged contact ids";
+            qWarning() << m_selectStagedExistingContactIds.lastError();
+            selected = false;
+        } else {
+            while (m_selectStagedExistingContactIds.next()) {
+                existingIds->insert(m_selectStagedExistingContactIds.value(0).toUInt());
+            }
+            m_selectStagedExistingContactIds.finish();
+        }
+    }
+
+    if (!m_clearStagedContactIds.exec()) {
+        qWarning() << "Failed to clear staged contact ids";
+        qWarning() << m_clearStagedContactIds.lastError();
+        selected = false;
+    }
+    m_clearStagedContactIds.finish();
+
+    if (!selected)
+        *error = QContactManager::UnspecifiedError;
+    return selected;
+}
+
 QContactManager::Error ContactWriter::remove(const QList<QContactIdType> &contactIds, QMap<int, QContactManager::Error> *errorMap, bool withinTransaction)
 {
     if (contactIds.isEmpty())
@@ -1063,19 +1469,16 @@ QContactManager::Error ContactWriter::remove(const QList<QContactIdType> &contac
     }
     m_selfContactId.finish();
 
-    // grab the existing contact ids so that we can perform removal detection
-    // XXX TODO: for perf, remove this check.  Less conformant, but client
-    // shouldn't care (ie, not exists == has been removed).
-    QSet<quint32> existingContactIds;
-    if (!m_existingContactIds.exec()) {
-        qWarning() << "Failed to fetch existing contact ids during remove";
-        qWarning() << m_existingContactIds.lastError();
-        return QContactManager::UnspecifiedError;
-    }
-    while (m_existingContactIds.next()) {
-        existingContactIds.insert(m_existingContactIds.value(0).toUInt());
+    // determine which of the requested contacts exist, so that we can perform removal detection
+    QVariantList boundContactIds;
+    foreach (const QContactIdType &contactId, contactIds) {
+        boundContactIds.append(ContactId::databaseId(contactId));
     }
-    m_existingContactIds.finish();
+
+    QSet<quint32> existingContactIds;
+    QContactManager::Error existError = QContactManager::NoError;
+    if (!selectExistingContactIds(boundContactIds, &existingContactIds, &existError))
+        return existError;
 
     // determine which contacts we actually need to remove
     QContactManager::Error error = QContactManager::NoError;
@@ -1107,17 +1510,14 @@ QContactManager::Error ContactWriter::remove(const QList<QContactIdType> &contac
             qWarning() << "Unable to begin database transaction while removing contacts";
             return QContactManager::UnspecifiedError;
         }
-        m_removeContact.bindValue(QLatin1String(":contactId"), boundRealRemoveIds);
-        if (!m_removeContact.execBatch()) {
+        if (!removeContacts(boundRealRemoveIds)) {
             qWarning() << "Failed to remove contacts";
-            qWarning() << m_removeContact.lastError();
             if (!withinTransaction) {
                 // only rollback if we created a transaction.
                 rollbackTransaction();
             }
             return QContactManager::UnspecifiedError;
         }
-        m_removeContact.finish();
         foreach (const QContactIdType &rrid, realRemoveIds) {
             m_removedIds.insert(rrid);
         }
@@ -1178,18 +1578,14 @@ QContactManager::Error ContactWriter::remove(const QList<QContactIdType> &contac
 
     // remove the non-aggregate contacts
     if (boundNonAggregatesToRemove.size() > 0) {
-        m_removeContact.bindValue(QLatin1String(":contactId"), boundNonAggregatesToRemove);
-        if (!m_removeContact.execBatch()) {
+        if (!removeContacts(boundNonAggregatesToRemove)) {
             qWarning() << "Failed to removed non-aggregate contacts";
-            qWarning() << m_removeContact.lastError();
             if (!withinTransaction) {
                 // only rollback the transaction if we created it
                 rollbackTransaction();
             }
             return QContactManager::UnspecifiedError;
         }
-
-        m_removeContact.finish();
     }
 
     // remove the aggregate contacts - and any contacts they aggregate
@@ -1213,17 +1609,14 @@ QContactManager::Error ContactWriter::remove(const QList<QContactIdType> &contac
         m_findConstituentsForAggregate.finish();
 
         // remove the aggregates + the aggregated
-        m_removeContact.bindValue(QLatin1String(":contactId"), boundAggregatesToRemove);
-        if (!m_removeContact.execBatch()) {
+        if (!removeContacts(boundAggregatesToRemove)) {
             qWarning() << "Failed to removed aggregate contacts (and the contacts they aggregate)";
-            qWarning() << m_removeContact.lastError();
             if (!withinTransaction) {
                 // only rollback the transaction if we created it
                 rollbackTransaction();
             }
             return QContactManager::UnspecifiedError;
         }
-        m_removeContact.finish();
     }
 
     // removing aggregates if they no longer aggregate any contacts.
@@ -1249,7 +1642,18 @@ QContactManager::Error ContactWriter::remove(const QList<QContactIdType> &contac
 
     // Now regenerate our remaining aggregates as required.
     if (aggregatesOfRemoved.size() > 0) {
-        regenerateAggregates(aggregatesOfRemoved, DetailList(), true);
+        if (m_deferAggregation) {
+            QContactManager::Error deferError = deferAggregates(aggregatesOfRemoved);
+            if (deferError != QContactManager::NoError) {
+                if (!withinTransaction) {
+                    // only rollback the transaction if we created it
+                    rollbackTransaction();
+                }
+                return deferError;
+            }
+        } else {
+            regenerateAggregates(aggregatesOfRemoved, DetailList(), true);
+        }
     }
 
     // Success!  If we created a transaction, commit.
@@ -1414,6 +1818,7 @@ template <typename T> bool ContactWriter::removeCommonDetails(
     m_removeDetail.bindValue(0, contactId);
     m_removeDetail.bindValue(1, detailTypeName<T>());
 
+    ++m_detailStatementCount;
     if (!m_removeDetail.exec()) {
         qWarning() << "Failed to remove common detail for" << detailTypeName<T>();
         qWarning() << m_removeDetail.lastError();
@@ -1507,14 +1912,6 @@ static bool detailValuesSuperset(const QContactDetail &lhs, const QContactDetail
     return true;
 }
 
-static bool detailsEquivalent(const QContactDetail &lhs, const QContactDetail &rhs)
-{
-    // Same as operator== except ignores differences in accessConstraints values
-    if (detailType(lhs) != detailType(rhs))
-        return false;
-    return detailValuesEqual(lhs, rhs);
-}
-
 static bool detailsSuperset(const QContactDetail &lhs, const QContactDetail &rhs)
 {
     // True is lhs is a superset of rhs
@@ -1523,6 +1920,48 @@ static bool detailsSuperset(const QContactDetail &lhs, const QContactDetail &rhs
     return detailValuesSuperset(lhs, rhs);
 }
 
+static void streamVariant(QDataStream &stream, const QVariant &value)
+{
+#ifdef USING_QTPIM
+    // QList<int> values have no registered stream operators
+    static const int QListIntType = QMetaType::type("QList<int>");
+
+    if (value.userType() == QListIntType) {
+        stream << QListIntType << value.value<QList<int> >();
+        return;
+    }
+#endif
+    if (value.userType() == QMetaType::QString && value.toString().isNull()) {
+        // Null and empty strings compare equal
+        stream << QVariant(QString::fromLatin1(""));
+        return;
+    }
+    stream << value;
+}
+
+static void streamDetailValues(QDataStream &stream, const QContactDetail &detail)
+{
+    const DetailMap values(detailValues(detail));
+    DetailMap::const_iterator it = values.constBegin(), end = values.constEnd();
+    for ( ; it != end; ++it) {
+        stream << it.key();
+        streamVariant(stream, *it);
+    }
+}
+
+static QByteArray detailFingerprint(const QContactDetail &detail)
+{
+    // Details of the same type with equal values have equal fingerprints; as with
+    // operator==, except that differences in accessConstraints values are ignored
+    QByteArray data;
+    {
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream << detailTypeName(detail);
+        streamDetailValues(stream, detail);
+    }
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+}
+
 QVariant detailLinkedUris(const QContactDetail &detail)
 {
     static const QString separator = QString::fromLatin1(";");
@@ -1590,6 +2029,7 @@ template <typename T> bool ContactWriter::writeCommonDetails(
         m_insertDetail.bindValue(5, contexts);
         m_insertDetail.bindValue(6, accessConstraints);
 
+        ++m_detailStatementCount;
         if (!m_insertDetail.exec()) {
             qWarning() << "Failed to write common details for" << detailTypeName<T>();
             qWarning() << m_insertDetail.lastError();
@@ -1603,30 +2043,256 @@ template <typename T> bool ContactWriter::writeCommonDetails(
     return true;
 }
 
+QSqlQuery &ContactWriter::detailTableQuery(QHash<QString, QSqlQuery> *queries, const char *statement, const char *table)
+{
+    const QString text(QString::fromLatin1(statement).arg(QString::fromLatin1(table)));
+
+    QHash<QString, QSqlQuery>::iterator it = queries->find(text);
+    if (it == queries->end())
+        it = queries->insert(text, prepare(text.toLatin1().constData(), m_database));
+    return *it;
+}
+
+bool ContactWriter::verifyImportedIds(const char *table, const char *column, quint32 lastId, int count, QContactManager::Error *error)
+{
+    // The rows of a batch are expected to receive consecutive ids ending with the last inserted,
+    // since we hold the write lock; the ids of the batch are derived from that range, so verify
+    // that the range is fully occupied before relying on it
+    if (lastId < static_cast<quint32>(count)) {
+        qWarning() << "Imported rows in" << table << "cannot end at id" << lastId;
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+
+    const QByteArray statement(QByteArray("SELECT count(*) FROM %1 WHERE ") + column + " BETWEEN :firstId AND :lastId;");
+    QSqlQuery &query(detailTableQuery(&m_countIdRanges, statement.constData(), table));
+
+    query.bindValue(0, lastId - count + 1);
+    query.bindValue(1, lastId);
+    if (!query.exec() || !query.next()) {
+        qWarning() << "Failed to verify imported ids in" << table;
+        qWarning() << query.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    const int rangeCount = query.value(0).toInt();
+    query.finish();
+
+    if (rangeCount != count) {
+        qWarning() << "Imported rows in" << table << "did not receive consecutive ids:" << rangeCount << "of" << count << "ending at" << lastId;
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    return true;
+}
+
+bool ContactWriter::selectDetailIds(quint32 contactId, const char *table, QVariantList *detailIds, QContactManager::Error *error)
+{
+    QSqlQuery &query(detailTableQuery(&m_selectDetailIds, "SELECT detailId FROM %1 WHERE contactId = :contactId ORDER BY detailId;", table));
+
+    query.bindValue(0, contactId);
+    ++m_detailStatementCount;
+    if (!query.exec()) {
+        qWarning() << "Failed to select existing detail ids from" << table;
+        qWarning() << query.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    while (query.next())
+        detailIds->append(query.value(0));
+    query.finish();
+    return true;
+}
+
+template <typename T> bool ContactWriter::removeDetailRows(
+        const QVariantList &detailIds, const char *table, QContactManager::Error *error)
+{
+    QSqlQuery &query(detailTableQuery(&m_removeDetailIds, "DELETE FROM %1 WHERE detailId = :detailId;", table));
+
+    query.bindValue(0, detailIds);
+    ++m_detailStatementCount;
+    if (!query.execBatch()) {
+        qWarning() << "Failed to remove changed details for" << detailTypeName<T>();
+        qWarning() << query.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    query.finish();
+
+    QVariantList detailNames;
+    for (int i = 0; i < detailIds.count(); ++i)
+        detailNames.append(QString::fromLatin1(detailTypeName<T>()));
+
+    m_removeDetailRow.bindValue(0, detailIds);
+    m_removeDetailRow.bindValue(1, detailNames);
+    ++m_detailStatementCount;
+    if (!m_removeDetailRow.execBatch()) {
+        qWarning() << "Failed to remove changed common details for" << detailTypeName<T>();
+        qWarning() << m_removeDetailRow.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_removeDetailRow.finish();
+    return true;
+}
+
+QSqlQuery &ContactWriter::updateDetailQuery(const QSqlQuery &insertQuery, const char *table)
+{
+    const QString tableName(QString::fromLatin1(table));
+
+    QHash<QString, QSqlQuery>::iterator it = m_updateDetailRows.find(tableName);
+    if (it == m_updateDetailRows.end()) {
+        // Assign the columns of the insert statement in order, so that the values bound
+        // by bindDetail() can be copied positionally to update an existing row
+        const QString insert(insertQuery.lastQuery());
+        const int columnsBegin = insert.indexOf(QLatin1Char('(')) + 1;
+        const int columnsEnd = insert.indexOf(QLatin1Char(')'), columnsBegin);
+
+        QStringList assignments;
+        foreach (const QString &column, insert.mid(columnsBegin, columnsEnd - columnsBegin).split(QLatin1Char(',')))
+            assignments.append(column.trimmed() + QLatin1String(" = ?"));
+
+        const QString statement(QString::fromLatin1("UPDATE %1 SET %2 WHERE detailId = ?;").arg(tableName).arg(assignments.join(QLatin1String(", "))));
+        it = m_updateDetailRows.insert(tableName, prepare(statement.toLatin1().constData(), m_database));
+    }
+    return *it;
+}
+
+template <typename T> bool ContactWriter::updateDetailRows(
+        quint32 contactId, const QVariantList &detailIds, const QList<T> &details, const char *table, QContactManager::Error *error)
+{
+    // The common detail rows are rewritten, since they exist only for details having common values
+    QVariantList detailNames;
+    for (int i = 0; i < detailIds.count(); ++i)
+        detailNames.append(QString::fromLatin1(detailTypeName<T>()));
+
+    m_removeDetailRow.bindValue(0, detailIds);
+    m_removeDetailRow.bindValue(1, detailNames);
+    ++m_detailStatementCount;
+    if (!m_removeDetailRow.execBatch()) {
+        qWarning() << "Failed to remove changed common details for" << detailTypeName<T>();
+        qWarning() << m_removeDetailRow.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_removeDetailRow.finish();
+
+    for (int i = 0; i < details.count(); ++i) {
+        const T &detail(details.at(i));
+
+        QSqlQuery &insertQuery = bindDetail(contactId, detail);
+        QSqlQuery &query = updateDetailQuery(insertQuery, table);
+
+        const int valueCount = insertQuery.boundValues().count();
+        for (int j = 0; j < valueCount; ++j)
+            query.bindValue(j, insertQuery.boundValue(j));
+        query.bindValue(valueCount, detailIds.at(i));
+
+        ++m_detailStatementCount;
+        if (!query.exec()) {
+            qWarning() << "Failed to update details for" << detailTypeName<T>();
+            qWarning() << query.lastError();
+            *error = QContactManager::UnspecifiedError;
+            return false;
+        }
+        query.finish();
+
+        if (!writeCommonDetails(contactId, detailIds.at(i), detail, error))
+            return false;
+    }
+    return true;
+}
+
+static bool storedDetailMatches(const QContactDetail &stored, const QContactDetail &detail)
+{
+    return detailValuesEqual(stored, detail) && stored.accessConstraints() == detail.accessConstraints();
+}
+
 template <typename T> bool ContactWriter::writeDetails(
         quint32 contactId,
+        const QContact &storedContact,
         QContact *contact,
         QSqlQuery &removeQuery,
+        const char *table,
         const DetailList &definitionMask,
         QContactManager::Error *error)
 {
     if (!definitionMask.isEmpty() && !detailListContains<T>(definitionMask))
         return true;
 
-    if (!removeCommonDetails<T>(contactId, error))
-        return false;
+    QList<T> details(contact->details<T>());
 
-    removeQuery.bindValue(0, contactId);
-    if (!removeQuery.exec()) {
-        qWarning() << "Failed to remove existing details for" << detailTypeName<T>();
-        qWarning() << removeQuery.lastError();
-        *error = QContactManager::UnspecifiedError;
-        return false;
+    // Only the details that differ from the stored details are written.  The stored details
+    // are read in detailId order, so they can be paired with the detail ids selected here;
+    // if the two do not correspond, all the stored details of this type are replaced.
+    const QList<T> storedDetails(storedContact.details<T>());
+    if (!storedDetails.isEmpty()) {
+        QVariantList storedIds;
+        if (!selectDetailIds(contactId, table, &storedIds, error))
+            return false;
+
+        if (storedIds.count() == storedDetails.count()) {
+            // Details are read back in detailId order, and inserted details are given ids greater
+            // than those of all retained details.  So a stored detail can only be retained if it
+            // follows the details retained before it; once a detail cannot be retained, it and
+            // the details following it are written over the remaining stored rows in order, and
+            // only those exceeding the stored rows are inserted.
+            QVariantList removedIds;
+            QVariantList updatedIds;
+            QList<T> updatedDetails;
+            int retainedIndex = 0;
+            int storedIndex = 0;
+            for ( ; retainedIndex < details.count(); ++retainedIndex) {
+                int index = storedIndex;
+                for ( ; index < storedDetails.count(); ++index) {
+                    if (storedDetailMatches(storedDetails.at(index), details.at(retainedIndex)))
+                        break;
+                }
+                if (index == storedDetails.count())
+                    break;
+
+                // Any stored details skipped over are no longer wanted at their position
+                for ( ; storedIndex < index; ++storedIndex)
+                    removedIds.append(storedIds.at(storedIndex));
+                ++storedIndex;
+            }
+
+            // Rows following the last retained detail keep their position when updated in place
+            int detailIndex = retainedIndex;
+            for ( ; storedIndex < storedDetails.count() && detailIndex < details.count(); ++storedIndex, ++detailIndex) {
+                if (!storedDetailMatches(storedDetails.at(storedIndex), details.at(detailIndex))) {
+                    updatedIds.append(storedIds.at(storedIndex));
+                    updatedDetails.append(details.at(detailIndex));
+                }
+            }
+            for ( ; storedIndex < storedDetails.count(); ++storedIndex)
+                removedIds.append(storedIds.at(storedIndex));
+
+            details = details.mid(detailIndex);
+
+            if (!removedIds.isEmpty() && !removeDetailRows<T>(removedIds, table, error))
+                return false;
+            if (!updatedIds.isEmpty() && !updateDetailRows<T>(contactId, updatedIds, updatedDetails, table, error))
+                return false;
+        } else {
+            if (!removeCommonDetails<T>(contactId, error))
+                return false;
+
+            removeQuery.bindValue(0, contactId);
+            ++m_detailStatementCount;
+            if (!removeQuery.exec()) {
+                qWarning() << "Failed to remove existing details for" << detailTypeName<T>();
+                qWarning() << removeQuery.lastError();
+                *error = QContactManager::UnspecifiedError;
+                return false;
+            }
+            removeQuery.finish();
+        }
     }
-    removeQuery.finish();
 
-    foreach (const T &detail, contact->details<T>()) {
+    foreach (const T &detail, details) {
         QSqlQuery &query = bindDetail(contactId, detail);
+        ++m_detailStatementCount;
         if (!query.exec()) {
             qWarning() << "Failed to write details for" << detailTypeName<T>();
             qWarning() << query.lastError();
@@ -1656,36 +2322,47 @@ static bool betterPresence(const QContactPresence &detail, const QContactPresenc
     return (detail.presenceState() < best.presenceState());
 }
 
-QContactManager::Error ContactWriter::save(
-            QList<QContact> *contacts,
-            const DetailList &definitionMask,
-            QMap<int, bool> *aggregatesUpdated,
-            QMap<int, QContactManager::Error> *errorMap,
-            bool withinTransaction,
-            bool withinAggregateUpdate)
+static bool singleSyncTarget(const QList<QContact> &contacts)
 {
+    // Note that empty == "local" for all intents and purposes.
+    QString batchSyncTarget;
+    for (int i = 0; i < contacts.count(); ++i) {
+        // retrieve current contact's sync target
+        QString currSyncTarget = contacts.at(i).detail<QContactSyncTarget>().syncTarget();
+        if (currSyncTarget.isEmpty()) {
+            currSyncTarget = QLatin1String("local");
+        }
+
+        // determine whether it's valid
+        if (batchSyncTarget.isEmpty()) {
+            batchSyncTarget = currSyncTarget;
+        } else if (batchSyncTarget != currSyncTarget) {
+            return false;
+        }
+    }
+    return true;
+}
+
+QContactManager::Error ContactWriter::save(
+            QList<QContact> *contacts,
+            const DetailList &definitionMask,
+            QMap<int, bool> *aggregatesUpdated,
+            QMap<int, QContactManager::Error> *errorMap,
+            bool withinTransaction,
+            bool withinAggregateUpdate)
+{
+    if (!withinAggregateUpdate) {
+        m_unchangedCount = 0;
+        m_detailStatementCount = 0;
+    }
+
     if (contacts->isEmpty())
         return QContactManager::NoError;
 
     // Check that all of the contacts have the same sync target.
-    // Note that empty == "local" for all intents and purposes.
-    if (!withinAggregateUpdate) {
-        QString batchSyncTarget;
-        for (int i = 0; i < contacts->count(); ++i) {
-            // retrieve current contact's sync target
-            QString currSyncTarget = (*contacts)[i].detail<QContactSyncTarget>().syncTarget();
-            if (currSyncTarget.isEmpty()) {
-                currSyncTarget = QLatin1String("local");
-            }
-
-            // determine whether it's valid
-            if (batchSyncTarget.isEmpty()) {
-                batchSyncTarget = currSyncTarget;
-            } else if (batchSyncTarget != currSyncTarget) {
-                qWarning() << "Error: contacts from multiple sync targets specified in single batch save!";
-                return QContactManager::UnspecifiedError;
-            }
-        }
+    if (!withinAggregateUpdate && !singleSyncTarget(*contacts)) {
+        qWarning() << "Error: contacts from multiple sync targets specified in single batch save!";
+        return QContactManager::UnspecifiedError;
     }
 
     if (!withinTransaction && !beginTransaction()) {
@@ -1705,20 +2382,31 @@ QContactManager::Error ContactWriter::save(
 
     QContactManager::Error worstError = QContactManager::NoError;
     QContactManager::Error err = QContactManager::NoError;
+    QList<QContact *> createdContacts;
+    QList<int> createdIndexes;
     for (int i = 0; i < contacts->count(); ++i) {
         QContact &contact = (*contacts)[i];
         const QContactIdType contactId = ContactId::apiId(contact);
         bool aggregateUpdated = false;
+        bool unchanged = false;
         if (ContactId::databaseId(contactId) == 0) {
-            err = create(&contact, definitionMask, maxAggregateId, true, withinAggregateUpdate);
+            err = create(&contact, definitionMask);
             if (err == QContactManager::NoError) {
                 m_addedIds.insert(ContactId::apiId(contact));
+                if (contact.detail<QContactSyncTarget>().value(QContactSyncTarget::FieldSyncTarget) != QLatin1String("aggregate")) {
+                    createdContacts.append(&contact);
+                    createdIndexes.append(i);
+                }
             } else {
                 qWarning() << "Error creating contact:" << err << "syncTarget:" << contact.detail<QContactSyncTarget>().syncTarget();
             }
         } else {
-            err = update(&contact, definitionMask, &aggregateUpdated, true, withinAggregateUpdate);
-            if (err == QContactManager::NoError) {
+            err = update(&contact, definitionMask, &aggregateUpdated, &unchanged, true, withinAggregateUpdate);
+            if (err == QContactManager::NoError && unchanged) {
+                // nothing was written, so there is no change to report
+                if (!withinAggregateUpdate)
+                    ++m_unchangedCount;
+            } else if (err == QContactManager::NoError) {
                 m_changedIds.insert(contactId);
             } else {
                 qWarning() << "Error updating contact" << contactId << ":" << err;
@@ -1735,6 +2423,26 @@ QContactManager::Error ContactWriter::save(
         }
     }
 
+#ifdef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
+    if (!withinAggregateUpdate && worstError == QContactManager::NoError && !createdContacts.isEmpty()) {
+        // either update the aggregate contacts (if they exist) or create new ones, for all of the new contacts together
+        const int detailStatementCount = m_detailStatementCount;
+        err = aggregateContacts(createdContacts, definitionMask, maxAggregateId, true);
+        m_detailStatementCount = detailStatementCount;
+        if (err != QContactManager::NoError) {
+            qWarning() << "Error aggregating" << createdContacts.count() << "created contacts:" << err;
+            worstError = err;
+            if (errorMap) {
+                foreach (int index, createdIndexes) {
+                    errorMap->insert(index, err);
+                }
+            }
+        }
+    }
+#else
+    Q_UNUSED(maxAggregateId)
+#endif
+
     if (!withinTransaction) {
         // only attempt to commit/rollback the transaction if we created it
         if (worstError != QContactManager::NoError) {
@@ -1907,8 +2615,23 @@ static QContactManager::Error calculateDelta(ContactReader *reader, QContact *co
     }
 
     // Determine which details are in the update contact which aren't in the database contact:
-    // Detail order is not defined, so loop over the entire set for each, removing matches or
-    // superset details (eg, backend added a field (like lastModified to timestamp) on previous save)
+    // Detail order is not defined, so first remove the details with identical values, which are
+    // found by fingerprint.
+    QHash<QByteArray, QList<QContactDetail> > dbDetails;
+    foreach (const QContactDetail &ddb, dbContact.details()) {
+        dbDetails[detailFingerprint(ddb)].append(ddb);
+    }
+    foreach (QContactDetail dup, upContact.details()) {
+        QHash<QByteArray, QList<QContactDetail> >::iterator it = dbDetails.find(detailFingerprint(dup));
+        if (it != dbDetails.end() && !it->isEmpty()) {
+            QContactDetail ddb = it->takeFirst();
+            dbContact.removeDetail(&ddb);
+            upContact.removeDetail(&dup);
+        }
+    }
+
+    // Then loop over the remainder for each, removing superset details (eg, backend
+    // added a field (like lastModified to timestamp) on previous save)
     foreach (QContactDetail ddb, dbContact.details()) {
         foreach (QContactDetail dup, upContact.details()) {
             if (detailsSuperset(ddb, dup)) {
@@ -1961,6 +2684,11 @@ static void promoteDetailsToLocal(const QList<QContactDetail> addDelta, const QL
     // (eg, if the client attempted to manually remove a detail which
     // comes from a synced contact, rather than the local contact) -
     // in which case, it'll be ignored.
+    QHash<QByteArray, QList<QContactDetail> > localDetails;
+    foreach (const QContactDetail &det, localContact->details()) {
+        localDetails[detailFingerprint(det)].append(det);
+    }
+
     QList<QContactDetail> notPresentInLocal;
     foreach (const QContactDetail &det, remDelta) {
         if (detailType(det) == detailType<QContactGuid>() ||
@@ -1983,19 +2711,12 @@ static void promoteDetailsToLocal(const QList<QContactDetail> addDelta, const QL
             localContact->removeDetail(&detToRemove);
         } else {
             // all other details are just removed directly.
-            bool found = false;
-            QList<QContactDetail> allDets = localContact->details();
-            for (int j = 0; j < allDets.size(); ++j) {
-                detToRemove = allDets.at(j);
-                if (detailsEquivalent(detToRemove, det)) {
-                    // note: this comparison does value checking only.
-                    localContact->removeDetail(&detToRemove);
-                    found = true;
-                    break;
-                }
-            }
-
-            if (!found) {
+            // note: the fingerprint comparison does value checking only.
+            QHash<QByteArray, QList<QContactDetail> >::iterator it = localDetails.find(detailFingerprint(det));
+            if (it != localDetails.end() && !it->isEmpty()) {
+                detToRemove = it->takeFirst();
+                localContact->removeDetail(&detToRemove);
+            } else {
                 notPresentInLocal.append(det);
             }
         }
@@ -2020,6 +2741,12 @@ static void promoteDetailsToLocal(const QList<QContactDetail> addDelta, const QL
     qWarning() << "promoteDetailsToLocal: IGNORED" << notPresentInLocal.size() << "details:" << ignoredStr;
 #endif
 
+    // Don't promote details already in the local, or those not originally present in the local
+    QSet<QByteArray> noPromoteFingerprints;
+    foreach (const QContactDetail &det, localContact->details() + notPresentInLocal) {
+        noPromoteFingerprints.insert(detailFingerprint(det));
+    }
+
     foreach (QContactDetail det, addDelta) {
         if (detailType(det) == detailType<QContactGuid>() ||
             detailType(det) == detailType<QContactSyncTarget>() ||
@@ -2079,19 +2806,10 @@ static void promoteDetailsToLocal(const QList<QContactDetail> addDelta, const QL
             // This is a pretty crude heuristic.  The detail equality
             // algorithm only attempts to match values, not key/value pairs.
             // XXX TODO: use a better heuristic to minimise duplicates.
-            bool needsPromote = true;
-
-            // Don't promote details already in the local, or those not originally present in the local
-            QList<QContactDetail> noPromoteDetails(localContact->details() + notPresentInLocal);
-            foreach (QContactDetail ld, noPromoteDetails) {
-                if (detailsEquivalent(det, ld)) {
-                    needsPromote = false;
-                    break;
-                }
-            }
-
-            if (needsPromote) {
+            const QByteArray fingerprint(detailFingerprint(det));
+            if (!noPromoteFingerprints.contains(fingerprint)) {
                 localContact->saveDetail(&det);
+                noPromoteFingerprints.insert(fingerprint);
             }
         }
     }
@@ -2294,6 +3012,11 @@ static void promoteDetailsToAggregate(const QContact &contact, QContact *aggrega
 {
     static const ContactWriter::DetailList unpromotedDetailTypes(getUnpromotedDetailTypes());
 
+    QSet<QByteArray> aggregateFingerprints;
+    foreach (const QContactDetail &detail, aggregate->details()) {
+        aggregateFingerprints.insert(detailFingerprint(detail));
+    }
+
     QList<QContactDetail> currDetails = contact.details();
     for (int j = 0; j < currDetails.size(); ++j) {
         QContactDetail currDet = currDetails.at(j);
@@ -2381,16 +3104,9 @@ static void promoteDetailsToAggregate(const QContact &contact, QContact *aggrega
             // This is a pretty crude heuristic.  The detail equality
             // algorithm only attempts to match values, not key/value pairs.
             // XXX TODO: use a better heuristic to minimise duplicates.
-            bool needsPromote = true;
-            QList<QContactDetail> allADetails = aggregate->details();
-            foreach (QContactDetail ad, allADetails) {
-                if (detailsEquivalent(currDet, ad)) {
-                    needsPromote = false;
-                    break;
-                }
-            }
-
-            if (needsPromote) {
+            const QByteArray fingerprint(detailFingerprint(currDet));
+            if (!aggregateFingerprints.contains(fingerprint)) {
+                aggregateFingerprints.insert(fingerprint);
                 QString syncTarget(contact.detail<QContactSyncTarget>().value<QString>(QContactSyncTarget::FieldSyncTarget));
                 if (!syncTarget.isEmpty() && syncTarget != QLatin1String("local")) {
                     QContactManagerEngine::setDetailAccessConstraints(&currDet, QContactDetail::ReadOnly | QContactDetail::Irremovable);
@@ -2401,22 +3117,41 @@ static void promoteDetailsToAggregate(const QContact &contact, QContact *aggrega
     }
 }
 
-/*
-   This function is called when a new contact is created.  The
-   aggregate contacts are searched for a match, and the matching
-   one updated if it exists; or a new aggregate is created.
-*/
-QContactManager::Error ContactWriter::updateOrCreateAggregate(QContact *contact, const DetailList &definitionMask, int maxAggregateId, bool withinTransaction)
+static bool betterMatch(const QPair<quint32, quint32> &lhs, const QPair<quint32, quint32> &rhs)
 {
-    // 1) search for match
-    // 2) if exists, update the existing aggregate (by default, non-clobber:
-    //    only update empty fields of details, or promote non-existent details.  Never delete or replace details.)
-    // 3) otherwise, create new aggregate, consisting of all details of contact, return.
+    // Higher scores first; of equal scores, the earliest aggregate
+    return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second);
+}
 
-    QMap<int, QContactManager::Error> errorMap;
-    QList<QContact> saveContactList;
-    QList<QContactRelationship> saveRelationshipList;
+bool ContactWriter::selectMatchCandidates(ContactsDatabase::MatchKeyType keyType, const QStringList &keys, int maxAggregateId, QSet<quint32> *candidateIds)
+{
+    foreach (const QString &key, keys) {
+        if (key.isEmpty())
+            continue;
+
+        m_selectMatchCandidates.bindValue(0, static_cast<int>(keyType));
+        m_selectMatchCandidates.bindValue(1, key);
+        m_selectMatchCandidates.bindValue(2, maxAggregateId);
+        if (!m_selectMatchCandidates.exec()) {
+            qWarning() << "Failed to select aggregation candidates";
+            qWarning() << m_selectMatchCandidates.lastError();
+            return false;
+        }
+        while (m_selectMatchCandidates.next()) {
+            candidateIds->insert(m_selectMatchCandidates.value(0).toUInt());
+        }
+        m_selectMatchCandidates.finish();
+    }
+    return true;
+}
 
+/*
+   Finds the existing aggregate that best matches the contact, if any.  Aggregates
+   in claimedIds have already been matched to another contact from the same sync
+   target, so they are not considered.
+*/
+QContactManager::Error ContactWriter::findMatchingAggregate(const QContact &contact, int maxAggregateId, const QSet<quint32> &claimedIds, quint32 *aggregateId)
+{
     QString firstName;
     QString lastName;
     QString nickname;
@@ -2425,131 +3160,236 @@ QContactManager::Error ContactWriter::updateOrCreateAggregate(QContact *contact,
     QStringList accountUris;
     QString syncTarget;
 
-    quint32 contactId = ContactId::databaseId(*contact);
-    foreach (const QContactName &detail, contact->details<QContactName>()) {
+    quint32 contactId = ContactId::databaseId(contact);
+    foreach (const QContactName &detail, contact.details<QContactName>()) {
         firstName = detail.firstName().toLower();
         lastName = detail.lastName().toLower();
         break;
     }
-    foreach (const QContactNickname &detail, contact->details<QContactNickname>()) {
+    foreach (const QContactNickname &detail, contact.details<QContactNickname>()) {
         nickname = detail.nickname().toLower();
         break;
     }
-    foreach (const QContactPhoneNumber &detail, contact->details<QContactPhoneNumber>()) {
+    foreach (const QContactPhoneNumber &detail, contact.details<QContactPhoneNumber>()) {
         phoneNumbers.append(ContactsEngine::normalizedPhoneNumber(detail.number()));
     }
-    foreach (const QContactEmailAddress &detail, contact->details<QContactEmailAddress>()) {
+    foreach (const QContactEmailAddress &detail, contact.details<QContactEmailAddress>()) {
         emailAddresses.append(detail.emailAddress().toLower());
     }
-    foreach (const QContactOnlineAccount &detail, contact->details<QContactOnlineAccount>()) {
+    foreach (const QContactOnlineAccount &detail, contact.details<QContactOnlineAccount>()) {
         accountUris.append(detail.accountUri().toLower());
     }
-    syncTarget = contact->detail<QContactSyncTarget>().syncTarget();
+    syncTarget = contact.detail<QContactSyncTarget>().syncTarget();
     if (syncTarget.isEmpty()) {
         syncTarget = QLatin1String("local");
     }
 
-    static const QLatin1Char Percent('%');
-
-    // Use a simple match algorithm, looking for exact matches on name fields,
-    // or accumulating points for name matches (including partial matches of first name).
-
-    m_findMatchForContact.bindValue(":id", contactId);
-    m_findMatchForContact.bindValue(":firstName", firstName);
-    m_findMatchForContact.bindValue(":firstPartial", firstName.mid(0, 4).prepend(Percent).append(Percent));
-    m_findMatchForContact.bindValue(":lastName", lastName);
-    m_findMatchForContact.bindValue(":nickname", nickname);
-    m_findMatchForContact.bindValue(":number", phoneNumbers.join(","));
-    m_findMatchForContact.bindValue(":email", emailAddresses.join(","));
-    m_findMatchForContact.bindValue(":uri", accountUris.join(","));
-    m_findMatchForContact.bindValue(":maxAggregateId", maxAggregateId);
-    m_findMatchForContact.bindValue(":syncTarget", syncTarget);
+    // Use a simple match algorithm, looking for matches on name fields (including partial
+    // matches of first name), and accumulating points for other matching details.  Only
+    // the aggregates sharing at least one match key with the contact are considered.
+    static const quint32 MinimumMatchScore = 15;
+
+    QSet<quint32> firstNameMatches;
+    QSet<quint32> lastNameMatches;
+    QSet<quint32> nicknameMatches;
+    QSet<quint32> identifierMatches;
+    if (!selectMatchCandidates(ContactsDatabase::FirstNamePrefixKey, QStringList() << ContactsDatabase::namePrefix(firstName), maxAggregateId, &firstNameMatches)
+            || !selectMatchCandidates(ContactsDatabase::LastNameKey, QStringList() << lastName, maxAggregateId, &lastNameMatches)
+            || !selectMatchCandidates(ContactsDatabase::NicknameKey, QStringList() << nickname, maxAggregateId, &nicknameMatches)
+            || !selectMatchCandidates(ContactsDatabase::PhoneNumberKey, phoneNumbers, maxAggregateId, &identifierMatches)
+            || !selectMatchCandidates(ContactsDatabase::EmailAddressKey, emailAddresses, maxAggregateId, &identifierMatches)
+            || !selectMatchCandidates(ContactsDatabase::AccountUriKey, accountUris, maxAggregateId, &identifierMatches)) {
+        return QContactManager::UnspecifiedError;
+    }
 
-    QContact matchingAggregate;
-    bool found = false;
+    // Matching first and last names scores 20, while matching one name where the other is
+    // absent scores 12.  Any shared phone number, email address or account URI adds 3, and
+    // a matching nickname adds 1.
+    QList<QPair<quint32, quint32> > candidates;
+    foreach (quint32 candidateId, QSet<quint32>(firstNameMatches).unite(lastNameMatches)) {
+        const bool firstNameMatch = firstNameMatches.contains(candidateId);
+        const bool lastNameMatch = lastNameMatches.contains(candidateId);
+
+        quint32 score = (identifierMatches.contains(candidateId) ? 3 : 0) + (nicknameMatches.contains(candidateId) ? 1 : 0);
+        if (firstNameMatch && lastNameMatch) {
+            score += 20;
+        } else if (score + 12 >= MinimumMatchScore) {
+            bool otherNameAbsent = firstNameMatch ? lastName.isEmpty() : firstName.isEmpty();
+            if (!otherNameAbsent) {
+                m_selectMatchNames.bindValue(0, candidateId);
+                if (!m_selectMatchNames.exec()) {
+                    qWarning() << "Failed to select names of aggregation candidate";
+                    qWarning() << m_selectMatchNames.lastError();
+                    return QContactManager::UnspecifiedError;
+                }
+                if (m_selectMatchNames.next()) {
+                    otherNameAbsent = m_selectMatchNames.value(firstNameMatch ? 1 : 0).toString().isEmpty();
+                }
+                m_selectMatchNames.finish();
+            }
+            if (otherNameAbsent)
+                score += 12;
+        }
 
-    if (!m_findMatchForContact.exec()) {
-        qWarning() << m_findMatchForContact.lastError();
-        return QContactManager::UnspecifiedError;
+        if (score >= MinimumMatchScore)
+            candidates.append(qMakePair(score, candidateId));
     }
-    if (m_findMatchForContact.next()) {
-        QContactIdType aggregateId = ContactId::apiId(m_findMatchForContact.value(0).toUInt());
-        quint32 score = m_findMatchForContact.value(1).toUInt();
-        m_findMatchForContact.finish();
 
-        static const quint32 MinimumMatchScore = 15;
-        if (score >= MinimumMatchScore) {
-            QList<QContactIdType> readIds;
-            readIds.append(aggregateId);
+    *aggregateId = 0;
+    if (!candidates.isEmpty()) {
+        qSort(candidates.begin(), candidates.end(), betterMatch);
+
+        // Exclude aggregates the contact must not be aggregated into
+        QSet<quint32> unmatchableIds;
+        m_selectUnmatchableAggregates.bindValue(":id", contactId);
+        if (!m_selectUnmatchableAggregates.exec()) {
+            qWarning() << "Failed to select unmatchable aggregates";
+            qWarning() << m_selectUnmatchableAggregates.lastError();
+            return QContactManager::UnspecifiedError;
+        }
+        while (m_selectUnmatchableAggregates.next()) {
+            unmatchableIds.insert(m_selectUnmatchableAggregates.value(0).toUInt());
+        }
+        m_selectUnmatchableAggregates.finish();
 
-            QContactFetchHint hint;
-            hint.setOptimizationHints(QContactFetchHint::NoRelationships);
+        for (int i = 0; i < candidates.count() && *aggregateId == 0; ++i) {
+            const quint32 candidateId = candidates.at(i).second;
+            if (unmatchableIds.contains(candidateId) || claimedIds.contains(candidateId))
+                continue;
 
-            QList<QContact> readList;
-            QContactManager::Error readError = m_reader->readContacts(QLatin1String("CreateAggregate"), &readList, readIds, hint);
-            if (readError != QContactManager::NoError || readList.size() < 1) {
-                qWarning() << "Failed to read aggregate contact" << aggregateId << "during regenerate";
+            // An aggregate never aggregates two contacts from the same sync target
+            m_checkAggregateSyncTarget.bindValue(0, candidateId);
+            m_checkAggregateSyncTarget.bindValue(1, syncTarget);
+            if (!m_checkAggregateSyncTarget.exec() || !m_checkAggregateSyncTarget.next()) {
+                qWarning() << "Failed to check sync targets of aggregation candidate";
+                qWarning() << m_checkAggregateSyncTarget.lastError();
                 return QContactManager::UnspecifiedError;
             }
+            if (m_checkAggregateSyncTarget.value(0).toInt() == 0)
+                *aggregateId = candidateId;
+            m_checkAggregateSyncTarget.finish();
+        }
+    }
+
+    return QContactManager::NoError;
+}
+
+/*
+   This function is called when new contacts are created.  The
+   aggregate contacts are searched for a match for each contact,
+   and the matching ones updated if they exist; otherwise new
+   aggregates are created.  The contacts are aggregated together,
+   so that each affected aggregate is read and written only once.
+*/
+QContactManager::Error ContactWriter::aggregateContacts(const QList<QContact *> &contacts, const DetailList &definitionMask, int maxAggregateId, bool withinTransaction)
+{
+    // 1) search for matches
+    // 2) update the existing aggregates (by default, non-clobber:
+    //    only update empty fields of details, or promote non-existent details.  Never delete or replace details.)
+    // 3) otherwise, create new aggregates, consisting of all details of the contact.
+
+    // An aggregate never aggregates two contacts from the same sync target, so the
+    // aggregates matched to each sync target are excluded from later matches
+    QHash<QString, QSet<quint32> > claimedIds;
+    QList<quint32> matchingIds;
+    for (int i = 0; i < contacts.count(); ++i) {
+        QString syncTarget = contacts.at(i)->detail<QContactSyncTarget>().syncTarget();
+        if (syncTarget.isEmpty()) {
+            syncTarget = QLatin1String("local");
+        }
+
+        quint32 aggregateId = 0;
+        QContactManager::Error err = findMatchingAggregate(*contacts.at(i), maxAggregateId, claimedIds.value(syncTarget), &aggregateId);
+        if (err != QContactManager::NoError)
+            return err;
+
+        matchingIds.append(aggregateId);
+        if (aggregateId != 0)
+            claimedIds[syncTarget].insert(aggregateId);
+    }
 
-            matchingAggregate = readList.at(0);
-            found = true;
+    // read all of the matching aggregates together
+    QList<QContactIdType> readIds;
+    foreach (quint32 aggregateId, matchingIds) {
+        if (aggregateId != 0 && !readIds.contains(ContactId::apiId(aggregateId)))
+            readIds.append(ContactId::apiId(aggregateId));
+    }
+
+    QHash<quint32, QContact> matchingAggregates;
+    if (!readIds.isEmpty()) {
+        QContactFetchHint hint;
+        hint.setOptimizationHints(QContactFetchHint::NoRelationships);
+
+        QList<QContact> readList;
+        QContactManager::Error readError = m_reader->readContacts(QLatin1String("CreateAggregate"), &readList, readIds, hint);
+        if (readError != QContactManager::NoError || readList.size() < readIds.size()) {
+            qWarning() << "Failed to read" << readIds.size() << "aggregate contacts during aggregation";
+            return QContactManager::UnspecifiedError;
+        }
+        for (int i = 0; i < readIds.count(); ++i) {
+            matchingAggregates.insert(ContactId::databaseId(readIds.at(i)), readList.at(i));
         }
     }
-    m_findMatchForContact.finish();
 
     // whether it's an existing or new contact, we promote details.
+    // Contacts matching the same aggregate are all promoted into it.
     // XXX TODO: promote relationships!
-    promoteDetailsToAggregate(*contact, &matchingAggregate, definitionMask);
-    if (!found) {
-        // need to create an aggregating contact first.
-        QContactSyncTarget cst;
-        cst.setSyncTarget(QLatin1String("aggregate"));
-        matchingAggregate.saveDetail(&cst);
+    QList<QContact> saveContactList;
+    QHash<quint32, int> aggregateIndexes;
+    QList<int> contactAggregateIndexes;
+    for (int i = 0; i < contacts.count(); ++i) {
+        const quint32 aggregateId = matchingIds.at(i);
+        int index = aggregateIndexes.value(aggregateId, -1);
+        if (index == -1) {
+            index = saveContactList.count();
+            if (aggregateId != 0) {
+                saveContactList.append(matchingAggregates.value(aggregateId));
+                aggregateIndexes.insert(aggregateId, index);
+            } else {
+                // need to create an aggregating contact first.
+                QContact aggregate;
+                QContactSyncTarget cst;
+                cst.setSyncTarget(QLatin1String("aggregate"));
+                aggregate.saveDetail(&cst);
+                saveContactList.append(aggregate);
+            }
+        }
+        promoteDetailsToAggregate(*contacts.at(i), &saveContactList[index], definitionMask);
+        contactAggregateIndexes.append(index);
     }
 
     // now save in database.
-    saveContactList.append(matchingAggregate);
-    QContactManager::Error err = save(&saveContactList, DetailList(), 0, &errorMap, withinTransaction, true); // we're updating (or creating) the aggregate
+    QMap<int, QContactManager::Error> errorMap;
+    QContactManager::Error err = save(&saveContactList, DetailList(), 0, &errorMap, withinTransaction, true); // we're updating (or creating) the aggregates
     if (err != QContactManager::NoError) {
-        if (!found) {
-            qWarning() << "Could not create new aggregate contact";
-        } else {
-            qWarning() << "Could not update existing aggregate contact";
-        }
+        qWarning() << "Could not save" << saveContactList.count() << "aggregate contacts";
         return err;
     }
-    matchingAggregate = saveContactList.at(0);
 
-    // add the relationship and save in the database.
+    // add the relationships and save in the database.
     // Note: we DON'T use the existing save(relationshipList, ...) function
     // as it does (expensive) aggregate regeneration which we have already
     // done above (via the detail promotion and aggregate save).
-    // Instead, we simply add the "aggregates" relationship directly.
-    m_insertRelationship.bindValue(":firstId", ContactId::databaseId(matchingAggregate));
-    m_insertRelationship.bindValue(":secondId", ContactId::databaseId(*contact));
-    m_insertRelationship.bindValue(":type", relationshipString(QContactRelationship::Aggregates));
-    if (!m_insertRelationship.exec()) {
-        qWarning() << "error inserting Aggregates relationship: " << m_insertRelationship.lastError();
-        err = QContactManager::UnspecifiedError;
-    }
-
-    if (err != QContactManager::NoError) {
-        // if the aggregation relationship fails, the entire save has failed.
-        qWarning() << "Unable to save aggregation relationship!";
-
-        if (!found) {
-            // clean up the newly created contact.
-            QList<QContactIdType> removeList;
-            removeList.append(ContactId::apiId(matchingAggregate));
-            QContactManager::Error cleanupErr = remove(removeList, &errorMap, withinTransaction);
-            if (cleanupErr != QContactManager::NoError) {
-                qWarning() << "Unable to cleanup newly created aggregate contact!";
-            }
-        }
+    // Instead, we simply add the "aggregates" relationships directly.
+    QVariantList firstIds;
+    QVariantList secondIds;
+    QVariantList types;
+    for (int i = 0; i < contacts.count(); ++i) {
+        firstIds.append(ContactId::databaseId(saveContactList.at(contactAggregateIndexes.at(i))));
+        secondIds.append(ContactId::databaseId(*contacts.at(i)));
+        types.append(relationshipString(QContactRelationship::Aggregates));
+    }
+    m_insertRelationship.bindValue(":firstId", firstIds);
+    m_insertRelationship.bindValue(":secondId", secondIds);
+    m_insertRelationship.bindValue(":type", types);
+    if (!m_insertRelationship.execBatch()) {
+        // if the aggregation relationships fail, the entire save has failed.
+        qWarning() << "error inserting Aggregates relationships: " << m_insertRelationship.lastError();
+        return QContactManager::UnspecifiedError;
     }
+    m_insertRelationship.finish();
 
-    return err;
+    return QContactManager::NoError;
 }
 
 /*
@@ -2560,9 +3400,10 @@ QContactManager::Error ContactWriter::updateOrCreateAggregate(QContact *contact,
 
     If the operation fails, it's not a huge issue - we don't need to rollback
     the database.  It simply means that the existing aggregates may contain
-    some stale data.
+    some stale data.  The error is returned for callers which must record
+    that the regeneration is still outstanding.
 */
-void ContactWriter::regenerateAggregates(const QList<quint32> &aggregateIds, const DetailList &definitionMask, bool withinTransaction)
+QContactManager::Error ContactWriter::regenerateAggregates(const QList<quint32> &aggregateIds, const DetailList &definitionMask, bool withinTransaction)
 {
     static const DetailList identityDetailTypes(getIdentityDetailTypes());
     static const DetailList unpromotedDetailTypes(getUnpromotedDetailTypes());
@@ -2572,46 +3413,89 @@ void ContactWriter::regenerateAggregates(const QList<quint32> &aggregateIds, con
     // 2) build unique details via composition (name / timestamp / gender / favorite - NOT synctarget or guid)
     // 3) append non-unique details
     // In all cases, we "prefer" the 'local' contact's data (if it exists)
+    // The constituents of all aggregates are found and read together, rather than per aggregate.
 
-    QList<QContact> aggregatesToSave;
-    QSet<QContactIdType> aggregatesToSaveIds;
+    QList<quint32> regenerateIds;
+    QSet<quint32> regenerateIdSet;
+    QStringList boundIds;
     foreach (quint32 aggId, aggregateIds) {
-        QContactIdType apiId(ContactId::apiId(aggId));
-        if (aggregatesToSaveIds.contains(apiId)) {
-            continue;
+        if (!regenerateIdSet.contains(aggId)) {
+            regenerateIdSet.insert(aggId);
+            regenerateIds.append(aggId);
+            boundIds.append(QString::number(aggId));
         }
+    }
+    if (regenerateIds.isEmpty())
+        return QContactManager::NoError;
 
-        QList<QContactIdType> readIds;
-        readIds.append(apiId);
+    QHash<quint32, QList<quint32> > constituentIds;
+    QSqlQuery constituentsQuery(m_database);
+    constituentsQuery.setForwardOnly(true);
+    if (!constituentsQuery.exec(QString::fromLatin1(findConstituentsForAggregates).arg(boundIds.join(QLatin1String(","))))) {
+        qWarning() << "Failed to find constituent contacts for aggregates during regenerate";
+        qWarning() << constituentsQuery.lastError();
+        return QContactManager::UnspecifiedError;
+    }
+    while (constituentsQuery.next()) {
+        constituentIds[constituentsQuery.value(0).toUInt()].append(constituentsQuery.value(1).toUInt());
+    }
+    constituentsQuery.finish();
 
-        m_findConstituentsForAggregate.bindValue(":aggregateId", aggId);
-        if (!m_findConstituentsForAggregate.exec()) {
-            qWarning() << "Failed to find constituent contacts for aggregate" << aggId << "during regenerate";
+    QList<QContactIdType> readIds;
+    QSet<quint32> readIdSet;
+    foreach (quint32 aggId, regenerateIds) {
+        const QList<quint32> &constituents(constituentIds[aggId]);
+        if (constituents.isEmpty()) { // only the aggregate?
+            qWarning() << "Existing aggregate" << aggId << "should already have been removed - aborting regenerate";
             continue;
         }
-        while (m_findConstituentsForAggregate.next()) {
-            readIds.append(ContactId::apiId(m_findConstituentsForAggregate.value(0).toUInt()));
-        }
-        m_findConstituentsForAggregate.finish();
 
-        if (readIds.size() == 1) { // only the aggregate?
-            qWarning() << "Existing aggregate" << aggId << "should already have been removed - aborting regenerate";
-            continue;
+        readIds.append(ContactId::apiId(aggId));
+        foreach (quint32 constituentId, constituents) {
+            if (!readIdSet.contains(constituentId)) {
+                readIdSet.insert(constituentId);
+                readIds.append(ContactId::apiId(constituentId));
+            }
         }
+    }
+    if (readIds.isEmpty())
+        return QContactManager::NoError;
 
-        QContactFetchHint hint;
-        hint.setOptimizationHints(QContactFetchHint::NoRelationships);
+    QContactFetchHint hint;
+    hint.setOptimizationHints(QContactFetchHint::NoRelationships);
 
-        QList<QContact> readList;
-        QContactManager::Error readError = m_reader->readContacts(QLatin1String("RegenerateAggregate"), &readList, readIds, hint);
-        if (readError != QContactManager::NoError
-                || readList.size() <= 1
-                || readList.at(0).detail<QContactSyncTarget>().value(QContactSyncTarget::FieldSyncTarget) != QLatin1String("aggregate")) {
+    QList<QContact> readList;
+    QContactManager::Error readError = m_reader->readContacts(QLatin1String("RegenerateAggregate"), &readList, readIds, hint);
+    if (readError != QContactManager::NoError) {
+        qWarning() << "Failed to read constituent contacts for" << regenerateIds.count() << "aggregates during regenerate";
+        return readError;
+    }
+
+    QHash<quint32, const QContact *> contactsById;
+    for (int i = 0; i < readList.count(); ++i) {
+        contactsById.insert(ContactId::databaseId(readList.at(i)), &readList.at(i));
+    }
+
+    QList<QContact> aggregatesToSave;
+    foreach (quint32 aggId, regenerateIds) {
+        const QList<quint32> &aggregateConstituentIds(constituentIds[aggId]);
+        if (aggregateConstituentIds.isEmpty())
+            continue;
+
+        const QContact *aggregate = contactsById.value(aggId);
+        QList<QContact> constituents;
+        foreach (quint32 constituentId, aggregateConstituentIds) {
+            if (const QContact *constituent = contactsById.value(constituentId))
+                constituents.append(*constituent);
+        }
+        if (!aggregate
+                || constituents.isEmpty()
+                || aggregate->detail<QContactSyncTarget>().value(QContactSyncTarget::FieldSyncTarget) != QLatin1String("aggregate")) {
             qWarning() << "Failed to read constituent contacts for aggregate" << aggId << "during regenerate";
             continue;
         }
 
-        QContact originalAggregateContact = readList.at(0);
+        const QContact &originalAggregateContact(*aggregate);
 
         QContact aggregateContact;
         aggregateContact.setId(originalAggregateContact.id());
@@ -2631,8 +3515,8 @@ void ContactWriter::regenerateAggregates(const QList<quint32> &aggregateIds, con
         }
 
         // Step two: search for the "local" contact and promote its details first
-        for (int i = 1; i < readList.size(); ++i) { // start from 1 to skip aggregate
-            QContact curr = readList.at(i);
+        for (int i = 0; i < constituents.size(); ++i) {
+            QContact curr = constituents.at(i);
             if (curr.detail<QContactSyncTarget>().value(QContactSyncTarget::FieldSyncTarget) != QLatin1String("local"))
                 continue;
             QList<QContactDetail> currDetails = curr.details();
@@ -2649,8 +3533,8 @@ void ContactWriter::regenerateAggregates(const QList<quint32> &aggregateIds, con
         }
 
         // Step Three: promote data from details of other related contacts
-        for (int i = 1; i < readList.size(); ++i) { // start from 1 to skip aggregate
-            QContact curr = readList.at(i);
+        for (int i = 0; i < constituents.size(); ++i) {
+            QContact curr = constituents.at(i);
             if (curr.detail<QContactSyncTarget>().value(QContactSyncTarget::FieldSyncTarget) == QLatin1String("local")) {
                 continue; // already promoted the "local" contact's details.
             }
@@ -2661,15 +3545,18 @@ void ContactWriter::regenerateAggregates(const QList<quint32> &aggregateIds, con
 
         // we save the updated aggregates to database all in a batch at the end.
         aggregatesToSave.append(aggregateContact);
-        aggregatesToSaveIds.insert(ContactId::apiId(aggregateContact));
     }
 
+    if (aggregatesToSave.isEmpty())
+        return QContactManager::NoError;
+
     QMap<int, QContactManager::Error> errorMap;
     QContactManager::Error writeError = save(&aggregatesToSave, DetailList(), 0, &errorMap, withinTransaction, true); // we're updating aggregates.
     if (writeError != QContactManager::NoError) {
         qWarning() << "Failed to write updated aggregate contacts during regenerate";
         qWarning() << "definitionMask:" << definitionMask;
     }
+    return writeError;
 }
 
 QContactManager::Error ContactWriter::removeChildlessAggregates(QList<QContactIdType> *removedIds)
@@ -2688,13 +3575,10 @@ QContactManager::Error ContactWriter::removeChildlessAggregates(QList<QContactId
     m_childlessAggregateIds.finish();
 
     if (aggregateIds.size() > 0) {
-        m_removeContact.bindValue(QLatin1String(":contactId"), aggregateIds);
-        if (!m_removeContact.execBatch()) {
+        if (!removeContacts(aggregateIds)) {
             qWarning() << "Failed to remove childless aggregate contacts";
-            qWarning() << m_removeContact.lastError();
             return QContactManager::UnspecifiedError;
         }
-        m_removeContact.finish();
     }
 
     return QContactManager::NoError;
@@ -2732,88 +3616,266 @@ QContactManager::Error ContactWriter::aggregateOrphanedContacts(bool withinTrans
         int maxAggregateId = m_findMaximumContactId.value(0).toInt();
         m_findMaximumContactId.finish();
 
-        QList<QContact>::iterator it = readList.begin(), end = readList.end();
-        for ( ; it != end; ++it) {
-            QContact &orphan(*it);
-            QContactManager::Error error = updateOrCreateAggregate(&orphan, DetailList(), maxAggregateId, withinTransaction);
-            if (error != QContactManager::NoError) {
-                qWarning() << "Failed to create aggregate for orphaned contact:" << ContactId::toString(orphan);
-                return error;
-            }
+        QList<QContact *> orphans;
+        for (int i = 0; i < readList.count(); ++i) {
+            orphans.append(&readList[i]);
+        }
+        QContactManager::Error error = aggregateContacts(orphans, DetailList(), maxAggregateId, withinTransaction);
+        if (error != QContactManager::NoError) {
+            qWarning() << "Failed to create aggregates for" << orphans.count() << "orphaned contacts";
+            return error;
         }
     }
 
     return QContactManager::NoError;
 }
+
+/*
+    Records the aggregates which need to be regenerated, rather than regenerating them
+    within the current transaction.  Repeated deferral of the same aggregate is coalesced
+    into a single entry, which remains until the aggregate has been regenerated.
+*/
+QContactManager::Error ContactWriter::deferAggregates(const QList<quint32> &aggregateIds)
+{
+    QVariantList boundAggregateIds;
+    foreach (quint32 aggregateId, aggregateIds) {
+        boundAggregateIds.append(aggregateId);
+    }
+
+    m_insertDeferredAggregate.bindValue(":contactId", boundAggregateIds);
+    if (!m_insertDeferredAggregate.execBatch()) {
+        qWarning() << "Failed to record deferred aggregates";
+        qWarning() << m_insertDeferredAggregate.lastError();
+        return QContactManager::UnspecifiedError;
+    }
+    m_insertDeferredAggregate.finish();
+
+    m_aggregationDeferred = true;
+    return QContactManager::NoError;
+}
 #endif
 
-static bool updateGlobalPresence(QContact *contact)
+QContactManager::Error ContactWriter::regenerateDeferredAggregates()
 {
-    QContactGlobalPresence globalPresence = contact->detail<QContactGlobalPresence>();
+#ifdef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
+    // Regenerate a small number of aggregates in each transaction, so that writers in
+    // other processes are not held off for long
+    static const int DeferredAggregateBatchSize = 10;
 
-    const QList<QContactPresence> details = contact->details<QContactPresence>();
-    if (details.isEmpty()) {
-        // No presence - remove global presence if present
-        if (!globalPresence.isEmpty()) {
-            contact->removeDetail(&globalPresence);
+    while (true) {
+        if (!beginTransaction()) {
+            qWarning() << "Unable to begin database transaction while regenerating deferred aggregates";
+            return QContactManager::UnspecifiedError;
         }
-        return true;
-    }
 
-    QContactPresence bestPresence;
+        QList<quint32> aggregateIds;
+        QVariantList boundAggregateIds;
+        m_selectDeferredAggregates.bindValue(":limit", DeferredAggregateBatchSize);
+        if (!m_selectDeferredAggregates.exec()) {
+            qWarning() << "Failed to select deferred aggregates";
+            qWarning() << m_selectDeferredAggregates.lastError();
+            rollbackTransaction();
+            return QContactManager::UnspecifiedError;
+        }
+        while (m_selectDeferredAggregates.next()) {
+            const quint32 aggregateId = m_selectDeferredAggregates.value(0).toUInt();
+            aggregateIds.append(aggregateId);
+            boundAggregateIds.append(aggregateId);
+        }
+        m_selectDeferredAggregates.finish();
 
-    foreach (const QContactPresence &detail, details) {
-        if (betterPresence(detail, bestPresence)) {
-            bestPresence = detail;
+        if (aggregateIds.isEmpty()) {
+            rollbackTransaction();
+            return QContactManager::NoError;
         }
-    }
 
-    globalPresence.setPresenceState(bestPresence.presenceState());
-    globalPresence.setTimestamp(bestPresence.timestamp());
-    globalPresence.setNickname(bestPresence.nickname());
-    globalPresence.setCustomMessage(bestPresence.customMessage());
+        // If regeneration fails, the aggregates remain deferred until a later attempt
+        QContactManager::Error regenerateError = regenerateAggregates(aggregateIds, DetailList(), true);
+        if (regenerateError != QContactManager::NoError) {
+            qWarning() << "Failed to regenerate deferred aggregates";
+            rollbackTransaction();
+            return regenerateError;
+        }
 
-    contact->saveDetail(&globalPresence);
-    return true;
+        m_removeDeferredAggregate.bindValue(":contactId", boundAggregateIds);
+        if (!m_removeDeferredAggregate.execBatch()) {
+            qWarning() << "Failed to remove regenerated deferred aggregates";
+            qWarning() << m_removeDeferredAggregate.lastError();
+            rollbackTransaction();
+            return QContactManager::UnspecifiedError;
+        }
+        m_removeDeferredAggregate.finish();
+
+        if (!commitTransaction()) {
+            qWarning() << "Failed to commit regenerated deferred aggregates";
+            return QContactManager::UnspecifiedError;
+        }
+    }
+#else
+    return QContactManager::NoError;
+#endif
 }
 
-static bool updateTimestamp(QContact *contact, bool setCreationTimestamp)
+static bool fingerprintedDetail(const QContactDetail &detail)
 {
-    QContactTimestamp timestamp = contact->detail<QContactTimestamp>();
-    QDateTime createdTime = timestamp.created().toUTC();
-    QDateTime modifiedTime = timestamp.lastModified().toUTC();
-    bool needsSave = false;
-
-    if (!modifiedTime.isValid()) {
-        modifiedTime = QDateTime::currentDateTimeUtc();
-        timestamp.setLastModified(modifiedTime);
-        needsSave = true;
-    }
+    // Details that are derived or updated by the writer do not contribute to the fingerprint
+    const ContactWriter::DetailList::value_type type(detailType(detail));
+    return type != detailType<QContactTimestamp>()
+        && type != detailType<QContactDisplayLabel>()
+        && type != detailType<QContactGlobalPresence>();
+}
 
-    if (setCreationTimestamp && !createdTime.isValid()) {
-        timestamp.setCreated(modifiedTime);
-        needsSave = true;
-    }
+static bool fingerprintInMask(const QString &typeName, const ContactWriter::DetailList &definitionMask)
+{
+    if (definitionMask.isEmpty())
+        return true;
 
-    if (needsSave) {
-        return contact->saveDetail(&timestamp);
+    foreach (const ContactWriter::DetailList::value_type &type, definitionMask) {
+#ifdef USING_QTPIM
+        if (typeName == QLatin1String(detailTypeName(type)))
+#else
+        if (typeName == type)
+#endif
+            return true;
     }
-
-    return true;
+    return false;
 }
 
-QContactManager::Error ContactWriter::create(QContact *contact, const DetailList &definitionMask, int maxAggregateId, bool withinTransaction, bool withinAggregateUpdate)
+// Each detail type present in the contact (and in the mask, if any) has a hash of the values
+// and access constraints of its details, in order; a type absent from the fingerprints has no details.
+static ContactWriter::Fingerprints contactFingerprints(const QContact &contact, const ContactWriter::DetailList &definitionMask)
+{
+    QMap<QString, QList<QContactDetail> > typeDetails;
+    foreach (const QContactDetail &detail, contact.details()) {
+        if (!fingerprintedDetail(detail))
+            continue;
+        if (!definitionMask.isEmpty() && !detailListContains(definitionMask, detail))
+            continue;
+
+        typeDetails[detailTypeName(detail)].append(detail);
+    }
+
+    ContactWriter::Fingerprints fingerprints;
+    QMap<QString, QList<QContactDetail> >::const_iterator it = typeDetails.constBegin(), end = typeDetails.constEnd();
+    for ( ; it != end; ++it) {
+        QByteArray data;
+        {
+            QDataStream stream(&data, QIODevice::WriteOnly);
+            foreach (const QContactDetail &detail, it.value()) {
+                streamDetailValues(stream, detail);
+                stream << static_cast<int>(detail.accessConstraints());
+            }
+        }
+        fingerprints.insert(it.key(), QCryptographicHash::hash(data, QCryptographicHash::Sha1));
+    }
+    return fingerprints;
+}
+
+static bool fingerprintsMatch(const ContactWriter::Fingerprints &stored, const ContactWriter::Fingerprints &fingerprints, const ContactWriter::DetailList &definitionMask)
+{
+    // Without stored fingerprints, the content of the contact is unknown
+    if (stored.isEmpty())
+        return false;
+
+    if (definitionMask.isEmpty())
+        return stored == fingerprints;
+
+    ContactWriter::Fingerprints::const_iterator it = stored.constBegin(), end = stored.constEnd();
+    for ( ; it != end; ++it) {
+        if (fingerprintInMask(it.key(), definitionMask) && fingerprints.value(it.key()) != it.value())
+            return false;
+    }
+    for (it = fingerprints.constBegin(), end = fingerprints.constEnd(); it != end; ++it) {
+        if (!stored.contains(it.key()))
+            return false;
+    }
+    return true;
+}
+
+static void mergeFingerprints(ContactWriter::Fingerprints *stored, const ContactWriter::Fingerprints &fingerprints, const ContactWriter::DetailList &definitionMask)
+{
+    ContactWriter::Fingerprints::iterator it = stored->begin();
+    while (it != stored->end()) {
+        if (fingerprintInMask(it.key(), definitionMask)) {
+            it = stored->erase(it);
+        } else {
+            ++it;
+        }
+    }
+    ContactWriter::Fingerprints::const_iterator cit = fingerprints.constBegin(), end = fingerprints.constEnd();
+    for ( ; cit != end; ++cit) {
+        stored->insert(cit.key(), cit.value());
+    }
+}
+
+static bool updateGlobalPresence(QContact *contact)
+{
+    QContactGlobalPresence globalPresence = contact->detail<QContactGlobalPresence>();
+
+    const QList<QContactPresence> details = contact->details<QContactPresence>();
+    if (details.isEmpty()) {
+        // No presence - remove global presence if present
+        if (!globalPresence.isEmpty()) {
+            contact->removeDetail(&globalPresence);
+        }
+        return true;
+    }
+
+    QContactPresence bestPresence;
+
+    foreach (const QContactPresence &detail, details) {
+        if (betterPresence(detail, bestPresence)) {
+            bestPresence = detail;
+        }
+    }
+
+    globalPresence.setPresenceState(bestPresence.presenceState());
+    globalPresence.setTimestamp(bestPresence.timestamp());
+    globalPresence.setNickname(bestPresence.nickname());
+    globalPresence.setCustomMessage(bestPresence.customMessage());
+
+    contact->saveDetail(&globalPresence);
+    return true;
+}
+
+static bool updateTimestamp(QContact *contact, bool setCreationTimestamp)
+{
+    QContactTimestamp timestamp = contact->detail<QContactTimestamp>();
+    QDateTime createdTime = timestamp.created().toUTC();
+    QDateTime modifiedTime = timestamp.lastModified().toUTC();
+    bool needsSave = false;
+
+    if (!modifiedTime.isValid()) {
+        modifiedTime = QDateTime::currentDateTimeUtc();
+        timestamp.setLastModified(modifiedTime);
+        needsSave = true;
+    }
+
+    if (setCreationTimestamp && !createdTime.isValid()) {
+        timestamp.setCreated(modifiedTime);
+        needsSave = true;
+    }
+
+    if (needsSave) {
+        return contact->saveDetail(&timestamp);
+    }
+
+    return true;
+}
+
+QContactManager::Error ContactWriter::create(QContact *contact, const DetailList &definitionMask)
 {
-#ifndef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
-    Q_UNUSED(withinTransaction)
-    Q_UNUSED(withinAggregateUpdate)
-#endif
     QContactManager::Error writeErr = enforceDetailConstraints(contact);
     if (writeErr != QContactManager::NoError) {
         qWarning() << "Contact failed detail constraints";
         return writeErr;
     }
 
+    // only a contact written in full has fingerprints covering all of its content
+    Fingerprints fingerprints;
+    if (definitionMask.isEmpty())
+        fingerprints = contactFingerprints(*contact, definitionMask);
+
     // update the global presence (display label may be derived from it)
     updateGlobalPresence(contact);
 
@@ -2832,22 +3894,13 @@ QContactManager::Error ContactWriter::create(QContact *contact, const DetailList
     quint32 contactId = m_insertContact.lastInsertId().toUInt();
     m_insertContact.finish();
 
-    writeErr = write(contactId, contact, definitionMask);
+    writeErr = write(contactId, QContact(), contact, definitionMask);
+    if (writeErr == QContactManager::NoError && !fingerprints.isEmpty())
+        writeFingerprints(contactId, fingerprints, &writeErr);
     if (writeErr == QContactManager::NoError) {
         // successfully saved all data.  Update id.
         contact->setId(ContactId::contactId(ContactId::apiId(contactId)));
-
-#ifdef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
-        if (!withinAggregateUpdate) {
-            // and either update the aggregate contact (if it exists) or create a new one (unless it is an aggregate contact).
-            if (contact->detail<QContactSyncTarget>().value(QContactSyncTarget::FieldSyncTarget) != QLatin1String("aggregate")) {
-                writeErr = updateOrCreateAggregate(contact, definitionMask, maxAggregateId, withinTransaction);
-            }
-        }
-#endif
-    }
-
-    if (writeErr != QContactManager::NoError) {
+    } else {
         // error occurred.  Remove the failed entry.
         m_removeContact.bindValue(":contactId", contactId);
         if (!m_removeContact.exec()) {
@@ -2860,13 +3913,353 @@ QContactManager::Error ContactWriter::create(QContact *contact, const DetailList
     return writeErr;
 }
 
-QContactManager::Error ContactWriter::update(QContact *contact, const DetailList &definitionMask, bool *aggregateUpdated, bool withinTransaction, bool withinAggregateUpdate)
+static void stageBoundValues(const QSqlQuery &query, QVector<QVariantList> *columns)
+{
+    const int count = query.boundValues().count();
+    if (columns->isEmpty())
+        columns->resize(count);
+
+    for (int i = 0; i < count; ++i)
+        (*columns)[i].append(query.boundValue(i));
+}
+
+static void bindStagedValues(QSqlQuery &query, const QVector<QVariantList> &columns)
+{
+    for (int i = 0; i < columns.count(); ++i)
+        query.bindValue(i, columns.at(i));
+}
+
+template <typename T> bool ContactWriter::importDetails(
+        const QList<QContact *> &contacts, quint32 firstId, const char *table, QContactManager::Error *error)
+{
+    QSqlQuery *query = 0;
+    QVector<QVariantList> columns;
+    QVariantList contactIds;
+    QVariantList detailUris;
+    QVariantList linkedDetailUris;
+    QVariantList contexts;
+    QVariantList accessConstraints;
+
+    for (int i = 0; i < contacts.count(); ++i) {
+        const quint32 contactId = firstId + i;
+        foreach (const T &detail, contacts.at(i)->details<T>()) {
+            query = &bindDetail(contactId, detail);
+            stageBoundValues(*query, &columns);
+
+            contactIds.append(contactId);
+            detailUris.append(detailValue(detail, QContactDetail::FieldDetailUri));
+            linkedDetailUris.append(detailLinkedUris(detail));
+            contexts.append(detailContexts(detail));
+            accessConstraints.append(static_cast<int>(detail.accessConstraints()));
+        }
+    }
+
+    if (!query)
+        return true;
+
+    bindStagedValues(*query, columns);
+    ++m_detailStatementCount;
+    if (!query->execBatch()) {
+        qWarning() << "Failed to import details for" << detailTypeName<T>();
+        qWarning() << query->lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+
+    const quint32 lastDetailId = query->lastInsertId().toUInt();
+    query->finish();
+    if (!verifyImportedIds(table, "detailId", lastDetailId, contactIds.count(), error))
+        return false;
+
+    QVariantList detailIds;
+    QVariantList detailNames;
+    for (int i = 0; i < contactIds.count(); ++i) {
+        detailIds.append(lastDetailId - contactIds.count() + 1 + i);
+        detailNames.append(QString::fromLatin1(detailTypeName<T>()));
+    }
+
+    m_insertDetail.bindValue(0, contactIds);
+    m_insertDetail.bindValue(1, detailIds);
+    m_insertDetail.bindValue(2, detailNames);
+    m_insertDetail.bindValue(3, detailUris);
+    m_insertDetail.bindValue(4, linkedDetailUris);
+    m_insertDetail.bindValue(5, contexts);
+    m_insertDetail.bindValue(6, accessConstraints);
+    ++m_detailStatementCount;
+    if (!m_insertDetail.execBatch()) {
+        qWarning() << "Failed to import common details for" << detailTypeName<T>();
+        qWarning() << m_insertDetail.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_insertDetail.finish();
+    return true;
+}
+
+bool ContactWriter::indexImportedContacts(quint32 firstId, quint32 lastId, QContactManager::Error *error)
+{
+    if (m_searchIndex) {
+        m_insertSearchIndexRange.bindValue(0, firstId);
+        m_insertSearchIndexRange.bindValue(1, lastId);
+        if (!m_insertSearchIndexRange.exec()) {
+            qWarning() << "Failed to index imported contacts";
+            qWarning() << m_insertSearchIndexRange.lastError();
+            *error = QContactManager::UnspecifiedError;
+            return false;
+        }
+        m_insertSearchIndexRange.finish();
+    }
+
+    QVariantList contactIds;
+    QVariantList fields;
+    QVariantList keypads;
+
+    static const char *nameFields[] = { "displayLabel", "firstName", "middleName", "lastName" };
+
+    m_selectKeypadNamesRange.bindValue(0, firstId);
+    m_selectKeypadNamesRange.bindValue(1, lastId);
+    if (!m_selectKeypadNamesRange.exec()) {
+        qWarning() << "Failed to select imported names for keypad index";
+        qWarning() << m_selectKeypadNamesRange.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    while (m_selectKeypadNamesRange.next()) {
+        for (int i = 0; i < 4; ++i) {
+            const QString keypad(ContactsDatabase::keypadDigits(m_selectKeypadNamesRange.value(i + 1).toString()));
+            if (!keypad.isEmpty()) {
+                contactIds.append(m_selectKeypadNamesRange.value(0));
+                fields.append(QString::fromLatin1(nameFields[i]));
+                keypads.append(keypad);
+            }
+        }
+    }
+    m_selectKeypadNamesRange.finish();
+
+    m_selectKeypadNicknamesRange.bindValue(0, firstId);
+    m_selectKeypadNicknamesRange.bindValue(1, lastId);
+    if (!m_selectKeypadNicknamesRange.exec()) {
+        qWarning() << "Failed to select imported nicknames for keypad index";
+        qWarning() << m_selectKeypadNicknamesRange.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    while (m_selectKeypadNicknamesRange.next()) {
+        const QString keypad(ContactsDatabase::keypadDigits(m_selectKeypadNicknamesRange.value(1).toString()));
+        if (!keypad.isEmpty()) {
+            contactIds.append(m_selectKeypadNicknamesRange.value(0));
+            fields.append(QString::fromLatin1("nickname"));
+            keypads.append(keypad);
+        }
+    }
+    m_selectKeypadNicknamesRange.finish();
+
+    if (contactIds.isEmpty())
+        return true;
+
+    m_insertKeypadIndex.bindValue(0, contactIds);
+    m_insertKeypadIndex.bindValue(1, fields);
+    m_insertKeypadIndex.bindValue(2, keypads);
+    if (!m_insertKeypadIndex.execBatch()) {
+        qWarning() << "Failed to insert keypad index for imported contacts";
+        qWarning() << m_insertKeypadIndex.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_insertKeypadIndex.finish();
+    return true;
+}
+
+QContactManager::Error ContactWriter::importBatch(QList<QContact *> *contacts)
+{
+    QVector<QVariantList> columns;
+    for (int i = 0; i < contacts->count(); ++i) {
+        QContact *contact = contacts->at(i);
+
+        QContactManager::Error error = enforceDetailConstraints(contact);
+        if (error != QContactManager::NoError) {
+            qWarning() << "Contact failed detail constraints";
+            return error;
+        }
+
+        updateGlobalPresence(contact);
+        m_engine.regenerateDisplayLabel(*contact);
+        updateTimestamp(contact, true);
+
+        bindContactDetails(*contact, m_insertContact, DetailList(), false);
+        stageBoundValues(m_insertContact, &columns);
+    }
+
+    bindStagedValues(m_insertContact, columns);
+    if (!m_insertContact.execBatch()) {
+        qWarning() << "Failed to import contacts";
+        qWarning() << m_insertContact.lastError();
+        return QContactManager::UnspecifiedError;
+    }
+
+    const quint32 lastId = m_insertContact.lastInsertId().toUInt();
+    const quint32 firstId = lastId - contacts->count() + 1;
+    m_insertContact.finish();
+
+    QContactManager::Error error = QContactManager::NoError;
+    if (!verifyImportedIds("Contacts", "contactId", lastId, contacts->count(), &error))
+        return error;
+
+    if (!importDetails<QContactAddress>(*contacts, firstId, "Addresses", &error)
+            || !importDetails<QContactAnniversary>(*contacts, firstId, "Anniversaries", &error)
+            || !importDetails<QContactAvatar>(*contacts, firstId, "Avatars", &error)
+            || !importDetails<QContactBirthday>(*contacts, firstId, "Birthdays", &error)
+            || !importDetails<QContactEmailAddress>(*contacts, firstId, "EmailAddresses", &error)
+            || !importDetails<QContactGlobalPresence>(*contacts, firstId, "GlobalPresences", &error)
+            || !importDetails<QContactGuid>(*contacts, firstId, "Guids", &error)
+            || !importDetails<QContactHobby>(*contacts, firstId, "Hobbies", &error)
+            || !importDetails<QContactNickname>(*contacts, firstId, "Nicknames", &error)
+            || !importDetails<QContactNote>(*contacts, firstId, "Notes", &error)
+            || !importDetails<QContactOnlineAccount>(*contacts, firstId, "OnlineAccounts", &error)
+            || !importDetails<QContactOrganization>(*contacts, firstId, "Organizations", &error)
+            || !importDetails<QContactPhoneNumber>(*contacts, firstId, "PhoneNumbers", &error)
+            || !importDetails<QContactPresence>(*contacts, firstId, "Presences", &error)
+            || !importDetails<QContactRingtone>(*contacts, firstId, "Ringtones", &error)
+            || !importDetails<QContactTag>(*contacts, firstId, "Tags", &error)
+            || !importDetails<QContactUrl>(*contacts, firstId, "Urls", &error)
+            || !importDetails<QContactOriginMetadata>(*contacts, firstId, "TpMetadata", &error)
+            || !indexImportedContacts(firstId, lastId, &error)) {
+        return error;
+    }
+
+    for (int i = 0; i < contacts->count(); ++i) {
+        if (!updateMatchKeys(firstId + i, *contacts->at(i), &error))
+            return error;
+    }
+
+    for (int i = 0; i < contacts->count(); ++i) {
+        const QContactIdType contactId(ContactId::apiId(firstId + i));
+        contacts->at(i)->setId(ContactId::contactId(contactId));
+        m_addedIds.insert(contactId);
+    }
+    return QContactManager::NoError;
+}
+
+QContactManager::Error ContactWriter::import(QList<QContact> *contacts, QMap<int, QContactManager::Error> *errorMap)
+{
+    m_unchangedCount = 0;
+    m_detailStatementCount = 0;
+
+    if (contacts->isEmpty())
+        return QContactManager::NoError;
+
+    if (!singleSyncTarget(*contacts)) {
+        qWarning() << "Error: contacts from multiple sync targets specified in single batch import!";
+        return QContactManager::UnspecifiedError;
+    }
+
+    if (!beginTransaction()) {
+        qWarning() << "Unable to begin database transaction while importing contacts";
+        return QContactManager::UnspecifiedError;
+    }
+
+    if (!m_findMaximumContactId.exec() || !m_findMaximumContactId.next()) {
+        qWarning() << "Failed to find max possible aggregate during import:" << m_findMaximumContactId.lastError().text();
+        rollbackTransaction();
+        return QContactManager::UnspecifiedError;
+    }
+    int maxAggregateId = m_findMaximumContactId.value(0).toInt();
+    m_findMaximumContactId.finish();
+
+    // New contacts are written in batches, each with a single statement per table;
+    // contacts that already exist are updated as they would be by save()
+    QContactManager::Error error = QContactManager::NoError;
+    for (int start = 0; start < contacts->count() && error == QContactManager::NoError; start += ImportBatchSize) {
+        const int end = qMin(start + ImportBatchSize, contacts->count());
+
+        QList<QContact *> batch;
+        for (int i = start; i < end; ++i) {
+            QContact &contact = (*contacts)[i];
+            if (ContactId::databaseId(ContactId::apiId(contact)) == 0) {
+                batch.append(&contact);
+                continue;
+            }
+
+            bool aggregateUpdated = false;
+            bool unchanged = false;
+            error = update(&contact, DetailList(), &aggregateUpdated, &unchanged, true, false);
+            if (error != QContactManager::NoError) {
+                qWarning() << "Error updating contact" << ContactId::toString(contact) << ":" << error;
+                if (errorMap)
+                    errorMap->insert(i, error);
+                break;
+            }
+            if (unchanged) {
+                ++m_unchangedCount;
+            } else {
+                m_changedIds.insert(ContactId::apiId(contact));
+            }
+        }
+
+        if (error == QContactManager::NoError && !batch.isEmpty()) {
+            error = importBatch(&batch);
+            if (error != QContactManager::NoError) {
+                qWarning() << "Error importing contacts:" << error;
+                if (errorMap) {
+                    for (int i = start; i < end; ++i)
+                        errorMap->insert(i, error);
+                }
+            }
+        }
+    }
+
+#ifdef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
+    // The imported contacts are aggregated once they have all been written
+    if (error == QContactManager::NoError
+            && contacts->first().detail<QContactSyncTarget>().value(QContactSyncTarget::FieldSyncTarget) != QLatin1String("aggregate")) {
+        QList<QContact *> imported;
+        for (int i = 0; i < contacts->count(); ++i) {
+            QContact &contact = (*contacts)[i];
+            if (m_addedIds.contains(ContactId::apiId(contact)))
+                imported.append(&contact);
+        }
+
+        // Aggregate in batches, so that each affected aggregate is written once per batch
+        for (int start = 0; start < imported.count() && error == QContactManager::NoError; start += ImportBatchSize) {
+            error = aggregateContacts(imported.mid(start, ImportBatchSize), DetailList(), maxAggregateId, true);
+            if (error != QContactManager::NoError)
+                qWarning() << "Error aggregating imported contacts:" << error;
+        }
+    }
+#else
+    Q_UNUSED(maxAggregateId)
+#endif
+
+    if (error != QContactManager::NoError) {
+        // Any contacts we 'added' are not actually added - clear their IDs
+        for (int i = 0; i < contacts->count(); ++i) {
+            QContact &contact = (*contacts)[i];
+            if (m_addedIds.contains(ContactId::apiId(contact))) {
+                contact.setId(QContactId());
+                if (errorMap && !errorMap->contains(i))
+                    errorMap->insert(i, QContactManager::LockedError);
+            }
+        }
+
+        rollbackTransaction();
+        return error;
+    }
+
+    if (!commitTransaction()) {
+        qWarning() << "Failed to commit imported contacts";
+        return QContactManager::UnspecifiedError;
+    }
+    return QContactManager::NoError;
+}
+
+QContactManager::Error ContactWriter::update(QContact *contact, const DetailList &definitionMask, bool *aggregateUpdated, bool *unchanged, bool withinTransaction, bool withinAggregateUpdate)
 {
 #ifndef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
     Q_UNUSED(withinTransaction)
     Q_UNUSED(withinAggregateUpdate)
 #endif
     *aggregateUpdated = false;
+    *unchanged = false;
 
     quint32 contactId = ContactId::databaseId(*contact);
 
@@ -2899,6 +4292,16 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
         return writeError;
     }
 
+    // if the content is identical to that of the previous save, there is nothing to write
+    Fingerprints fingerprints;
+    if (!readFingerprints(contactId, &fingerprints, &writeError))
+        return writeError;
+    const Fingerprints updatedFingerprints(contactFingerprints(*contact, definitionMask));
+    if (fingerprintsMatch(fingerprints, updatedFingerprints, definitionMask)) {
+        *unchanged = true;
+        return QContactManager::NoError;
+    }
+
     // update the modification timestamp
     updateTimestamp(contact, false);
 
@@ -2921,8 +4324,16 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
     // update the display label for this contact
     m_engine.regenerateDisplayLabel(*contact);
 
+    // read the stored details, so that only the changed details need to be written
+    QContact storedContact;
+    writeError = readStoredDetails(contactId, definitionMask, &storedContact);
+    if (writeError != QContactManager::NoError) {
+        qWarning() << "Failed to read stored details for contact" << contactId;
+        return writeError;
+    }
+
     bindContactDetails(*contact, m_updateContact, definitionMask, true);
-    m_updateContact.bindValue(22, contactId);
+    m_updateContact.bindValue(25, contactId);
     if (!m_updateContact.exec()) {
         qWarning() << "Failed to update contact";
         qWarning() << m_updateContact.lastError();
@@ -2930,7 +4341,19 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
     }
     m_updateContact.finish();
 
-    writeError = write(contactId, contact, definitionMask);
+    writeError = write(contactId, storedContact, contact, definitionMask);
+    if (writeError == QContactManager::NoError) {
+        // A partial save can only update fingerprints that already cover the whole contact
+        if (definitionMask.isEmpty() || !fingerprints.isEmpty()) {
+            if (definitionMask.isEmpty()) {
+                fingerprints = updatedFingerprints;
+            } else {
+                mergeFingerprints(&fingerprints, updatedFingerprints, definitionMask);
+            }
+            if (!writeFingerprints(contactId, fingerprints, &writeError))
+                return writeError;
+        }
+    }
 
 #ifdef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
     if (writeError == QContactManager::NoError) {
@@ -2948,8 +4371,16 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
             m_findAggregateForContact.finish();
 
             if (aggregatesOfUpdated.size() > 0) {
-                *aggregateUpdated = true;
-                regenerateAggregates(aggregatesOfUpdated, definitionMask, withinTransaction);
+                if (m_deferAggregation && !withinAggregateUpdate) {
+                    // the aggregates will be regenerated by the background aggregation job
+                    writeError = deferAggregates(aggregatesOfUpdated);
+                } else {
+                    // the statements written for the aggregates are not counted against this contact
+                    const int detailStatementCount = m_detailStatementCount;
+                    *aggregateUpdated = true;
+                    regenerateAggregates(aggregatesOfUpdated, definitionMask, withinTransaction);
+                    m_detailStatementCount = detailStatementCount;
+                }
             }
         }
     }
@@ -2958,32 +4389,267 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
     return writeError;
 }
 
-QContactManager::Error ContactWriter::write(quint32 contactId, QContact *contact, const DetailList &definitionMask)
+QContactManager::Error ContactWriter::readStoredDetails(quint32 contactId, const DetailList &definitionMask, QContact *storedContact)
+{
+    DetailList storedTypes(definitionMask);
+    if (!storedTypes.isEmpty()) {
+        // Presence and GlobalPresence are written together
+        if (detailListContains<QContactPresence>(storedTypes)) {
+            storedTypes.append(detailType<QContactPresence>());
+            storedTypes.append(detailType<QContactGlobalPresence>());
+        }
+    }
+
+    QContactFetchHint hint;
+#ifdef USING_QTPIM
+    hint.setDetailTypesHint(storedTypes);
+#else
+    hint.setDetailDefinitionsHint(storedTypes);
+#endif
+    QContactFetchHint::OptimizationHints optimizationHints(QContactFetchHint::NoRelationships);
+    optimizationHints |= QContactFetchHint__SingleDetailQuery;
+    hint.setOptimizationHints(optimizationHints);
+
+    QList<QContactIdType> readIds;
+    readIds.append(ContactId::apiId(contactId));
+
+    QList<QContact> readList;
+    QContactManager::Error readError = m_reader->readContacts(QLatin1String("UpdateContact"), &readList, readIds, hint);
+    if (readError != QContactManager::NoError)
+        return readError;
+    if (readList.isEmpty())
+        return QContactManager::DoesNotExistError;
+
+    *storedContact = readList.first();
+    return QContactManager::NoError;
+}
+
+bool ContactWriter::readFingerprints(quint32 contactId, Fingerprints *fingerprints, QContactManager::Error *error)
+{
+    m_selectFingerprint.bindValue(0, contactId);
+    if (!m_selectFingerprint.exec()) {
+        qWarning() << "Failed to select contact fingerprint";
+        qWarning() << m_selectFingerprint.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    if (m_selectFingerprint.next()) {
+        QByteArray data(m_selectFingerprint.value(0).toByteArray());
+        QDataStream stream(&data, QIODevice::ReadOnly);
+        stream >> *fingerprints;
+    }
+    m_selectFingerprint.finish();
+    return true;
+}
+
+bool ContactWriter::writeFingerprints(quint32 contactId, const Fingerprints &fingerprints, QContactManager::Error *error)
+{
+    QByteArray data;
+    {
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream << fingerprints;
+    }
+
+    m_insertFingerprint.bindValue(0, contactId);
+    m_insertFingerprint.bindValue(1, data);
+    if (!m_insertFingerprint.exec()) {
+        qWarning() << "Failed to store contact fingerprint";
+        qWarning() << m_insertFingerprint.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_insertFingerprint.finish();
+    return true;
+}
+
+QContactManager::Error ContactWriter::write(quint32 contactId, const QContact &storedContact, QContact *contact, const DetailList &definitionMask)
 {
     QContactManager::Error error = QContactManager::NoError;
-    if (writeDetails<QContactAddress>(contactId, contact, m_removeAddress, definitionMask, &error)
-            && writeDetails<QContactAnniversary>(contactId, contact, m_removeAnniversary, definitionMask, &error)
-            && writeDetails<QContactAvatar>(contactId, contact, m_removeAvatar, definitionMask, &error)
-            && writeDetails<QContactBirthday>(contactId, contact, m_removeBirthday, definitionMask, &error)
-            && writeDetails<QContactEmailAddress>(contactId, contact, m_removeEmailAddress, definitionMask, &error)
-            && writeDetails<QContactGlobalPresence>(contactId, contact, m_removeGlobalPresence, definitionMask, &error)
-            && writeDetails<QContactGuid>(contactId, contact, m_removeGuid, definitionMask, &error)
-            && writeDetails<QContactHobby>(contactId, contact, m_removeHobby, definitionMask, &error)
-            && writeDetails<QContactNickname>(contactId, contact, m_removeNickname, definitionMask, &error)
-            && writeDetails<QContactNote>(contactId, contact, m_removeNote, definitionMask, &error)
-            && writeDetails<QContactOnlineAccount>(contactId, contact, m_removeOnlineAccount, definitionMask, &error)
-            && writeDetails<QContactOrganization>(contactId, contact, m_removeOrganization, definitionMask, &error)
-            && writeDetails<QContactPhoneNumber>(contactId, contact, m_removePhoneNumber, definitionMask, &error)
-            && writeDetails<QContactPresence>(contactId, contact, m_removePresence, definitionMask, &error)
-            && writeDetails<QContactRingtone>(contactId, contact, m_removeRingtone, definitionMask, &error)
-            && writeDetails<QContactTag>(contactId, contact, m_removeTag, definitionMask, &error)
-            && writeDetails<QContactUrl>(contactId, contact, m_removeUrl, definitionMask, &error)
-            && writeDetails<QContactOriginMetadata>(contactId, contact, m_removeOriginMetadata, definitionMask, &error)) {
+    if (writeDetails<QContactAddress>(contactId, storedContact, contact, m_removeAddress, "Addresses", definitionMask, &error)
+            && writeDetails<QContactAnniversary>(contactId, storedContact, contact, m_removeAnniversary, "Anniversaries", definitionMask, &error)
+            && writeDetails<QContactAvatar>(contactId, storedContact, contact, m_removeAvatar, "Avatars", definitionMask, &error)
+            && writeDetails<QContactBirthday>(contactId, storedContact, contact, m_removeBirthday, "Birthdays", definitionMask, &error)
+            && writeDetails<QContactEmailAddress>(contactId, storedContact, contact, m_removeEmailAddress, "EmailAddresses", definitionMask, &error)
+            && writeDetails<QContactGlobalPresence>(contactId, storedContact, contact, m_removeGlobalPresence, "GlobalPresences", definitionMask, &error)
+            && writeDetails<QContactGuid>(contactId, storedContact, contact, m_removeGuid, "Guids", definitionMask, &error)
+            && writeDetails<QContactHobby>(contactId, storedContact, contact, m_removeHobby, "Hobbies", definitionMask, &error)
+            && writeDetails<QContactNickname>(contactId, storedContact, contact, m_removeNickname, "Nicknames", definitionMask, &error)
+            && writeDetails<QContactNote>(contactId, storedContact, contact, m_removeNote, "Notes", definitionMask, &error)
+            && writeDetails<QContactOnlineAccount>(contactId, storedContact, contact, m_removeOnlineAccount, "OnlineAccounts", definitionMask, &error)
+            && writeDetails<QContactOrganization>(contactId, storedContact, contact, m_removeOrganization, "Organizations", definitionMask, &error)
+            && writeDetails<QContactPhoneNumber>(contactId, storedContact, contact, m_removePhoneNumber, "PhoneNumbers", definitionMask, &error)
+            && writeDetails<QContactPresence>(contactId, storedContact, contact, m_removePresence, "Presences", definitionMask, &error)
+            && writeDetails<QContactRingtone>(contactId, storedContact, contact, m_removeRingtone, "Ringtones", definitionMask, &error)
+            && writeDetails<QContactTag>(contactId, storedContact, contact, m_removeTag, "Tags", definitionMask, &error)
+            && writeDetails<QContactUrl>(contactId, storedContact, contact, m_removeUrl, "Urls", definitionMask, &error)
+            && writeDetails<QContactOriginMetadata>(contactId, storedContact, contact, m_removeOriginMetadata, "TpMetadata", definitionMask, &error)
+            && updateSearchIndex(contactId, &error)
+            && updateKeypadIndex(contactId, &error)
+            && updateMatchKeys(contactId, *contact, &error)) {
         return QContactManager::NoError;
     }
     return error;
 }
 
+bool ContactWriter::insertKeypadIndex(quint32 contactId, const char *field, const QString &value, QContactManager::Error *error)
+{
+    const QString keypad(ContactsDatabase::keypadDigits(value));
+    if (keypad.isEmpty())
+        return true;
+
+    m_insertKeypadIndex.bindValue(0, contactId);
+    m_insertKeypadIndex.bindValue(1, QString::fromLatin1(field));
+    m_insertKeypadIndex.bindValue(2, keypad);
+    if (!m_insertKeypadIndex.exec()) {
+        qWarning() << "Failed to insert keypad index for contact" << contactId;
+        qWarning() << m_insertKeypadIndex.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_insertKeypadIndex.finish();
+    return true;
+}
+
+bool ContactWriter::updateKeypadIndex(quint32 contactId, QContactManager::Error *error)
+{
+    // As for the search index, the encodings are rebuilt from the stored contact
+    m_removeKeypadIndex.bindValue(0, contactId);
+    if (!m_removeKeypadIndex.exec()) {
+        qWarning() << "Failed to remove keypad index for contact" << contactId;
+        qWarning() << m_removeKeypadIndex.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_removeKeypadIndex.finish();
+
+    QStringList names;
+    m_selectKeypadNames.bindValue(0, contactId);
+    if (!m_selectKeypadNames.exec()) {
+        qWarning() << "Failed to select names for keypad index of contact" << contactId;
+        qWarning() << m_selectKeypadNames.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    if (m_selectKeypadNames.next()) {
+        for (int i = 0; i < 4; ++i)
+            names.append(m_selectKeypadNames.value(i).toString());
+    }
+    m_selectKeypadNames.finish();
+
+    QStringList nicknames;
+    m_selectKeypadNicknames.bindValue(0, contactId);
+    if (!m_selectKeypadNicknames.exec()) {
+        qWarning() << "Failed to select nicknames for keypad index of contact" << contactId;
+        qWarning() << m_selectKeypadNicknames.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    while (m_selectKeypadNicknames.next()) {
+        nicknames.append(m_selectKeypadNicknames.value(0).toString());
+    }
+    m_selectKeypadNicknames.finish();
+
+    static const char *nameFields[] = { "displayLabel", "firstName", "middleName", "lastName" };
+    for (int i = 0; i < names.count(); ++i) {
+        if (!insertKeypadIndex(contactId, nameFields[i], names.at(i), error))
+            return false;
+    }
+    foreach (const QString &nickname, nicknames) {
+        if (!insertKeypadIndex(contactId, "nickname", nickname, error))
+            return false;
+    }
+    return true;
+}
+
+bool ContactWriter::updateMatchKeys(quint32 contactId, const QContact &contact, QContactManager::Error *error)
+{
+    // Only aggregates are candidates for matching; their keys are rebuilt from the stored contact
+    if (contact.detail<QContactSyncTarget>().syncTarget() != QLatin1String("aggregate"))
+        return true;
+
+    m_removeMatchKeys.bindValue(0, contactId);
+    if (!m_removeMatchKeys.exec()) {
+        qWarning() << "Failed to remove match keys for contact" << contactId;
+        qWarning() << m_removeMatchKeys.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_removeMatchKeys.finish();
+
+    m_insertMatchKeys.bindValue(":contactId", contactId);
+    if (!m_insertMatchKeys.exec()) {
+        qWarning() << "Failed to insert match keys for contact" << contactId;
+        qWarning() << m_insertMatchKeys.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_insertMatchKeys.finish();
+
+    QString firstName;
+    m_selectMatchNames.bindValue(0, contactId);
+    if (!m_selectMatchNames.exec()) {
+        qWarning() << "Failed to select names for match keys of contact" << contactId;
+        qWarning() << m_selectMatchNames.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    if (m_selectMatchNames.next()) {
+        firstName = m_selectMatchNames.value(0).toString();
+    }
+    m_selectMatchNames.finish();
+
+    const QStringList prefixes(ContactsDatabase::namePrefixes(firstName));
+    if (prefixes.isEmpty())
+        return true;
+
+    QVariantList contactIds;
+    QVariantList keyTypes;
+    QVariantList keys;
+    foreach (const QString &prefix, prefixes) {
+        contactIds.append(contactId);
+        keyTypes.append(static_cast<int>(ContactsDatabase::FirstNamePrefixKey));
+        keys.append(prefix);
+    }
+    m_insertMatchKey.bindValue(0, contactIds);
+    m_insertMatchKey.bindValue(1, keyTypes);
+    m_insertMatchKey.bindValue(2, keys);
+    if (!m_insertMatchKey.execBatch()) {
+        qWarning() << "Failed to insert name match keys for contact" << contactId;
+        qWarning() << m_insertMatchKey.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_insertMatchKey.finish();
+    return true;
+}
+
+bool ContactWriter::updateSearchIndex(quint32 contactId, QContactManager::Error *error)
+{
+    if (!m_searchIndex)
+        return true;
+
+    // The index row is rebuilt from the stored contact, since the detail definition
+    // mask may have preserved values not present in the saved contact
+    m_removeSearchIndex.bindValue(0, contactId);
+    if (!m_removeSearchIndex.exec()) {
+        qWarning() << "Failed to remove search index for contact" << contactId;
+        qWarning() << m_removeSearchIndex.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_removeSearchIndex.finish();
+
+    m_insertSearchIndex.bindValue(0, contactId);
+    if (!m_insertSearchIndex.exec()) {
+        qWarning() << "Failed to update search index for contact" << contactId;
+        qWarning() << m_insertSearchIndex.lastError();
+        *error = QContactManager::UnspecifiedError;
+        return false;
+    }
+    m_insertSearchIndex.finish();
+    return true;
+}
+
 void ContactWriter::bindContactDetails(const QContact &contact, QSqlQuery &query, const DetailList &definitionMask, bool update)
 {
 #ifdef USING_QTPIM
@@ -3075,6 +4741,15 @@ void ContactWriter::bindContactDetails(const QContact &contact, QSqlQuery &query
     } else {
         query.bindValue(17, value);
     }
+
+    const int sortKeyIndex = update ? 22 : 18;
+#ifdef USING_QTPIM
+    query.bindValue(sortKeyIndex, ContactsDatabase::sortKey(label.label()));
+#else
+    query.bindValue(sortKeyIndex, ContactsDatabase::sortKey(contact.displayLabel()));
+#endif
+    query.bindValue(sortKeyIndex + 1, ContactsDatabase::sortKey(name.value<QString>(QContactName::FieldFirstName)));
+    query.bindValue(sortKeyIndex + 2, ContactsDatabase::sortKey(name.value<QString>(QContactName::FieldLastName)));
 }
 
 QSqlQuery &ContactWriter::bindDetail(quint32 contactId, const QContactAddress &detail)
@@ -3225,6 +4900,7 @@ QSqlQuery &ContactWriter::bindDetail(quint32 contactId, const QContactPhoneNumbe
     m_insertPhoneNumber.bindValue(2, detailValue(detail, T::FieldSubTypes));
 #endif
     m_insertPhoneNumber.bindValue(3, QVariant(ContactsEngine::normalizedPhoneNumber(detail.number())));
+    m_insertPhoneNumber.bindValue(4, QVariant(ContactsDatabase::reversedPhoneNumber(detail.number())));
     return m_insertPhoneNumber;
 }
 
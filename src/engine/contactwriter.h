@@ -57,6 +57,7 @@
 #include <QContactUrl>
 #include <QContactManager>
 
+#include <QHash>
 #include <QSet>
 #include <QSqlQuery>
 
@@ -74,6 +75,9 @@ public:
     typedef QStringList DetailList;
 #endif
 
+    // A hash of the content of each detail type of a contact, keyed by type name
+    typedef QMap<QString, QByteArray> Fingerprints;
+
     ContactWriter(const ContactsEngine &engine, const QSqlDatabase &database, ContactReader *reader);
     ~ContactWriter();
 
@@ -88,6 +92,10 @@ public:
                                   QMap<int, QContactManager::Error> *errorMap,
                                   bool withinTransaction);
 
+    // Saves a large number of contacts in a single transaction, writing new contacts
+    // in batches and aggregating them once all have been written
+    QContactManager::Error import(QList<QContact> *contacts, QMap<int, QContactManager::Error> *errorMap);
+
     QContactManager::Error setIdentity(ContactsDatabase::Identity identity, QContactIdType contactId);
 
     QContactManager::Error save(
@@ -99,35 +107,83 @@ public:
             QMap<int, QContactManager::Error> *errorMap,
             bool withinTransaction);
 
+    // The number of detail table statements executed for the contacts of the most recent save,
+    // not including those executed to regenerate their aggregates
+    int detailStatementCount() const;
+
+    // The number of contacts not written by the most recent save, because their content was
+    // identical to that stored by their previous save
+    int unchangedCount() const;
+
+    // Returns true if aggregate regeneration has been deferred since the last call
+    bool takeDeferredAggregation();
+
+    // Regenerates the aggregates whose regeneration was deferred, in a series of short transactions
+    QContactManager::Error regenerateDeferredAggregates();
+
+    // Between these calls, writes are committed together in a single transaction; the transaction
+    // of each write is reduced to a savepoint, so that a failed write is rolled back alone.
+    // Change notifications are emitted for the whole group when it is committed.
+    bool beginTransactionGroup();
+    bool commitTransactionGroup();
+
 private:
     bool beginTransaction();
     bool commitTransaction();
     void rollbackTransaction();
 
-    QContactManager::Error create(QContact *contact, const DetailList &definitionMask, int maxAggregateId, bool withinTransaction, bool withinAggregateUpdate);
-    QContactManager::Error update(QContact *contact, const DetailList &definitionMask, bool *aggregateUpdated, bool withinTransaction, bool withinAggregateUpdate);
-    QContactManager::Error write(quint32 contactId, QContact *contact, const DetailList &definitionMask);
+    QContactManager::Error create(QContact *contact, const DetailList &definitionMask);
+    QContactManager::Error update(QContact *contact, const DetailList &definitionMask, bool *aggregateUpdated, bool *unchanged, bool withinTransaction, bool withinAggregateUpdate);
+    QContactManager::Error importBatch(QList<QContact *> *contacts);
+    template <typename T> bool importDetails(
+            const QList<QContact *> &contacts, quint32 firstId, const char *table, QContactManager::Error *error);
+    bool indexImportedContacts(quint32 firstId, quint32 lastId, QContactManager::Error *error);
+    bool verifyImportedIds(const char *table, const char *column, quint32 lastId, int count, QContactManager::Error *error);
+
+    bool removeContacts(const QVariantList &contactIds);
+    bool selectExistingContactIds(const QVariantList &contactIds, QSet<quint32> *existingIds, QContactManager::Error *error);
+    bool readFingerprints(quint32 contactId, Fingerprints *fingerprints, QContactManager::Error *error);
+    bool writeFingerprints(quint32 contactId, const Fingerprints &fingerprints, QContactManager::Error *error);
+    QContactManager::Error readStoredDetails(quint32 contactId, const DetailList &definitionMask, QContact *storedContact);
+    QContactManager::Error write(quint32 contactId, const QContact &storedContact, QContact *contact, const DetailList &definitionMask);
+    bool updateSearchIndex(quint32 contactId, QContactManager::Error *error);
+    bool updateKeypadIndex(quint32 contactId, QContactManager::Error *error);
+    bool insertKeypadIndex(quint32 contactId, const char *field, const QString &value, QContactManager::Error *error);
+    bool updateMatchKeys(quint32 contactId, const QContact &contact, QContactManager::Error *error);
 
     QContactManager::Error saveRelationships(const QList<QContactRelationship> &relationships, QMap<int, QContactManager::Error> *errorMap);
     QContactManager::Error removeRelationships(const QList<QContactRelationship> &relationships, QMap<int, QContactManager::Error> *errorMap);
 
 #ifdef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
-    QContactManager::Error updateOrCreateAggregate(QContact *contact, const DetailList &definitionMask, int maxAggregateId, bool withinTransaction);
+    bool selectMatchCandidates(ContactsDatabase::MatchKeyType keyType, const QStringList &keys, int maxAggregateId, QSet<quint32> *candidateIds);
+    QContactManager::Error findMatchingAggregate(const QContact &contact, int maxAggregateId, const QSet<quint32> &claimedIds, quint32 *aggregateId);
+    QContactManager::Error aggregateContacts(const QList<QContact *> &contacts, const DetailList &definitionMask, int maxAggregateId, bool withinTransaction);
     QContactManager::Error updateLocalAndAggregate(QContact *contact, const DetailList &definitionMask, bool withinTransaction);
-    void regenerateAggregates(const QList<quint32> &aggregateIds, const DetailList &definitionMask, bool withinTransaction);
+    QContactManager::Error regenerateAggregates(const QList<quint32> &aggregateIds, const DetailList &definitionMask, bool withinTransaction);
     QContactManager::Error removeChildlessAggregates(QList<QContactIdType> *realRemoveIds);
     QContactManager::Error aggregateOrphanedContacts(bool withinTransaction);
+    QContactManager::Error deferAggregates(const QList<quint32> &aggregateIds);
 #endif
 
     void bindContactDetails(const QContact &contact, QSqlQuery &query, const DetailList &definitionMask, bool update);
 
     template <typename T> bool writeDetails(
             quint32 contactId,
+            const QContact &storedContact,
             QContact *contact,
             QSqlQuery &removeQuery,
+            const char *table,
             const DetailList &definitionMask,
             QContactManager::Error *error);
 
+    QSqlQuery &detailTableQuery(QHash<QString, QSqlQuery> *queries, const char *statement, const char *table);
+    bool selectDetailIds(quint32 contactId, const char *table, QVariantList *detailIds, QContactManager::Error *error);
+    template <typename T> bool removeDetailRows(
+                const QVariantList &detailIds, const char *table, QContactManager::Error *error);
+    QSqlQuery &updateDetailQuery(const QSqlQuery &insertQuery, const char *table);
+    template <typename T> bool updateDetailRows(
+                quint32 contactId, const QVariantList &detailIds, const QList<T> &details, const char *table, QContactManager::Error *error);
+
     template <typename T> bool writeCommonDetails(
                 quint32 contactId, const QVariant &detailId, const T &detail, QContactManager::Error *error);
     template <typename T> bool removeCommonDetails(
@@ -159,16 +215,26 @@ private:
     QSqlQuery m_findLocalForAggregate;
     QSqlQuery m_findAggregateForContact;
     QSqlQuery m_findMaximumContactId;
-    QSqlQuery m_findMatchForContact;
+    QSqlQuery m_selectMatchCandidates;
+    QSqlQuery m_selectMatchNames;
+    QSqlQuery m_selectUnmatchableAggregates;
+    QSqlQuery m_checkAggregateSyncTarget;
     QSqlQuery m_selectAggregateContactIds;
     QSqlQuery m_childlessAggregateIds;
     QSqlQuery m_orphanContactIds;
     QSqlQuery m_checkContactExists;
     QSqlQuery m_existingContactIds;
+    QSqlQuery m_insertStagedContactId;
+    QSqlQuery m_selectStagedExistingContactIds;
+    QSqlQuery m_clearStagedContactIds;
     QSqlQuery m_selfContactId;
     QSqlQuery m_insertContact;
     QSqlQuery m_updateContact;
     QSqlQuery m_removeContact;
+    QSqlQuery m_insertBulkRemoval;
+    QSqlQuery m_advanceChangeSequence;
+    QSqlQuery m_recordPrunedSequence;
+    QSqlQuery m_pruneTombstones;
     QSqlQuery m_existingRelationships;
     QSqlQuery m_insertRelationship;
     QSqlQuery m_removeRelationship;
@@ -211,12 +277,46 @@ private:
     QSqlQuery m_removeUrl;
     QSqlQuery m_removeOriginMetadata;
     QSqlQuery m_removeDetail;
+    QSqlQuery m_removeDetailRow;
+    QHash<QString, QSqlQuery> m_selectDetailIds;
+    QHash<QString, QSqlQuery> m_removeDetailIds;
+    QHash<QString, QSqlQuery> m_updateDetailRows;
+    QHash<QString, QSqlQuery> m_countIdRanges;
     QSqlQuery m_removeIdentity;
+    QSqlQuery m_selectKeypadNames;
+    QSqlQuery m_selectKeypadNicknames;
+    QSqlQuery m_insertKeypadIndex;
+    QSqlQuery m_removeKeypadIndex;
+    QSqlQuery m_selectKeypadNamesRange;
+    QSqlQuery m_selectKeypadNicknamesRange;
+    QSqlQuery m_removeSearchIndex;
+    QSqlQuery m_insertSearchIndex;
+    QSqlQuery m_insertSearchIndexRange;
+    QSqlQuery m_insertMatchKeys;
+    QSqlQuery m_insertMatchKey;
+    QSqlQuery m_removeMatchKeys;
+    QSqlQuery m_selectFingerprint;
+    QSqlQuery m_insertFingerprint;
+    QSqlQuery m_insertDeferredAggregate;
+    QSqlQuery m_selectDeferredAggregates;
+    QSqlQuery m_removeDeferredAggregate;
     ContactReader *m_reader;
+    bool m_searchIndex;
+    bool m_deferAggregation;
+    bool m_aggregationDeferred;
+    bool m_transactionGroup;
+    int m_detailStatementCount;
+    int m_unchangedCount;
 
     QSet<QContactIdType> m_addedIds;
     QSet<QContactIdType> m_removedIds;
     QSet<QContactIdType> m_changedIds;
+
+    // The state to restore when rolling back to the savepoint of a write within a group
+    bool m_savepointAggregationDeferred;
+    QSet<QContactIdType> m_savepointAddedIds;
+    QSet<QContactIdType> m_savepointRemovedIds;
+    QSet<QContactIdType> m_savepointChangedIds;
 };
 
 
@@ -6,6 +6,11 @@ TARGET = qtcontacts_sqlite
 
 QT += sql dbus
 
+# sqlite3 is used directly only to abort reads in progress; the QSQLITE driver must use the
+# same (system) library, which is verified at runtime before the interrupt is installed
+CONFIG += link_pkgconfig
+PKGCONFIG += sqlite3
+
 CONFIG += plugin hide_symbols
 PLUGIN_TYPE=contacts
 
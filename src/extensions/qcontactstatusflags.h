@@ -65,6 +65,7 @@ public:
         HasEmailAddress = (1 << 1),
         HasOnlineAccount = (1 << 2),
         IsOnline = (1 << 3),
+        IsPendingAggregation = (1 << 4)
     };
     Q_DECLARE_FLAGS(Flags, Flag)
 
@@ -35,6 +35,7 @@
 #include "qtcontacts-extensions-config.h"
 
 #include <QContactDetail>
+#include <QContactFetchHint>
 #include <QContactId>
 
 #ifdef USING_QTPIM
@@ -96,6 +97,73 @@ Q_DECLARE_LATIN1_CONSTANT(QContactPhoneNumber__FieldNormalizedNumber, "Normalize
 Q_DECLARE_LATIN1_CONSTANT(QContactAvatar__FieldAvatarMetadata, "AvatarMetadata") = { "AvatarMetadata" };
 #endif
 
+// In QContactFetchHint, we support an optimization hint requesting that all detail
+// tables be read in a single combined query, rather than one query per table
+static const QContactFetchHint::OptimizationHint QContactFetchHint__SingleDetailQuery = static_cast<QContactFetchHint::OptimizationHint>(0x100);
+
+// In QContactFetchRequest and QContactIdFetchRequest, we support paged fetches using dynamic properties.
+// The page size is the fetch hint's maxCountHint, or the PageSize property for an id fetch.  When a
+// full page is fetched, the finished request's NextContinuationToken property is set; setting that
+// value as the ContinuationToken property of a request with the same filter and sorting fetches
+// the following page.
+static const char * const QContactAbstractRequest__ContinuationToken = "ContinuationToken";
+static const char * const QContactAbstractRequest__NextContinuationToken = "NextContinuationToken";
+static const char * const QContactAbstractRequest__PageSize = "PageSize";
+
+// In QContactIdFetchRequest, setting the ChangesToken property reports the contacts changed since
+// that token, instead of those matching the filter; an empty token reports every contact as added.
+// Setting the ChangesSyncTarget property restricts the report to contacts of that sync target.  When
+// the request finishes, its ids are those of the added and changed contacts, the AddedIds, ChangedIds
+// and RemovedIds properties hold each list separately, and the NextChangesToken property holds the
+// token for the next request.  Removals are only retained for a limited period (30 days); a token
+// older than the removals retained fails with DoesNotExistError, and a full report must be requested.
+static const char * const QContactIdFetchRequest__ChangesToken = "ChangesToken";
+static const char * const QContactIdFetchRequest__ChangesSyncTarget = "ChangesSyncTarget";
+static const char * const QContactIdFetchRequest__NextChangesToken = "NextChangesToken";
+static const char * const QContactIdFetchRequest__AddedIds = "AddedIds";
+static const char * const QContactIdFetchRequest__ChangedIds = "ChangedIds";
+static const char * const QContactIdFetchRequest__RemovedIds = "RemovedIds";
+
+// Setting the BulkImport property of a QContactSaveRequest to true saves the contacts in
+// import mode, which is much faster for large numbers of new contacts.  The definition
+// mask is not supported in import mode.
+static const char * const QContactSaveRequest__BulkImport = "BulkImport";
+
+// When a QContactSaveRequest finishes, its UnchangedCount property holds the number of contacts
+// that were not written because their content was identical to that of their previous save.
+// No change notification is emitted for those contacts.
+static const char * const QContactSaveRequest__UnchangedCount = "UnchangedCount";
+
+// When a QContactSaveRequest finishes, its DetailStatementCount property holds the number of detail
+// table statements executed to write its contacts, not including those for their aggregates.
+static const char * const QContactSaveRequest__DetailStatementCount = "DetailStatementCount";
+
+// Asynchronous requests are scheduled in lanes selected by the Priority property, which may be set
+// to one of the priority values below; requests without the property are in the normal lane.  A
+// waiting request is started before any request in a lower lane.  Setting the Deadline property to
+// a number of milliseconds causes the request to be started ahead of all others once it has waited
+// that long.  Only fetch requests are reordered: save and remove requests are started in the order
+// they were made, and no request is started ahead of an earlier save or remove request.  When a
+// request finishes, its QueueWait property holds the milliseconds it waited.
+static const char * const QContactAbstractRequest__Priority = "Priority";
+static const char * const QContactAbstractRequest__Deadline = "Deadline";
+static const char * const QContactAbstractRequest__QueueWait = "QueueWait";
+static const int QContactAbstractRequest__BackgroundPriority = 0;
+static const int QContactAbstractRequest__NormalPriority = 1;
+static const int QContactAbstractRequest__InteractivePriority = 2;
+
+// When a request finishes, its CachedQueryHits and CachedQueryMisses properties hold the number of
+// cached selection statements which were reused or had to be prepared, counted over the lifetime
+// of the database connection which executed the request.
+static const char * const QContactAbstractRequest__CachedQueryHits = "CachedQueryHits";
+static const char * const QContactAbstractRequest__CachedQueryMisses = "CachedQueryMisses";
+
+// Constructing a QContactManager with the deferAggregation parameter set to "true" commits changes
+// to constituent contacts without regenerating the aggregates affected by them; those aggregates are
+// regenerated by a background job instead.  Until then, their QContactStatusFlags detail has the
+// IsPendingAggregation flag set.
+static const char * const QContactManager__DeferAggregation = "deferAggregation";
+
 #ifdef USING_QTPIM
 QT_END_NAMESPACE_CONTACTS
 #else
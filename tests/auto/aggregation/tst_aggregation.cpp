@@ -104,6 +104,8 @@ private slots:
 
     void batchSemantics();
 
+    void deferredAggregation();
+
     void customSemantics();
 
     void changeLogFiltering();
@@ -2684,6 +2686,103 @@ void tst_Aggregation::batchSemantics()
     allContacts = m_cm->contacts(allSyncTargets);
     newContactsCount = allContacts.size() - allContactsCount;
     QCOMPARE(newContactsCount, 10); // 5 local, 5 aggregate - d and e should not have been aggregated into one.
+
+    // A batch whose contacts match different existing aggregates is aggregated into each of them
+    QContact f, g;
+    QContactName fname, gname;
+    QContactSyncTarget fst, gst;
+    fname.setFirstName("f");
+    fname.setLastName("batch");
+    gname.setFirstName("g");
+    gname.setLastName("batch");
+    fst.setSyncTarget("local");
+    gst.setSyncTarget("local");
+    f.saveDetail(&fname);
+    f.saveDetail(&fst);
+    g.saveDetail(&gname);
+    g.saveDetail(&gst);
+
+    saveList.clear();
+    saveList << f << g;
+    QVERIFY(m_cm->saveContacts(&saveList));
+
+    allContacts = m_cm->contacts(allSyncTargets);
+    newContactsCount = allContacts.size() - allContactsCount;
+    QCOMPARE(newContactsCount, 14); // 7 local, 7 aggregate
+
+    QContact fsync, gsync;
+    fst.setSyncTarget("batch-sync");
+    gst.setSyncTarget("batch-sync");
+    fsync.saveDetail(&fname);
+    fsync.saveDetail(&fst);
+    gsync.saveDetail(&gname);
+    gsync.saveDetail(&gst);
+
+    saveList.clear();
+    saveList << fsync << gsync;
+    QVERIFY(m_cm->saveContacts(&saveList));
+
+    allContacts = m_cm->contacts(allSyncTargets);
+    newContactsCount = allContacts.size() - allContactsCount;
+    QCOMPARE(newContactsCount, 16); // 9 constituents, 7 aggregate - no new aggregates were required.
+}
+
+void tst_Aggregation::deferredAggregation()
+{
+    // a manager which defers aggregation commits changes to constituent contacts
+    // without regenerating their aggregate, which is regenerated in the background
+    QMap<QString, QString> parameters;
+    parameters.insert(QString::fromLatin1(QContactManager__DeferAggregation), QString::fromLatin1("true"));
+    QContactManager deferredManager(m_cm->managerName(), parameters);
+
+    QContact alice;
+    QContactName an;
+    an.setFirstName("Alice10");
+    an.setLastName("Deferred");
+    alice.saveDetail(&an);
+    QContactPhoneNumber aph;
+    aph.setNumber("1010101");
+    alice.saveDetail(&aph);
+    QVERIFY(m_cm->saveContact(&alice));
+
+    QContact syncAlice;
+    QContactName san;
+    san.setFirstName(an.firstName());
+    san.setLastName(an.lastName());
+    syncAlice.saveDetail(&san);
+    QContactPhoneNumber saph;
+    saph.setNumber(aph.number());
+    syncAlice.saveDetail(&saph);
+    QContactSyncTarget sast;
+    sast.setSyncTarget(QLatin1String("test"));
+    syncAlice.saveDetail(&sast);
+    QVERIFY(m_cm->saveContact(&syncAlice));
+
+    syncAlice = m_cm->contact(retrievalId(syncAlice));
+    QList<QContactId> aggregateIds = relatedContactIds(syncAlice.relatedContacts(aggregatesRelationship, QContactRelationship::First));
+    QCOMPARE(aggregateIds.size(), 1);
+    QContact aggregateAlice = m_cm->contact(retrievalId(aggregateIds.first()));
+    QCOMPARE(aggregateAlice.detail<QContactSyncTarget>().syncTarget(), QLatin1String("aggregate"));
+    QVERIFY(!aggregateAlice.detail<QContactStatusFlags>().testFlag(QContactStatusFlags::IsPendingAggregation));
+
+    // the aggregate receives the new detail once the background regeneration completes
+    QContactHobby sah;
+    sah.setHobby(QLatin1String("chess"));
+    syncAlice.saveDetail(&sah);
+    QVERIFY(deferredManager.saveContact(&syncAlice));
+
+    QTRY_COMPARE(m_cm->contact(retrievalId(aggregateAlice)).detail<QContactHobby>().hobby(), QLatin1String("chess"));
+    aggregateAlice = m_cm->contact(retrievalId(aggregateAlice));
+    QVERIFY(!aggregateAlice.detail<QContactStatusFlags>().testFlag(QContactStatusFlags::IsPendingAggregation));
+
+    // removal of a constituent is also regenerated in the background
+    QVERIFY(deferredManager.removeContact(removalId(syncAlice)));
+
+    QTRY_COMPARE(m_cm->contact(retrievalId(aggregateAlice)).detail<QContactHobby>().hobby(), QString());
+    aggregateAlice = m_cm->contact(retrievalId(aggregateAlice));
+    QCOMPARE(aggregateAlice.detail<QContactPhoneNumber>().number(), aph.number());
+    QVERIFY(!aggregateAlice.detail<QContactStatusFlags>().testFlag(QContactStatusFlags::IsPendingAggregation));
+    QVERIFY(m_cm->contactIds(QContactStatusFlags::matchFlag(QContactStatusFlags::IsPendingAggregation)).isEmpty());
 }
 
 void tst_Aggregation::customSemantics()
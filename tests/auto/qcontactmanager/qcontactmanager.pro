@@ -3,6 +3,14 @@ include(../../common.pri)
 
 TARGET = tst_qcontactmanager
 
+QT += sql
+
+# the stored rows are inspected in the engine's database
+DEFINES += 'QTCONTACTS_SQLITE_CENTRAL_DATA_DIR=\'\"/home/nemo/.local/share/system/\"\''
+DEFINES += 'QTCONTACTS_SQLITE_PRIVILEGED_DIR=\'\"privileged\"\''
+DEFINES += 'QTCONTACTS_SQLITE_DATABASE_DIR=\'\"Contacts/qtcontacts-sqlite/\"\''
+DEFINES += 'QTCONTACTS_SQLITE_DATABASE_NAME=\'\"contacts.db\"\''
+
 INCLUDEPATH += \
     ../../../src/engine/
 
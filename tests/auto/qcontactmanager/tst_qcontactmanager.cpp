@@ -62,6 +62,11 @@
 #include "qcontactchangeset.h"
 #endif
 
+#include <QDir>
+#include <QElapsedTimer>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+
 #include "../../util.h"
 #include "../../qcontactmanagerdataholder.h"
 
@@ -164,6 +169,17 @@ private slots:
     void constituentOfSelf();
 #endif
     void searchSensitivity();
+    void requestPriority();
+    void cancelFetch();
+    void sharedFetch();
+    void readAfterWrite();
+    void contactChanges();
+    void partialDetailWrites();
+    void bulkImport();
+    void bulkRemoval();
+    void groupedSaves();
+    void cachedQueries();
+    void destroyedRequests();
 
 #if defined(USE_VERSIT_PLZ)
     void partialSave();
@@ -232,6 +248,25 @@ private:
     const char * const mSignal;
 };
 
+// Helper class that records the order in which requests finish
+class QTestRequestFinishOrder : public QObject {
+    Q_OBJECT
+public:
+    void watch(QContactAbstractRequest *request)
+    {
+        connect(request, SIGNAL(stateChanged(QContactAbstractRequest::State)), this, SLOT(stateChanged(QContactAbstractRequest::State)));
+    }
+
+    QList<QObject *> finished;
+
+public slots:
+    void stateChanged(QContactAbstractRequest::State state)
+    {
+        if (state == QContactAbstractRequest::FinishedState)
+            finished.append(sender());
+    }
+};
+
 
 #ifndef USING_QTPIM
 /* Two backends for testing lazy signal connections */
@@ -1375,10 +1410,24 @@ void tst_QContactManager::remove()
     QVERIFY(alice.id() != QContactId());
 
     /* Remove the created contact */
+    const QDateTime removalTime = QDateTime::currentDateTimeUtc();
     QVERIFY(cm->removeContact(retrievalId(alice)));
     QCOMPARE(cm->contactIds().count(), contactCount);
     QVERIFY(cm->contact(retrievalId(alice)).isEmpty());
     QCOMPARE(cm->error(), QContactManager::DoesNotExistError);
+
+    /* The removal should be reported to change log filters */
+    QContactChangeLogFilter removedFilter(QContactChangeLogFilter::EventRemoved);
+    removedFilter.setSince(removalTime);
+    QVERIFY(cm->contactIds(removedFilter).contains(retrievalId(alice)));
+    QCOMPARE(cm->error(), QContactManager::NoError);
+
+    /* Removed contacts have no details, so a removal filter cannot be combined with other filters */
+    QContactIntersectionFilter combinedFilter;
+    combinedFilter.append(removedFilter);
+    combinedFilter.append(QContactChangeLogFilter(QContactChangeLogFilter::EventAdded));
+    QVERIFY(cm->contactIds(combinedFilter).isEmpty());
+    QVERIFY(cm->error() != QContactManager::NoError);
 }
 
 void tst_QContactManager::batch()
@@ -2384,6 +2433,82 @@ void tst_QContactManager::signalEmission()
     QCOMPARE(QContactIdType(arg.at(0)), cid);
 #endif
 
+    // verify that saving unmodified content does not emit signal changed
+    QTest::qWait(500);
+    spyCM.clear();
+    spyCOM1->clear();
+    QContactSaveRequest unchangedSave;
+    unchangedSave.setManager(m1.data());
+    unchangedSave.setContacts(QList<QContact>() << c);
+    unchangedSave.start();
+    QVERIFY(unchangedSave.waitForFinished());
+    QCOMPARE(unchangedSave.error(), QContactManager::NoError);
+    QCOMPARE(unchangedSave.property(QContactSaveRequest__UnchangedCount).toInt(), 1);
+    QTest::qWait(500);
+    QCOMPARE(spyCM.count(), 0);
+    QCOMPARE(spyCOM1->count(), 0);
+
+    // verify that a change to only the sub-types of a detail is saved, and emits signal changed
+    QContactPhoneNumber subTypedNumber;
+    subTypedNumber.setNumber("5551212");
+#ifdef USING_QTPIM
+    subTypedNumber.setSubTypes(QList<int>() << QContactPhoneNumber::SubTypeMobile);
+#else
+    subTypedNumber.setSubTypes(QStringList() << QContactPhoneNumber::SubTypeMobile);
+#endif
+    QVERIFY(c.saveDetail(&subTypedNumber));
+    QVERIFY(m1->saveContact(&c));
+    QTRY_VERIFY(spyCM.count() > 0);
+    QTest::qWait(500);
+    spyCM.clear();
+    spyCOM1->clear();
+
+    c = m1->contact(retrievalId(c));
+    subTypedNumber = c.detail<QContactPhoneNumber>();
+#ifdef USING_QTPIM
+    subTypedNumber.setSubTypes(QList<int>() << QContactPhoneNumber::SubTypeFax);
+#else
+    subTypedNumber.setSubTypes(QStringList() << QContactPhoneNumber::SubTypeFax);
+#endif
+    QVERIFY(c.saveDetail(&subTypedNumber));
+    QContactSaveRequest subTypeSave;
+    subTypeSave.setManager(m1.data());
+    subTypeSave.setContacts(QList<QContact>() << c);
+    subTypeSave.start();
+    QVERIFY(subTypeSave.waitForFinished());
+    QCOMPARE(subTypeSave.error(), QContactManager::NoError);
+    QCOMPARE(subTypeSave.property(QContactSaveRequest__UnchangedCount).toInt(), 0);
+    QTRY_VERIFY(spyCM.count() > 0);
+    arg = spyCM.takeFirst().first().value<QList<QContactIdType> >();
+    while (spyCM.count())
+        arg.append(spyCM.takeFirst().first().value<QList<QContactIdType> >());
+    QVERIFY(arg.contains(cid));
+#ifdef USING_QTPIM
+    QCOMPARE(m1->contact(retrievalId(c)).detail<QContactPhoneNumber>().subTypes(), QList<int>() << QContactPhoneNumber::SubTypeFax);
+#else
+    QCOMPARE(m1->contact(retrievalId(c)).detail<QContactPhoneNumber>().subTypes(), QStringList() << QContactPhoneNumber::SubTypeFax);
+#endif
+    QTest::qWait(500);
+    spyCM.clear();
+    spyCOM1->clear();
+
+    // verify that a change to only the access constraints of a detail is saved
+    c = m1->contact(retrievalId(c));
+    subTypedNumber = c.detail<QContactPhoneNumber>();
+    QContactManagerEngine::setDetailAccessConstraints(&subTypedNumber, QContactDetail::ReadOnly);
+    QVERIFY(c.saveDetail(&subTypedNumber));
+    QContactSaveRequest constraintSave;
+    constraintSave.setManager(m1.data());
+    constraintSave.setContacts(QList<QContact>() << c);
+    constraintSave.start();
+    QVERIFY(constraintSave.waitForFinished());
+    QCOMPARE(constraintSave.error(), QContactManager::NoError);
+    QCOMPARE(constraintSave.property(QContactSaveRequest__UnchangedCount).toInt(), 0);
+    QCOMPARE(m1->contact(retrievalId(c)).detail<QContactPhoneNumber>().accessConstraints(), QContactDetail::AccessConstraints(QContactDetail::ReadOnly));
+    QTest::qWait(500);
+    spyCM.clear();
+    spyCOM1->clear();
+
     // verify remove emits signal removed
     m1->removeContact(removalId(c));
     remSigCount += 1;
@@ -4502,5 +4627,891 @@ void tst_QContactManager::searchSensitivity()
     QCOMPARE(m.contactIds(sensitiveMismatch).count(), originalCount[5]);
 }
 
+void tst_QContactManager::requestPriority()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+#ifdef DETAIL_DEFINITION_SUPPORTED
+    QContactDetailDefinition nameDef = m.detailDefinition(QContactName::DefinitionName, QContactType::TypeContact);
+#endif
+
+    // Enough contacts that a fetch of all of them occupies its thread while other fetches are queued
+    QList<QContact> contacts;
+    for (int i = 0; i < 300; ++i) {
+#ifndef DETAIL_DEFINITION_SUPPORTED
+        contacts.append(createContact("Priority", QString::number(i), QString::number(5550100 + i)));
+#else
+        contacts.append(createContact(nameDef, "Priority", QString::number(i), QString::number(5550100 + i)));
+#endif
+    }
+    QVERIFY(m.saveContacts(&contacts));
+
+    // Fetches of one type are queued in the same thread; distinct filters prevent them sharing results
+    QTestRequestFinishOrder fetchOrder;
+    QContactFetchRequest blocker;
+    blocker.setManager(&m);
+    fetchOrder.watch(&blocker);
+    QList<QContactFetchRequest *> fetches;
+    for (int i = 0; i < 4; ++i) {
+        QContactDetailFilter filter;
+        setFilterDetail<QContactName>(filter, QContactName::FieldLastName);
+        filter.setValue(QString::number(i));
+        QContactFetchRequest *fetch = new QContactFetchRequest;
+        fetch->setManager(&m);
+        fetch->setFilter(filter);
+        fetch->setProperty(QContactAbstractRequest__Priority,
+                           i < 3 ? QContactAbstractRequest__BackgroundPriority : QContactAbstractRequest__InteractivePriority);
+        fetchOrder.watch(fetch);
+        fetches.append(fetch);
+    }
+    blocker.start();
+    foreach (QContactFetchRequest *fetch, fetches) {
+        fetch->start();
+    }
+    QTRY_COMPARE(fetchOrder.finished.count(), fetches.count() + 1);
+
+    // The interactive fetch finished before the background fetches queued ahead of it
+    const int interactiveIndex = fetchOrder.finished.indexOf(fetches.at(3));
+    QVERIFY(interactiveIndex < fetchOrder.finished.indexOf(fetches.at(1)));
+    QVERIFY(interactiveIndex < fetchOrder.finished.indexOf(fetches.at(2)));
+    qDeleteAll(fetches);
+
+    // Saves are not reordered by priority: they finish in the order they were started
+    QTestRequestFinishOrder saveOrder;
+    QList<QContactSaveRequest *> saves;
+    for (int i = 0; i < 4; ++i) {
+#ifndef DETAIL_DEFINITION_SUPPORTED
+        QContact contact = createContact("Prioritywrite", QString::number(i), QString::number(5550500 + i));
+#else
+        QContact contact = createContact(nameDef, "Prioritywrite", QString::number(i), QString::number(5550500 + i));
+#endif
+        QContactSaveRequest *save = new QContactSaveRequest;
+        save->setManager(&m);
+        save->setContacts(QList<QContact>() << contact);
+        save->setProperty(QContactAbstractRequest__Priority,
+                          i < 3 ? QContactAbstractRequest__BackgroundPriority : QContactAbstractRequest__InteractivePriority);
+        saveOrder.watch(save);
+        saves.append(save);
+    }
+    foreach (QContactSaveRequest *save, saves) {
+        save->start();
+    }
+    QTRY_COMPARE(saveOrder.finished.count(), saves.count());
+
+    QList<QContactIdType> savedIds;
+    for (int i = 0; i < saves.count(); ++i) {
+        QCOMPARE(saveOrder.finished.at(i), static_cast<QObject *>(saves.at(i)));
+        QCOMPARE(saves.at(i)->error(), QContactManager::NoError);
+        savedIds.append(removalId(saves.at(i)->contacts().first()));
+    }
+    qDeleteAll(saves);
+
+    foreach (const QContact &contact, contacts) {
+        savedIds.append(removalId(contact));
+    }
+    QVERIFY(m.removeContacts(savedIds));
+}
+
+void tst_QContactManager::cancelFetch()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+#ifdef DETAIL_DEFINITION_SUPPORTED
+    QContactDetailDefinition nameDef = m.detailDefinition(QContactName::DefinitionName, QContactType::TypeContact);
+#endif
+
+    // Ensure there are enough contacts that the fetch is reported in several batches
+    QList<QContact> contacts;
+    for (int i = 0; i < 500; ++i) {
+#ifndef DETAIL_DEFINITION_SUPPORTED
+        contacts.append(createContact("Cancel", QString::number(i), QString::number(5551000 + i)));
+#else
+        contacts.append(createContact(nameDef, "Cancel", QString::number(i), QString::number(5551000 + i)));
+#endif
+    }
+    QVERIFY(m.saveContacts(&contacts));
+
+    QContactFetchRequest request;
+    request.setManager(&m);
+    request.start();
+    QTRY_VERIFY(!request.contacts().isEmpty() || request.isFinished());
+
+    // Cancelling fails if the fetch completed in the meantime; otherwise the read in progress
+    // is aborted, rather than continuing to the end of its results
+    QElapsedTimer timer;
+    timer.start();
+    if (request.cancel()) {
+        QTRY_VERIFY(request.isCanceled());
+        qDebug() << "Cancel to idle latency:" << timer.elapsed() << "ms";
+        QVERIFY(timer.elapsed() < 1000);
+        QVERIFY(request.contacts().count() < m.contactIds().count());
+    } else {
+        QVERIFY(request.waitForFinished());
+        QVERIFY(request.isFinished());
+    }
+
+    // A fetch queued behind a write executes in the writer thread, and can also be cancelled
+#ifndef DETAIL_DEFINITION_SUPPORTED
+    QContact written = createContact("Cancel", "Written", "5551999");
+#else
+    QContact written = createContact(nameDef, "Cancel", "Written", "5551999");
+#endif
+    QContactSaveRequest save;
+    save.setManager(&m);
+    save.setContacts(QList<QContact>() << written);
+    QContactFetchRequest queued;
+    queued.setManager(&m);
+    QVERIFY(save.start());
+    QVERIFY(queued.start());
+    QTRY_VERIFY(!queued.contacts().isEmpty() || queued.isFinished());
+
+    timer.restart();
+    if (queued.cancel()) {
+        QTRY_VERIFY(queued.isCanceled());
+        QVERIFY(timer.elapsed() < 1000);
+        QVERIFY(queued.contacts().count() < m.contactIds().count());
+    } else {
+        QVERIFY(queued.waitForFinished());
+        QVERIFY(queued.isFinished());
+    }
+    QVERIFY(save.waitForFinished());
+    QCOMPARE(save.error(), QContactManager::NoError);
+    contacts.append(save.contacts().first());
+
+    // The thread must be free to process further requests, which are not affected by
+    // any ids left by the cancelled fetch
+    QContactFetchRequest subsequent;
+    subsequent.setManager(&m);
+    subsequent.start();
+    QVERIFY(subsequent.waitForFinished());
+    QCOMPARE(subsequent.error(), QContactManager::NoError);
+    QCOMPARE(subsequent.contacts().count(), m.contactIds().count());
+
+    QList<QContactIdType> savedIds;
+    foreach (const QContact &contact, contacts) {
+        savedIds.append(removalId(contact));
+    }
+    QVERIFY(m.removeContacts(savedIds));
+}
+
+void tst_QContactManager::sharedFetch()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+    const int count = m.contactIds().count();
+
+    // Identical requests started together may share a single execution
+    QContactFetchRequest first;
+    first.setManager(&m);
+    QContactFetchRequest second;
+    second.setManager(&m);
+    QContactFetchRequest third;
+    third.setManager(&m);
+
+    first.start();
+    second.start();
+    third.start();
+
+    // Cancelling one of the requests does not affect the others
+    third.cancel();
+
+    QVERIFY(first.waitForFinished());
+    QVERIFY(second.waitForFinished());
+    QCOMPARE(first.error(), QContactManager::NoError);
+    QCOMPARE(second.error(), QContactManager::NoError);
+    QCOMPARE(first.contacts().count(), count);
+    QCOMPARE(second.contacts().count(), count);
+
+    QTRY_VERIFY(third.isCanceled() || third.isFinished());
+
+    // A request started after a write does not share the results of a fetch already executing
+    QContactFetchRequest before;
+    before.setManager(&m);
+    before.start();
+
+#ifndef DETAIL_DEFINITION_SUPPORTED
+    QContact contact = createContact("Sharedfetch", "Writer", "5553000");
+#else
+    QContactDetailDefinition nameDef = m.detailDefinition(QContactName::DefinitionName, QContactType::TypeContact);
+    QContact contact = createContact(nameDef, "Sharedfetch", "Writer", "5553000");
+#endif
+    QVERIFY(m.saveContact(&contact));
+
+    QContactFetchRequest after;
+    after.setManager(&m);
+    after.start();
+    QVERIFY(before.waitForFinished());
+    QVERIFY(after.waitForFinished());
+    QCOMPARE(after.error(), QContactManager::NoError);
+    QCOMPARE(after.contacts().count(), count + 1);
+
+    // A request started after a queued write does not share a fetch queued before that write
+#ifndef DETAIL_DEFINITION_SUPPORTED
+    QContact first = createContact("Sharedfetch", "First", "5553001");
+    QContact second = createContact("Sharedfetch", "Second", "5553002");
+#else
+    QContact first = createContact(nameDef, "Sharedfetch", "First", "5553001");
+    QContact second = createContact(nameDef, "Sharedfetch", "Second", "5553002");
+#endif
+    QContactSaveRequest firstSave;
+    firstSave.setManager(&m);
+    firstSave.setContacts(QList<QContact>() << first);
+    QContactFetchRequest queuedBefore;
+    queuedBefore.setManager(&m);
+    QContactSaveRequest secondSave;
+    secondSave.setManager(&m);
+    secondSave.setContacts(QList<QContact>() << second);
+    QContactFetchRequest queuedAfter;
+    queuedAfter.setManager(&m);
+
+    QVERIFY(firstSave.start());
+    QVERIFY(queuedBefore.start());
+    QVERIFY(secondSave.start());
+    QVERIFY(queuedAfter.start());
+    QVERIFY(queuedAfter.waitForFinished());
+    QCOMPARE(queuedAfter.error(), QContactManager::NoError);
+    QCOMPARE(queuedAfter.contacts().count(), count + 3);
+
+    QVERIFY(firstSave.waitForFinished());
+    QVERIFY(secondSave.waitForFinished());
+    QVERIFY(queuedBefore.waitForFinished());
+    QVERIFY(m.removeContact(removalId(firstSave.contacts().first())));
+    QVERIFY(m.removeContact(removalId(secondSave.contacts().first())));
+
+    QVERIFY(m.removeContact(removalId(contact)));
+}
+
+void tst_QContactManager::readAfterWrite()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+#ifdef DETAIL_DEFINITION_SUPPORTED
+    QContactDetailDefinition nameDef = m.detailDefinition(QContactName::DefinitionName, QContactType::TypeContact);
+#endif
+
+    QContactDetailFilter nameFilter;
+    setFilterDetail<QContactName>(nameFilter, QContactName::FieldFirstName);
+    nameFilter.setValue(QString::fromLatin1("Readafterwrite"));
+    nameFilter.setMatchFlags(QContactFilter::MatchExactly);
+
+    // A fetch started after a save observes the saved contact, even if the save has not completed
+    QList<QContactSaveRequest *> saves;
+    for (int i = 0; i < 5; ++i) {
+#ifndef DETAIL_DEFINITION_SUPPORTED
+        QContact contact = createContact("Readafterwrite", QString::number(i), QString::number(5552000 + i));
+#else
+        QContact contact = createContact(nameDef, "Readafterwrite", QString::number(i), QString::number(5552000 + i));
+#endif
+        QContactSaveRequest *save = new QContactSaveRequest;
+        save->setManager(&m);
+        save->setContacts(QList<QContact>() << contact);
+        saves.append(save);
+    }
+
+    QContactFetchRequest fetch;
+    fetch.setManager(&m);
+    fetch.setFilter(nameFilter);
+    fetch.setProperty(QContactAbstractRequest__Priority, QContactAbstractRequest__InteractivePriority);
+
+    foreach (QContactSaveRequest *save, saves) {
+        save->start();
+    }
+    QVERIFY(fetch.start());
+    QVERIFY(fetch.waitForFinished());
+    QCOMPARE(fetch.error(), QContactManager::NoError);
+    QCOMPARE(fetch.contacts().count(), saves.count());
+
+    QList<QContactIdType> savedIds;
+    foreach (QContactSaveRequest *save, saves) {
+        QVERIFY(save->waitForFinished());
+        QCOMPARE(save->error(), QContactManager::NoError);
+        savedIds.append(removalId(save->contacts().first()));
+    }
+    qDeleteAll(saves);
+
+    // A fetch queued behind a write still finishes after the fetches of its type started before it
+    QTestRequestFinishOrder fetchOrder;
+    QContactFetchRequest earlier;
+    earlier.setManager(&m);
+    fetchOrder.watch(&earlier);
+#ifndef DETAIL_DEFINITION_SUPPORTED
+    QContact contact = createContact("Readafterwrite", "Ordered", "5552100");
+#else
+    QContact contact = createContact(nameDef, "Readafterwrite", "Ordered", "5552100");
+#endif
+    QContactSaveRequest save;
+    save.setManager(&m);
+    save.setContacts(QList<QContact>() << contact);
+    QContactFetchRequest later;
+    later.setManager(&m);
+    later.setFilter(nameFilter);
+    later.setProperty(QContactAbstractRequest__Priority, QContactAbstractRequest__InteractivePriority);
+    fetchOrder.watch(&later);
+
+    QVERIFY(earlier.start());
+    QVERIFY(save.start());
+    QVERIFY(later.start());
+    QTRY_COMPARE(fetchOrder.finished.count(), 2);
+    QCOMPARE(fetchOrder.finished.at(0), static_cast<QObject *>(&earlier));
+    QCOMPARE(fetchOrder.finished.at(1), static_cast<QObject *>(&later));
+    QCOMPARE(later.contacts().count(), savedIds.count() + 1);
+
+    QVERIFY(save.waitForFinished());
+    QCOMPARE(save.error(), QContactManager::NoError);
+    savedIds.append(removalId(save.contacts().first()));
+    QVERIFY(m.removeContacts(savedIds));
+}
+
+static bool fetchContactChanges(
+        QContactManager *m, const QString &token,
+        QList<QContactIdType> *addedIds, QList<QContactIdType> *changedIds, QList<QContactIdType> *removedIds,
+        QString *nextToken, QContactManager::Error *error)
+{
+#ifdef USING_QTPIM
+    QContactIdFetchRequest request;
+#else
+    QContactLocalIdFetchRequest request;
+#endif
+    request.setManager(m);
+    request.setProperty(QContactIdFetchRequest__ChangesToken, token);
+    if (!request.start() || !request.waitForFinished())
+        return false;
+
+    *error = request.error();
+    *addedIds = request.property(QContactIdFetchRequest__AddedIds).value<QList<QContactIdType> >();
+    *changedIds = request.property(QContactIdFetchRequest__ChangedIds).value<QList<QContactIdType> >();
+    *removedIds = request.property(QContactIdFetchRequest__RemovedIds).value<QList<QContactIdType> >();
+    *nextToken = request.property(QContactIdFetchRequest__NextChangesToken).toString();
+    return request.ids() == *addedIds + *changedIds;
+}
+
+void tst_QContactManager::contactChanges()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+    QList<QContactIdType> addedIds, changedIds, removedIds;
+    QString initialToken, addedToken, changedToken, token;
+    QContactManager::Error error;
+
+    // An invalid token is rejected
+    QVERIFY(fetchContactChanges(&m, QString::fromLatin1("invalid"), &addedIds, &changedIds, &removedIds, &token, &error));
+    QCOMPARE(error, QContactManager::BadArgumentError);
+
+    // A token beyond any change yet written is rejected
+    QVERIFY(fetchContactChanges(&m, QString::number(Q_INT64_C(1) << 62), &addedIds, &changedIds, &removedIds, &token, &error));
+    QCOMPARE(error, QContactManager::BadArgumentError);
+
+    // An empty token reports every existing contact as added
+    QVERIFY(fetchContactChanges(&m, QString(), &addedIds, &changedIds, &removedIds, &initialToken, &error));
+    QCOMPARE(error, QContactManager::NoError);
+    QVERIFY(!initialToken.isEmpty());
+    foreach (const QContactIdType &id, m.contactIds())
+        QVERIFY(addedIds.contains(id));
+    QVERIFY(changedIds.isEmpty());
+
+#ifndef DETAIL_DEFINITION_SUPPORTED
+    QContact alice = createContact("AliceChanges", "inWonderlandChanges", "123456789");
+    QContact bob = createContact("BobChanges", "BuilderChanges", "987654321");
+#else
+    QContactDetailDefinition nameDef = m.detailDefinition(QContactName::DefinitionName, QContactType::TypeContact);
+    QContact alice = createContact(nameDef, "AliceChanges", "inWonderlandChanges", "123456789");
+    QContact bob = createContact(nameDef, "BobChanges", "BuilderChanges", "987654321");
+#endif
+    QVERIFY(m.saveContact(&alice));
+    QVERIFY(m.saveContact(&bob));
+
+    QVERIFY(fetchContactChanges(&m, initialToken, &addedIds, &changedIds, &removedIds, &addedToken, &error));
+    QCOMPARE(error, QContactManager::NoError);
+    QVERIFY(addedIds.contains(retrievalId(alice)));
+    QVERIFY(addedIds.contains(retrievalId(bob)));
+    QVERIFY(!changedIds.contains(retrievalId(alice)));
+
+    // Changes already reported are not reported again
+    QVERIFY(fetchContactChanges(&m, addedToken, &addedIds, &changedIds, &removedIds, &token, &error));
+    QCOMPARE(error, QContactManager::NoError);
+    QVERIFY(!addedIds.contains(retrievalId(alice)));
+    QVERIFY(!changedIds.contains(retrievalId(alice)));
+    QVERIFY(!addedIds.contains(retrievalId(bob)));
+    QCOMPARE(token, addedToken);
+
+    // A fetched contact keeps its stored modification timestamp when saved, yet is reported as changed
+    alice = m.contact(retrievalId(alice));
+    QContactPhoneNumber phn = alice.detail<QContactPhoneNumber>();
+    phn.setNumber("1122334455");
+    alice.saveDetail(&phn);
+    QVERIFY(m.saveContact(&alice));
+    QVERIFY(m.removeContact(removalId(bob)));
+
+    QVERIFY(fetchContactChanges(&m, addedToken, &addedIds, &changedIds, &removedIds, &changedToken, &error));
+    QCOMPARE(error, QContactManager::NoError);
+    QVERIFY(changedIds.contains(retrievalId(alice)));
+    QVERIFY(!addedIds.contains(retrievalId(alice)));
+    QVERIFY(removedIds.contains(retrievalId(bob)));
+    QVERIFY(changedToken != addedToken);
+
+    QVERIFY(fetchContactChanges(&m, changedToken, &addedIds, &changedIds, &removedIds, &token, &error));
+    QCOMPARE(error, QContactManager::NoError);
+    QVERIFY(!changedIds.contains(retrievalId(alice)));
+    QVERIFY(!removedIds.contains(retrievalId(bob)));
+
+    QVERIFY(m.removeContact(removalId(alice)));
+}
+
+static int saveWithDetailStatementCount(QContactManager *m, QContact *contact)
+{
+    QContactSaveRequest request;
+    request.setManager(m);
+    request.setContacts(QList<QContact>() << *contact);
+    if (!request.start() || !request.waitForFinished() || request.error() != QContactManager::NoError)
+        return -1;
+
+    *contact = request.contacts().first();
+    return request.property(QContactSaveRequest__DetailStatementCount).toInt();
+}
+
+static QStringList phoneNumbers(const QContact &contact)
+{
+    QStringList numbers;
+    foreach (const QContactPhoneNumber &phn, contact.details<QContactPhoneNumber>())
+        numbers.append(phn.number());
+    return numbers;
+}
+
+static void setPhoneNumbers(QContact *contact, const QStringList &numbers)
+{
+    foreach (QContactPhoneNumber phn, contact->details<QContactPhoneNumber>())
+        contact->removeDetail(&phn);
+    foreach (const QString &number, numbers) {
+        QContactPhoneNumber phn;
+        phn.setNumber(number);
+        contact->saveDetail(&phn);
+    }
+}
+
+void tst_QContactManager::partialDetailWrites()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+    const QString a(QString::fromLatin1("1111111")), b(QString::fromLatin1("2222222")), c(QString::fromLatin1("3333333"));
+    const QString changed(QString::fromLatin1("4444444"));
+
+#ifndef DETAIL_DEFINITION_SUPPORTED
+    QContact alice = createContact("AlicePartial", "inWonderlandPartial", QString());
+#else
+    QContactDetailDefinition nameDef = m.detailDefinition(QContactName::DefinitionName, QContactType::TypeContact);
+    QContact alice = createContact(nameDef, "AlicePartial", "inWonderlandPartial", QString());
+#endif
+    setPhoneNumbers(&alice, QStringList() << a << b << c);
+    QVERIFY(m.saveContact(&alice));
+    const QContactIdType aliceId(retrievalId(alice));
+    QCOMPARE(phoneNumbers(m.contact(aliceId)), QStringList() << a << b << c);
+
+    // Each write costs one statement to select the stored detail ids, one to remove the common
+    // detail rows of the details updated in place and two per updated detail, two to remove
+    // the stored details no longer wanted with their common detail rows, and two per inserted detail.
+
+    // Modifying the last detail updates only that detail
+    QContact contact = m.contact(aliceId);
+    QList<QContactPhoneNumber> numbers = contact.details<QContactPhoneNumber>();
+    numbers[2].setNumber(changed);
+    contact.saveDetail(&numbers[2]);
+    QCOMPARE(saveWithDetailStatementCount(&m, &contact), 1 + 1 + 2);
+    QCOMPARE(phoneNumbers(m.contact(aliceId)), QStringList() << a << b << changed);
+
+    // Modifying the first detail updates it in place, so that the order is kept
+    // without rewriting the details following it
+    contact = m.contact(aliceId);
+    numbers = contact.details<QContactPhoneNumber>();
+    numbers[0].setNumber(c);
+    contact.saveDetail(&numbers[0]);
+    QCOMPARE(saveWithDetailStatementCount(&m, &contact), 1 + 1 + 2);
+    QCOMPARE(phoneNumbers(m.contact(aliceId)), QStringList() << c << b << changed);
+
+    // Removing a detail requires no inserts
+    contact = m.contact(aliceId);
+    numbers = contact.details<QContactPhoneNumber>();
+    contact.removeDetail(&numbers[1]);
+    QCOMPARE(saveWithDetailStatementCount(&m, &contact), 1 + 2);
+    QCOMPARE(phoneNumbers(m.contact(aliceId)), QStringList() << c << changed);
+
+    // Reordering the details inserts those that no longer follow the retained details
+    contact = m.contact(aliceId);
+    setPhoneNumbers(&contact, QStringList() << changed << a << c);
+    QCOMPARE(saveWithDetailStatementCount(&m, &contact), 1 + 2 + 2 * 2);
+    QCOMPARE(phoneNumbers(m.contact(aliceId)), QStringList() << changed << a << c);
+
+    // Changing only the name leaves the details untouched
+    contact = m.contact(aliceId);
+    QContactName name = contact.detail<QContactName>();
+    name.setFirstName(QString::fromLatin1("AlicePartialRenamed"));
+    contact.saveDetail(&name);
+    QCOMPARE(saveWithDetailStatementCount(&m, &contact), 1);
+    QCOMPARE(phoneNumbers(m.contact(aliceId)), QStringList() << changed << a << c);
+
+    QVERIFY(m.removeContact(removalId(alice)));
+}
+
+void tst_QContactManager::bulkImport()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+    const int importCount = 30;
+    const int existingCount = m.contactIds().count();
+
+    QList<QContact> contacts;
+    for (int i = 0; i < importCount; ++i) {
+        QContact contact;
+        QContactName name;
+        name.setFirstName(QString::fromLatin1("Bulkimport%1").arg(i));
+        name.setLastName(QString::fromLatin1("Importer"));
+        contact.saveDetail(&name);
+        QContactPhoneNumber phn;
+        phn.setNumber(QString::fromLatin1("5550%1").arg(i, 3, 10, QChar::fromLatin1('0')));
+        contact.saveDetail(&phn);
+        QContactEmailAddress email;
+        email.setEmailAddress(QString::fromLatin1("bulkimport%1@example.com").arg(i));
+        contact.saveDetail(&email);
+        contacts.append(contact);
+    }
+
+    QContactSaveRequest request;
+    request.setManager(&m);
+    request.setContacts(contacts);
+    request.setProperty(QContactSaveRequest__BulkImport, true);
+    QVERIFY(request.start());
+    QVERIFY(request.waitForFinished());
+    QCOMPARE(request.error(), QContactManager::NoError);
+    QVERIFY(request.errorMap().isEmpty());
+    QCOMPARE(request.contacts().count(), importCount);
+
+    // Each imported contact is stored with all of its details
+    QList<QContactIdType> importedIds;
+    for (int i = 0; i < importCount; ++i) {
+        const QContact &imported(request.contacts().at(i));
+        QVERIFY(ContactId::isValid(imported.id()));
+        importedIds.append(retrievalId(imported));
+
+        const QContact stored = m.contact(retrievalId(imported));
+        QCOMPARE(m.error(), QContactManager::NoError);
+        QCOMPARE(stored.detail<QContactName>().firstName(), QString::fromLatin1("Bulkimport%1").arg(i));
+        QCOMPARE(stored.detail<QContactName>().lastName(), QString::fromLatin1("Importer"));
+        QCOMPARE(stored.detail<QContactPhoneNumber>().number(), QString::fromLatin1("5550%1").arg(i, 3, 10, QChar::fromLatin1('0')));
+        QCOMPARE(stored.detail<QContactEmailAddress>().emailAddress(), QString::fromLatin1("bulkimport%1@example.com").arg(i));
+
+#ifdef QTCONTACTS_SQLITE_PERFORM_AGGREGATION
+        // and is aggregated
+        QContactRelationshipFilter relationshipFilter;
+        setFilterType(relationshipFilter, QContactRelationship::Aggregates);
+        setFilterContact(relationshipFilter, imported);
+        relationshipFilter.setRelatedContactRole(QContactRelationship::Second);
+        const QList<QContact> aggregates = m.contacts(relationshipFilter);
+        QCOMPARE(aggregates.count(), 1);
+        QCOMPARE(aggregates.first().detail<QContactName>().firstName(), QString::fromLatin1("Bulkimport%1").arg(i));
+#endif
+    }
+
+    // One contact is visible for each imported contact
+    QCOMPARE(m.contactIds().count(), existingCount + importCount);
+
+    // The imported contacts are found by name filters, including through the search index
+    QContactDetailFilter nameFilter;
+    setFilterDetail<QContactName>(nameFilter, QContactName::FieldFirstName);
+    nameFilter.setValue(QString::fromLatin1("Bulkimport1"));
+    nameFilter.setMatchFlags(QContactFilter::MatchStartsWith);
+    QCOMPARE(m.contactIds(nameFilter).count(), 11); // 1 and 10 to 19
+
+    nameFilter.setValue(QString::fromLatin1("bulkimport2"));
+    nameFilter.setMatchFlags(QContactFilter::MatchStartsWith);
+    QCOMPARE(m.contactIds(nameFilter).count(), 11); // 2 and 20 to 29
+
+    // and by keypad filters, through the keypad index
+    nameFilter.setValue(QString::fromLatin1("Bulkimport2"));
+    nameFilter.setMatchFlags(QContactFilter::MatchStartsWith | QContactFilter::MatchKeypadCollation);
+    QCOMPARE(m.contactIds(nameFilter).count(), 11);
+
+    nameFilter.setValue(QString::fromLatin1("28554676780"));
+    nameFilter.setMatchFlags(QContactFilter::MatchKeypadCollation);
+    QCOMPARE(m.contactIds(nameFilter).count(), 1);
+
+    QVERIFY(m.removeContacts(importedIds));
+    QCOMPARE(m.contactIds().count(), existingCount);
+}
+
+static int countRows(QSqlDatabase &database, const QString &statement)
+{
+    QSqlQuery query(database);
+    if (!query.exec(statement) || !query.next()) {
+        qWarning() << "Failed to count rows:" << statement;
+        return -1;
+    }
+    return query.value(0).toInt();
+}
+
+void tst_QContactManager::bulkRemoval()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+    // Enough contacts that they are removed by the set-based statements
+    const int removeCount = 25;
+
+    QContact survivor;
+    QContactName survivorName;
+    survivorName.setFirstName(QString::fromLatin1("Bulkremoval"));
+    survivorName.setLastName(QString::fromLatin1("Survivor"));
+    survivor.saveDetail(&survivorName);
+    QVERIFY(m.saveContact(&survivor));
+
+    QList<QContact> contacts;
+    for (int i = 0; i < removeCount; ++i) {
+        QContact contact;
+        QContactName name;
+        name.setFirstName(QString::fromLatin1("Bulkremoval%1").arg(i));
+        name.setLastName(QString::fromLatin1("Remover"));
+        contact.saveDetail(&name);
+        QContactPhoneNumber phn;
+        phn.setNumber(QString::fromLatin1("5551%1").arg(i, 3, 10, QChar::fromLatin1('0')));
+        contact.saveDetail(&phn);
+        QContactEmailAddress email;
+        email.setEmailAddress(QString::fromLatin1("bulkremoval%1@example.com").arg(i));
+        contact.saveDetail(&email);
+        contacts.append(contact);
+    }
+    QVERIFY(m.saveContacts(&contacts));
+
+    // Relationships both among the removed contacts and with a contact which is retained
+    QList<QContactRelationship> relationships;
+    QList<QContactIdType> removeIds;
+    QStringList boundIds;
+    for (int i = 0; i < removeCount; ++i) {
+        relationships.append(makeRelationship(QContactRelationship::HasMember, survivor.id(), contacts.at(i).id()));
+        if (i > 0)
+            relationships.append(makeRelationship(QContactRelationship::HasMember, contacts.at(i - 1).id(), contacts.at(i).id()));
+        removeIds.append(removalId(contacts.at(i)));
+        boundIds.append(QString::number(ContactId::databaseId(contacts.at(i).id())));
+    }
+    QVERIFY(m.saveRelationships(&relationships, 0));
+
+    QVERIFY(m.removeContacts(removeIds));
+    foreach (const QContact &contact, contacts) {
+        m.contact(retrievalId(contact));
+        QCOMPARE(m.error(), QContactManager::DoesNotExistError);
+    }
+
+    // Inspect the stored rows directly, using the engine's database location
+    QString databaseDir(QString::fromLatin1("%1/%2/").arg(QString::fromLatin1(QTCONTACTS_SQLITE_CENTRAL_DATA_DIR)).arg(QString::fromLatin1(QTCONTACTS_SQLITE_PRIVILEGED_DIR)));
+    if (!QDir(databaseDir).exists() || !QDir(databaseDir).isReadable())
+        databaseDir = QString::fromLatin1(QTCONTACTS_SQLITE_CENTRAL_DATA_DIR);
+    const QString databaseFile(databaseDir + QString::fromLatin1(QTCONTACTS_SQLITE_DATABASE_DIR) + QString::fromLatin1(QTCONTACTS_SQLITE_DATABASE_NAME));
+
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(QString::fromLatin1("QSQLITE"), QString::fromLatin1("tst_qcontactmanager_bulkRemoval"));
+        database.setDatabaseName(databaseFile);
+        database.setConnectOptions(QString::fromLatin1("QSQLITE_OPEN_READONLY"));
+        QVERIFY(database.open());
+
+        const QString ids(boundIds.join(QString::fromLatin1(",")));
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM Details WHERE contactId IN (%1)").arg(ids)), 0);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM PhoneNumbers WHERE contactId IN (%1)").arg(ids)), 0);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM EmailAddresses WHERE contactId IN (%1)").arg(ids)), 0);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM Relationships WHERE firstId IN (%1) OR secondId IN (%1)").arg(ids)), 0);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM Tombstones WHERE contactId IN (%1)").arg(ids)), removeCount);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM KeypadIndex WHERE contactId IN (%1)").arg(ids)), 0);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM Fingerprints WHERE contactId IN (%1)").arg(ids)), 0);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM MatchKeys WHERE contactId IN (%1)").arg(ids)), 0);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM DeferredAggregates WHERE contactId IN (%1)").arg(ids)), 0);
+        if (countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'SearchIndex'")) > 0)
+            QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM SearchIndex WHERE docid IN (%1)").arg(ids)), 0);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM BulkRemovals")), 0);
+
+        // Every per-row removal trigger skips the contacts staged for set-based removal
+        QVERIFY(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND tbl_name = 'Contacts' AND sql LIKE '%BEFORE DELETE%'")) > 0);
+        QCOMPARE(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND tbl_name = 'Contacts' AND sql LIKE '%BEFORE DELETE%' AND sql NOT LIKE '%BulkRemovals%'")), 0);
+
+        // The retained contact keeps its own details
+        QVERIFY(countRows(database, QString::fromLatin1("SELECT COUNT(*) FROM Details WHERE contactId = %1").arg(ContactId::databaseId(survivor.id()))) > 0);
+
+        database.close();
+    }
+    QSqlDatabase::removeDatabase(QString::fromLatin1("tst_qcontactmanager_bulkRemoval"));
+
+    QCOMPARE(m.contact(retrievalId(survivor)).detail<QContactName>().lastName(), QString::fromLatin1("Survivor"));
+    QVERIFY(m.removeContact(removalId(survivor)));
+}
+
+void tst_QContactManager::groupedSaves()
+{
+    QTest::qWait(500); // clear the signal queue
+    QContactManager m(DEFAULT_MANAGER);
+
+#ifdef DETAIL_DEFINITION_SUPPORTED
+    QContactDetailDefinition nameDef = m.detailDefinition(QContactName::DefinitionName, QContactType::TypeContact);
+#endif
+
+    // A contact which no longer exists cannot be updated
+#ifndef DETAIL_DEFINITION_SUPPORTED
+    QContact removed = createContact("Groupedsave", "Removed", "5554999");
+#else
+    QContact removed = createContact(nameDef, "Groupedsave", "Removed", "5554999");
+#endif
+    QVERIFY(m.saveContact(&removed));
+    QVERIFY(m.removeContact(removalId(removed)));
+
+    // A large save occupies the writer while the others are queued, to be committed together
+    QList<QContact> blockerContacts;
+    for (int i = 0; i < 200; ++i) {
+#ifndef DETAIL_DEFINITION_SUPPORTED
+        blockerContacts.append(createContact("Groupedblocker", QString::number(i), QString::number(5554000 + i)));
+#else
+        blockerContacts.append(createContact(nameDef, "Groupedblocker", QString::number(i), QString::number(5554000 + i)));
+#endif
+    }
+    QContactSaveRequest blocker;
+    blocker.setManager(&m);
+    blocker.setContacts(blockerContacts);
+
+    const int saveCount = 5;
+    const int failingIndex = 2;
+    QList<QContactSaveRequest *> saves;
+    for (int i = 0; i < saveCount; ++i) {
+#ifndef DETAIL_DEFINITION_SUPPORTED
+        QContact contact = createContact("Groupedsave", QString::number(i), QString::number(5554500 + i));
+#else
+        QContact contact = createContact(nameDef, "Groupedsave", QString::number(i), QString::number(5554500 + i));
+#endif
+        QContactSaveRequest *save = new QContactSaveRequest;
+        save->setManager(&m);
+        save->setContacts(QList<QContact>() << (i == failingIndex ? removed : contact));
+        saves.append(save);
+    }
+
+    QSignalSpy spyCA(&m, contactsAddedSignal);
+    QVERIFY(blocker.start());
+    foreach (QContactSaveRequest *save, saves) {
+        QVERIFY(save->start());
+    }
+    QVERIFY(blocker.waitForFinished());
+    QCOMPARE(blocker.error(), QContactManager::NoError);
+
+    // Only the failing request reports an error; the others are committed
+    QList<QContactIdType> savedIds;
+    for (int i = 0; i < saveCount; ++i) {
+        QContactSaveRequest *save = saves.at(i);
+        QVERIFY(save->waitForFinished());
+        if (i == failingIndex) {
+            QVERIFY(save->error() != QContactManager::NoError);
+            QVERIFY(save->errorMap().contains(0));
+        } else {
+            QCOMPARE(save->error(), QContactManager::NoError);
+            QVERIFY(save->errorMap().isEmpty());
+            const QContact saved = save->contacts().first();
+            QVERIFY(ContactId::isValid(saved.id()));
+            QCOMPARE(m.contact(retrievalId(saved)).detail<QContactName>().lastName(), QString::number(i));
+            savedIds.append(retrievalId(saved));
+        }
+    }
+    m.contact(retrievalId(removed));
+    QCOMPARE(m.error(), QContactManager::DoesNotExistError);
+
+    // The queued saves are committed together, and reported in a single signal
+    QTRY_VERIFY(spyCA.count() > 0);
+    QTest::qWait(500);
+    int reportingSignals = 0;
+    for (int i = 0; i < spyCA.count(); ++i) {
+        const QList<QContactIdType> addedIds = spyCA.at(i).at(0).value<QList<QContactIdType> >();
+        bool reported = false;
+        foreach (const QContactIdType &id, savedIds) {
+            if (addedIds.contains(id)) {
+                reported = true;
+                break;
+            }
+        }
+        if (reported) {
+            ++reportingSignals;
+            foreach (const QContactIdType &id, savedIds)
+                QVERIFY(addedIds.contains(id));
+        }
+    }
+    QCOMPARE(reportingSignals, 1);
+
+    foreach (const QContact &contact, blocker.contacts()) {
+        savedIds.append(removalId(contact));
+    }
+    qDeleteAll(saves);
+    QVERIFY(m.removeContacts(savedIds));
+}
+
+void tst_QContactManager::cachedQueries()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+    // Filters of the same shape share a prepared statement, whatever their values and page size
+    int hits = -1;
+    int misses = -1;
+    for (int i = 0; i < 3; ++i) {
+        QContactDetailFilter filter;
+        setFilterDetail<QContactName>(filter, QContactName::FieldFirstName);
+        filter.setValue(QString::fromLatin1("Cachedquery%1").arg(i));
+        filter.setMatchFlags(QContactFilter::MatchStartsWith);
+
+#ifdef USING_QTPIM
+        QContactIdFetchRequest request;
+#else
+        QContactLocalIdFetchRequest request;
+#endif
+        request.setManager(&m);
+        request.setFilter(filter);
+        request.setProperty(QContactAbstractRequest__PageSize, 5 + i);
+        QVERIFY(request.start());
+        QVERIFY(request.waitForFinished());
+        QCOMPARE(request.error(), QContactManager::NoError);
+
+        const QVariant requestHits(request.property(QContactAbstractRequest__CachedQueryHits));
+        const QVariant requestMisses(request.property(QContactAbstractRequest__CachedQueryMisses));
+        QVERIFY(requestHits.isValid());
+        QVERIFY(requestMisses.isValid());
+        if (i > 0) {
+            QCOMPARE(requestHits.toInt(), hits + 1);
+            QCOMPARE(requestMisses.toInt(), misses);
+        }
+        hits = requestHits.toInt();
+        misses = requestMisses.toInt();
+    }
+}
+
+void tst_QContactManager::destroyedRequests()
+{
+    QContactManager m(DEFAULT_MANAGER);
+
+    const int count = m.contactIds().count();
+
+    // Requests destroyed while their jobs execute do not receive the results of those jobs
+    for (int i = 0; i < 10; ++i) {
+        QContactFetchRequest *fetch = new QContactFetchRequest;
+        fetch->setManager(&m);
+        QVERIFY(fetch->start());
+
+#ifdef USING_QTPIM
+        QContactIdFetchRequest *changes = new QContactIdFetchRequest;
+#else
+        QContactLocalIdFetchRequest *changes = new QContactLocalIdFetchRequest;
+#endif
+        changes->setManager(&m);
+        changes->setProperty(QContactIdFetchRequest__ChangesToken, QString());
+        QVERIFY(changes->start());
+
+        QTest::qWait(i);
+        delete fetch;
+        delete changes;
+    }
+
+    // The engine remains usable after the destroyed jobs have finished
+    QContactFetchRequest request;
+    request.setManager(&m);
+    QVERIFY(request.start());
+    QVERIFY(request.waitForFinished());
+    QCOMPARE(request.error(), QContactManager::NoError);
+    QCOMPARE(request.contacts().count(), count);
+}
+
 QTEST_MAIN(tst_QContactManager)
 #include "tst_qcontactmanager.moc"
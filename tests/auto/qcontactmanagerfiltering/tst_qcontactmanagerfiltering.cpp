@@ -206,6 +206,9 @@ private slots:
     void multiSorting();
     void multiSorting_data();
 
+    void sortKeySorting();
+    void sortKeySorting_data();
+
     void invalidFiltering_data();
     void invalidFiltering();
 
@@ -379,6 +382,16 @@ void tst_QContactManagerFiltering::detailStringFiltering_data()
         newMRow("Name == ARON, ends, case sensitive", manager) << manager << name << firstname << QVariant("ARON") << (int)(QContactFilter::MatchEndsWith | QContactFilter::MatchCaseSensitive) << es;
         newMRow("Last name == n, ends", manager) << manager << name << lastname << QVariant("n") << (int)(QContactFilter::MatchEndsWith) << "abc";
 
+        // ITU-T standard keypad collation: Aaron = 22766, Bob = 262, Boris = 26747
+        newMRow("Name == 22766, keypad", manager) << manager << name << firstname << QVariant("22766") << (int)(QContactFilter::MatchKeypadCollation) << "a";
+        newMRow("Name == 2276, keypad", manager) << manager << name << firstname << QVariant("2276") << (int)(QContactFilter::MatchKeypadCollation) << es;
+        newMRow("Name == 26, begins, keypad", manager) << manager << name << firstname << QVariant("26") << (int)(QContactFilter::MatchStartsWith | QContactFilter::MatchKeypadCollation) << "bc";
+        newMRow("Name == Bo, begins, keypad", manager) << manager << name << firstname << QVariant("Bo") << (int)(QContactFilter::MatchStartsWith | QContactFilter::MatchKeypadCollation) << "bc";
+        newMRow("Name == 674, contains, keypad", manager) << manager << name << firstname << QVariant("674") << (int)(QContactFilter::MatchContains | QContactFilter::MatchKeypadCollation) << "c";
+        newMRow("Name == -, begins, keypad", manager) << manager << name << firstname << QVariant("-") << (int)(QContactFilter::MatchStartsWith | QContactFilter::MatchKeypadCollation) << es;
+        newMRow("Name == Zhe, begins, keypad", manager) << manager << name << firstname << QVariant(QString(QChar(0x0416))) << (int)(QContactFilter::MatchStartsWith | QContactFilter::MatchKeypadCollation) << es;
+        newMRow("Name == -, contains, keypad", manager) << manager << name << firstname << QVariant("-") << (int)(QContactFilter::MatchContains | QContactFilter::MatchKeypadCollation) << es;
+
         newMRow("Name == Aaron, fixed", manager) << manager << name << firstname << QVariant("Aaron") << (int)(QContactFilter::MatchFixedString) << "a";
         newMRow("Name == aaron, fixed", manager) << manager << name << firstname << QVariant("aaron") << (int)(QContactFilter::MatchFixedString) << "a";
         newMRow("Name == Aaron, fixed, case sensitive", manager) << manager << name << firstname << QVariant("Aaron") << (int)(QContactFilter::MatchFixedString | QContactFilter::MatchCaseSensitive) << "a";
@@ -565,6 +578,12 @@ void tst_QContactManagerFiltering::detailPhoneNumberFiltering_data()
         QTest::newRow("ab phone starts hyphen space") << manager << phoneDef << phoneField << QVariant(QString("5 55-")) << (int)(QContactFilter::MatchPhoneNumber | QContactFilter::MatchStartsWith) << "ab";
         QTest::newRow("ab phone starts hyphen space brackets") << manager << phoneDef << phoneField << QVariant(QString("5 (55)-")) << (int)(QContactFilter::MatchPhoneNumber | QContactFilter::MatchStartsWith) << "ab";
         QTest::newRow("ab phone starts hyphen space brackets plus") << manager << phoneDef << phoneField << QVariant(QString("+5 (55)-")) << (int)(QContactFilter::MatchPhoneNumber | QContactFilter::MatchStartsWith) << "ab";
+
+        // then match each of aaron and bob via ends with
+        QTest::newRow("a phone ends nospace") << manager << phoneDef << phoneField << QVariant(QString("1212")) << (int)(QContactFilter::MatchPhoneNumber | QContactFilter::MatchEndsWith) << "a";
+        QTest::newRow("a phone ends hyphen") << manager << phoneDef << phoneField << QVariant(QString("5-1212")) << (int)(QContactFilter::MatchPhoneNumber | QContactFilter::MatchEndsWith) << "a";
+        QTest::newRow("b phone ends space") << manager << phoneDef << phoneField << QVariant(QString("34 56")) << (int)(QContactFilter::MatchPhoneNumber | QContactFilter::MatchEndsWith) << "b";
+        QTest::newRow("no phone ends") << manager << phoneDef << phoneField << QVariant(QString("9999")) << (int)(QContactFilter::MatchPhoneNumber | QContactFilter::MatchEndsWith) << "";
     }
 }
 
@@ -2430,6 +2449,101 @@ void tst_QContactManagerFiltering::convenienceFiltering()
     QCOMPARE(resultString, expected);
 }
 
+void tst_QContactManagerFiltering::sortKeySorting_data()
+{
+    QTest::addColumn<QContactManager *>("cm");
+    QTest::addColumn<int>("directioni");
+    QTest::addColumn<int>("blankpolicyi");
+    QTest::addColumn<int>("casesensitivityi");
+    QTest::addColumn<QString>("expected");
+
+    int asc = Qt::AscendingOrder;
+    int desc = Qt::DescendingOrder;
+    int bll = QContactSortOrder::BlanksLast;
+    int blf = QContactSortOrder::BlanksFirst;
+    int cs = Qt::CaseSensitive;
+    int ci = Qt::CaseInsensitive;
+
+    for (int i = 0; i < managers.size(); i++) {
+        QContactManager *manager = managers.at(i);
+
+        // accents and case are ignored; g and h have identical names, so they are ordered by id in either direction
+        newMRow("ascending, blanks last", manager) << manager << asc << bll << ci << "fcabghed";
+        newMRow("ascending, blanks first", manager) << manager << asc << blf << ci << "dfcabghe";
+        newMRow("descending, blanks last", manager) << manager << desc << bll << ci << "eghbacfd";
+        newMRow("descending, blanks first", manager) << manager << desc << blf << ci << "deghbacf";
+
+        // case sensitive sorting uses the binary order of the stored names, which the case folded
+        // sort keys cannot reproduce: upper case names precede lower case, and accented names follow both
+        newMRow("ascending, blanks last, case sensitive", manager) << manager << asc << bll << cs << "cghefbad";
+        newMRow("ascending, blanks first, case sensitive", manager) << manager << asc << blf << cs << "dcghefba";
+        newMRow("descending, blanks last, case sensitive", manager) << manager << desc << bll << cs << "abfeghcd";
+        newMRow("descending, blanks first, case sensitive", manager) << manager << desc << blf << cs << "dabfeghc";
+    }
+}
+
+void tst_QContactManagerFiltering::sortKeySorting()
+{
+    QFETCH(QContactManager*, cm);
+    QFETCH(int, directioni);
+    QFETCH(int, blankpolicyi);
+    QFETCH(int, casesensitivityi);
+    QFETCH(QString, expected);
+
+    const QString marker(QString::fromLatin1("Sortkeytest"));
+
+    QStringList firstNames;
+    firstNames << QString::fromUtf8("\xc3\x89mile") << QString::fromLatin1("emma") << QString::fromLatin1("Eliza")
+               << QString() << QString::fromLatin1("Zoe") << QString::fromLatin1("adam")
+               << QString::fromLatin1("Tie") << QString::fromLatin1("Tie");
+
+    QList<QContactIdType> contacts;
+    foreach (const QString &firstName, firstNames) {
+        QContact contact;
+        QContactName name;
+        if (!firstName.isEmpty())
+            name.setFirstName(firstName);
+        name.setLastName(marker);
+        contact.saveDetail(&name);
+        QVERIFY(cm->saveContact(&contact));
+        contacts.append(ContactId::apiId(contact));
+    }
+
+    QContactDetailFilter markerFilter;
+    setFilterDetail<QContactName>(markerFilter, QContactName::FieldLastName);
+    markerFilter.setValue(marker);
+    markerFilter.setMatchFlags(QContactFilter::MatchExactly);
+
+    QContactSortOrder s;
+    setSortDetail<QContactName>(s, QContactName::FieldFirstName);
+    s.setDirection((Qt::SortOrder)directioni);
+    s.setBlankPolicy((QContactSortOrder::BlankPolicy)blankpolicyi);
+    s.setCaseSensitivity((Qt::CaseSensitivity)casesensitivityi);
+
+    QList<QContactIdType> ids = cm->contactIds(markerFilter, QList<QContactSortOrder>() << s);
+    QString output = convertIds(contacts, ids, 'a', 'h');
+
+    // a sort order without an explicit case sensitivity is case sensitive
+    QContactSortOrder d;
+    setSortDetail<QContactName>(d, QContactName::FieldFirstName);
+    d.setDirection((Qt::SortOrder)directioni);
+    d.setBlankPolicy((QContactSortOrder::BlankPolicy)blankpolicyi);
+    QList<QContactIdType> defaultIds = cm->contactIds(markerFilter, QList<QContactSortOrder>() << d);
+
+    // the fetched contacts must be in the same order as the ids
+    QList<QContact> fetched = cm->contacts(markerFilter, QList<QContactSortOrder>() << s);
+    QCOMPARE(fetched.size(), ids.size());
+    for (int i = 0; i < fetched.size(); ++i) {
+        QVERIFY(ContactId::apiId(fetched.at(i)) == ids.at(i));
+    }
+
+    cm->removeContacts(contacts, 0);
+
+    QCOMPARE(output, expected);
+    if (casesensitivityi == Qt::CaseSensitive)
+        QCOMPARE(defaultIds, ids);
+}
+
 void tst_QContactManagerFiltering::invalidFiltering_data()
 {
     QTest::addColumn<QContactManager*>("cm");
@@ -2586,6 +2700,89 @@ void tst_QContactManagerFiltering::fetchHint()
         // other details are not necessarily returned.
         QVERIFY(a.details().size() >= b.details().size());
     }
+
+    // reading all detail tables in a single query should produce identical results.
+    QContactFetchHint sdqh; // single detail query hint
+    sdqh.setOptimizationHints(QContactFetchHint__SingleDetailQuery);
+    QList<QContact> sdqhContacts = cm->contacts(nameSort, sdqh);
+    QCOMPARE(sdqhContacts.size(), allContacts.size());
+    for (int i = 0; i < allContacts.size(); ++i) {
+        QContact a = allContacts.at(i);
+        QContact b = sdqhContacts.at(i);
+
+        QVERIFY(a.id() == b.id());
+        QCOMPARE(a.details().size(), b.details().size());
+        QVERIFY(a == b);
+    }
+
+    // and the detail definitions hint should still be honoured.
+#ifdef USING_QTPIM
+    sdqh.setDetailTypesHint(defs);
+#else
+    sdqh.setDetailDefinitionsHint(defs);
+#endif
+    sdqhContacts = cm->contacts(nameSort, sdqh);
+    QCOMPARE(sdqhContacts.size(), ddhContacts.size());
+    for (int i = 0; i < ddhContacts.size(); ++i) {
+        QVERIFY(ddhContacts.at(i) == sdqhContacts.at(i));
+    }
+
+    // details of the same type should be returned in the order they were saved, by either path.
+    QStringList numbers;
+    numbers << QString::fromLatin1("5551111") << QString::fromLatin1("5552222") << QString::fromLatin1("5553333");
+    QStringList addresses;
+    addresses << QString::fromLatin1("c@example.com") << QString::fromLatin1("a@example.com") << QString::fromLatin1("b@example.com");
+    QContact ordered;
+    for (int i = 0; i < numbers.count(); ++i) {
+        // interleave the types, so that neither is stored contiguously
+        QContactPhoneNumber phn;
+        phn.setNumber(numbers.at(i));
+        ordered.saveDetail(&phn);
+        QContactEmailAddress email;
+        email.setEmailAddress(addresses.at(i));
+        ordered.saveDetail(&email);
+    }
+    QVERIFY(cm->saveContact(&ordered));
+    const QContactIdType orderedId(ContactId::apiId(ordered));
+    QContactFetchHint defaultHint;
+    QList<QContactFetchHint> orderHints;
+    orderHints << defaultHint << sdqh;
+    foreach (const QContactFetchHint &hint, orderHints) {
+        QContact fetched = cm->contact(orderedId, hint);
+        QStringList fetchedNumbers;
+        foreach (const QContactPhoneNumber &phn, fetched.details<QContactPhoneNumber>())
+            fetchedNumbers.append(phn.number());
+        QCOMPARE(fetchedNumbers, numbers);
+        QStringList fetchedAddresses;
+        foreach (const QContactEmailAddress &email, fetched.details<QContactEmailAddress>())
+            fetchedAddresses.append(email.emailAddress());
+        QCOMPARE(fetchedAddresses, addresses);
+    }
+    QVERIFY(cm->removeContact(orderedId));
+
+    // paging through the results with continuation tokens should visit every contact in order.
+    QContactFetchHint pageHint;
+    pageHint.setMaxCountHint(2);
+    QList<QContact> pagedContacts;
+    QString continuation;
+    do {
+        QContactFetchRequest request;
+        request.setManager(cm);
+        request.setSorting(nameSort);
+        request.setFetchHint(pageHint);
+        if (!continuation.isEmpty())
+            request.setProperty(QContactAbstractRequest__ContinuationToken, continuation);
+        QVERIFY(request.start());
+        QVERIFY(request.waitForFinished());
+        QCOMPARE(request.error(), QContactManager::NoError);
+        QVERIFY(request.contacts().size() <= pageHint.maxCountHint());
+        pagedContacts.append(request.contacts());
+        continuation = request.property(QContactAbstractRequest__NextContinuationToken).toString();
+    } while (!continuation.isEmpty() && pagedContacts.size() <= allContacts.size());
+    QCOMPARE(pagedContacts.size(), allContacts.size());
+    for (int i = 0; i < allContacts.size(); ++i) {
+        QVERIFY(pagedContacts.at(i).id() == allContacts.at(i).id());
+    }
 }
 
 
@@ -3,6 +3,8 @@ include(../../../config.pri)
 TEMPLATE = app
 TARGET = fetchtimes
 
+INCLUDEPATH += ../../../src/extensions
+
 SOURCES = main.cpp
 
 equals(QT_MAJOR_VERSION, 4): target.path = /opt/tests/qtcontacts-sqlite
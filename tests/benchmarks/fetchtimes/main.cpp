@@ -29,8 +29,12 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
  */
 
+#include "qtcontacts-extensions.h"
+
 #include <QContactManager>
 #include <QContactFetchRequest>
+#include <QContactFetchByIdRequest>
+#include <QContactSaveRequest>
 #include <QContactFavorite>
 #include <QContactName>
 #include <QContactEmailAddress>
@@ -285,6 +289,82 @@ int main(int argc, char  *argv[])
         qint64 elapsed = timer.elapsed();
         qDebug() << i << ": Max count fetch completed in" << elapsed << "ms";
     }
+
+    // Perform a lookup by id concurrently with a full fetch
+    QContactFetchRequest fullRequest;
+    fullRequest.setManager(&manager);
+
+    QContactFetchByIdRequest lookupRequest;
+    lookupRequest.setManager(&manager);
+    if (!request.contacts().isEmpty()) {
+#ifdef USING_QTPIM
+        lookupRequest.setIds(QList<QContactId>() << request.contacts().first().id());
+#else
+        lookupRequest.setLocalIds(QList<QContactLocalId>() << request.contacts().first().localId());
+#endif
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        QElapsedTimer timer;
+        timer.start();
+        fullRequest.start();
+        lookupRequest.start();
+        lookupRequest.waitForFinished();
+        qint64 lookupElapsed = timer.elapsed();
+        fullRequest.waitForFinished();
+
+        qint64 elapsed = timer.elapsed();
+        qDebug() << i << ": Concurrent lookup completed in" << lookupElapsed << "ms, full fetch in" << elapsed << "ms";
+    }
+
+    // Queue many small saves together, as a sync burst would
+    {
+        const int saveCount = 100;
+        QList<QContactSaveRequest *> saveRequests;
+        for (int i = 0; i < saveCount; ++i) {
+            QContactSaveRequest *saveRequest = new QContactSaveRequest;
+            saveRequest->setManager(&manager);
+            saveRequest->setContacts(QList<QContact>() << generateContact());
+            saveRequests.append(saveRequest);
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        foreach (QContactSaveRequest *saveRequest, saveRequests) {
+            saveRequest->start();
+        }
+
+        // Requests complete in order, so the time each completes approximates its end-to-end latency
+        qint64 totalLatency = 0;
+        qint64 maximumLatency = 0;
+        foreach (QContactSaveRequest *saveRequest, saveRequests) {
+            saveRequest->waitForFinished();
+            const qint64 latency = timer.elapsed();
+            totalLatency += latency;
+            maximumLatency = qMax(maximumLatency, latency);
+        }
+
+        qint64 elapsed = timer.elapsed();
+        qDebug() << saveCount << "queued saves completed in" << elapsed << "ms (" << ((1000.0 * saveCount) / qMax<qint64>(elapsed, 1))
+                 << "saves per second ), average latency" << (totalLatency / saveCount) << "ms, maximum" << maximumLatency << "ms";
+
+#ifdef USING_QTPIM
+        QList<QContactId> savedIds;
+#else
+        QList<QContactLocalId> savedIds;
+#endif
+        foreach (QContactSaveRequest *saveRequest, saveRequests) {
+            foreach (const QContact &contact, saveRequest->contacts()) {
+#ifdef USING_QTPIM
+                savedIds.append(contact.id());
+#else
+                savedIds.append(contact.localId());
+#endif
+            }
+        }
+        qDeleteAll(saveRequests);
+        manager.removeContacts(savedIds);
+    }
     qint64 asyncTotalElapsed = asyncTotalTimer.elapsed();
 
 
@@ -319,6 +399,7 @@ int main(int argc, char  *argv[])
         syncTimer.start();
         manager.saveContacts(&td);
         ste = syncTimer.elapsed();
+        const qint64 saveElapsed = ste;
         qDebug() << "    saving took" << ste << "milliseconds (" << ((1.0 * ste) / (1.0 * td.size())) << "msec per contact )";
 
         QContactFetchHint fh;
@@ -327,6 +408,13 @@ int main(int argc, char  *argv[])
         ste = syncTimer.elapsed();
         qDebug() << "    reading all (" << readContacts.size() << "), all details, took" << ste << "milliseconds (" << ((1.0 * ste) / (1.0 * td.size())) << "msec per contact )";
 
+        QContactFetchHint sfh;
+        sfh.setOptimizationHints(QContactFetchHint__SingleDetailQuery);
+        syncTimer.start();
+        readContacts = manager.contacts(QContactFilter(), QList<QContactSortOrder>(), sfh);
+        ste = syncTimer.elapsed();
+        qDebug() << "    reading all (" << readContacts.size() << "), all details, single detail query, took" << ste << "milliseconds (" << ((1.0 * ste) / (1.0 * td.size())) << "msec per contact )";
+
 #ifdef USING_QTPIM
         fh.setDetailTypesHint(QList<QContactDetail::DetailType>() << QContactDisplayLabel::Type
                 << QContactName::Type << QContactAvatar::Type
@@ -397,6 +485,28 @@ int main(int argc, char  *argv[])
         manager.removeContacts(idsToRemove);
         ste = syncTimer.elapsed();
         qDebug() << "    removing test data took" << ste << "milliseconds (" << ((1.0 * ste) / (1.0 * td.size())) << "msec per contact )";
+
+        // save the same contacts again in bulk import mode, for comparison
+        QContactSaveRequest importRequest;
+        importRequest.setManager(&manager);
+        importRequest.setContacts(testData.at(i));
+        importRequest.setProperty(QContactSaveRequest__BulkImport, true);
+        syncTimer.start();
+        importRequest.start();
+        importRequest.waitForFinished();
+        ste = syncTimer.elapsed();
+        qDebug() << "    importing took" << ste << "milliseconds (" << ((1.0 * ste) / (1.0 * td.size())) << "msec per contact,"
+                 << ((1.0 * saveElapsed) / (1.0 * qMax<qint64>(ste, 1))) << "times the throughput of saving )";
+
+        idsToRemove.clear();
+        foreach (const QContact &imported, importRequest.contacts()) {
+#ifdef USING_QTPIM
+            idsToRemove.append(imported.id());
+#else
+            idsToRemove.append(imported.localId());
+#endif
+        }
+        manager.removeContacts(idsToRemove);
     }
 
     // these tests are slightly different to those above.  They operate on much smaller
@@ -535,6 +645,7 @@ int main(int argc, char  *argv[])
     syncTimer.start();
     manager.saveContacts(&contactsToAggregate);
     qint64 aggregationElapsed = syncTimer.elapsed();
+    QList<QContact> aggregatedContacts(contactsToAggregate);
     int totalAggregatesInDatabase = manager.contactIds().count();
     qDebug() << "Average time for aggregation of" << contactsToAggregate.size() << "contacts (with" << totalAggregatesInDatabase << "existing in database):" << aggregationElapsed
              << "milliseconds (" << ((1.0 * aggregationElapsed) / (1.0 * contactsToAggregate.size())) << " msec per aggregated contact )";
@@ -562,6 +673,26 @@ int main(int argc, char  *argv[])
     qDebug() << "Average time for aggregation of" << contactsToAggregate.size() << "contacts (with" << totalAggregatesInDatabase << "existing in database):" << aggregationElapsed
              << "milliseconds (" << ((1.0 * aggregationElapsed) / (1.0 * contactsToAggregate.size())) << " msec per aggregated contact )";
 
+    // Removing the aggregated contacts requires each of their aggregates to be regenerated
+    // from the remaining constituents, as when an account is removed.
+    aggregatedContacts.append(contactsToAggregate);
+#ifdef USING_QTPIM
+    QList<QContactId> aggregatedIds;
+    foreach (const QContact &aggregated, aggregatedContacts) {
+        aggregatedIds.append(aggregated.id());
+    }
+#else
+    QList<QContactLocalId> aggregatedIds;
+    foreach (const QContact &aggregated, aggregatedContacts) {
+        aggregatedIds.append(aggregated.localId());
+    }
+#endif
+    syncTimer.start();
+    manager.removeContacts(aggregatedIds);
+    qint64 regenerationElapsed = syncTimer.elapsed();
+    qDebug() << "Average time for removal of" << aggregatedIds.size() << "aggregated contacts, regenerating their aggregates:" << regenerationElapsed
+             << "milliseconds (" << ((1.0 * regenerationElapsed) / (1.0 * aggregatedIds.size())) << " msec per regenerated aggregate )";
+
 
     // The next test is about updating existing contacts, amongst a large set.
     // We're especially interested in presence updates, as these are common.
@@ -863,5 +994,59 @@ int main(int argc, char  *argv[])
 #endif
     manager.removeContacts(morePrefillIds);
 
+    // The final test measures the latency of creating a contact (including finding a
+    // matching aggregate for it) as the number of contacts in the database grows.
+    qDebug() << "\n\nPerforming create latency tests:";
+#ifdef USING_QTPIM
+    QList<QContactId> growthIds;
+#else
+    QList<QContactLocalId> growthIds;
+#endif
+    const int databaseSizes[] = { 5000, 20000, 50000 };
+    for (int i = 0; i < 3; ++i) {
+        qDebug() << "    growing database to" << databaseSizes[i] << "contacts, please wait...";
+        QList<QContact> growthData;
+        while (growthIds.count() + growthData.count() < databaseSizes[i]) {
+            growthData.append(generateContact("test-growth", true));
+        }
+        QContactSaveRequest growthRequest;
+        growthRequest.setManager(&manager);
+        growthRequest.setContacts(growthData);
+        growthRequest.setProperty(QContactSaveRequest__BulkImport, true);
+        growthRequest.start();
+        growthRequest.waitForFinished();
+        foreach (const QContact &grown, growthRequest.contacts()) {
+#ifdef USING_QTPIM
+            growthIds.append(grown.id());
+#else
+            growthIds.append(grown.localId());
+#endif
+        }
+
+#ifdef USING_QTPIM
+        QList<QContactId> createdIds;
+#else
+        QList<QContactLocalId> createdIds;
+#endif
+        qint64 createElapsed = 0;
+        for (int j = 0; j < 100; ++j) {
+            QContact created = generateContact("test-create", true);
+            syncTimer.start();
+            manager.saveContact(&created);
+            createElapsed += syncTimer.elapsed();
+#ifdef USING_QTPIM
+            createdIds.append(created.id());
+#else
+            createdIds.append(created.localId());
+#endif
+        }
+        qDebug() << "    create ( 100 individually ) (with" << growthIds.count() << "existing in database):" << createElapsed
+                 << "milliseconds (" << ((1.0 * createElapsed) / 100.0) << " msec per created contact )";
+        manager.removeContacts(createdIds);
+    }
+
+    qDebug() << "    cleaning up growth data, please wait...";
+    manager.removeContacts(growthIds);
+
     return 0;
 }